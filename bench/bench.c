@@ -0,0 +1,364 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blob.h"
+#include "bitset.h"
+
+/*
+ * Benchmarks for the metadata and allocation hot paths. Every case formats
+ * a fresh blobstore on the device given on the command line, which may be
+ * a regular file or `ram:`, and the results are printed as a single JSON
+ * object.
+ */
+
+#define BENCH_ROUNDS 8
+
+#define BENCH_BLOBS 200
+
+#define BENCH_MAX_THREADS 8
+
+static const char *device_path = BDEV_RAM_PREFIX;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void die(const char *msg) {
+    fprintf(stderr, "bench: %s\n", msg);
+    exit(1);
+}
+
+static void bench_format(bdev_t *dev, blobstore_t *bs, uint64_t size) {
+    if (bdev_open(dev, device_path, size) < 0) die("failed to open device");
+    if (blobstore_init(bs, dev) < 0) die("failed to create blobstore");
+}
+
+static void bench_close(bdev_t *dev, blobstore_t *bs) {
+    blobstore_deinit(bs);
+    bdev_close(dev);
+}
+
+/**
+ * Create and delete `BENCH_BLOBS` blobs per round, committing once per
+ * round, and report the rates.
+ */
+static void bench_create_delete(void) {
+    bdev_t dev;
+    blobstore_t bs;
+    bench_format(&dev, &bs, 1ULL << 30);
+
+    double t_create = 0;
+    double t_delete = 0;
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        double t0 = now();
+        for (int i = 0; i < BENCH_BLOBS; i++) {
+            if (blobstore_create_blob(&bs, 16) < 0) die("failed to create blob");
+        }
+        if (blobstore_commit(&bs) < 0) die("failed to commit");
+
+        double t1 = now();
+        while (bs.head) {
+            if (blobstore_delete_blob(&bs, bs.head) < 0) die("failed to delete blob");
+        }
+        if (blobstore_commit(&bs) < 0) die("failed to commit");
+
+        t_create += t1 - t0;
+        t_delete += now() - t1;
+    }
+
+    double n = (double) BENCH_ROUNDS * BENCH_BLOBS;
+    printf("  \"create_delete\": {\"blobs\": %d, \"create_per_sec\": %.0f, \"delete_per_sec\": %.0f},\n",
+        BENCH_ROUNDS * BENCH_BLOBS, n / t_create, n / t_delete);
+    bench_close(&dev, &bs);
+}
+
+/**
+ * Time a clean and a recovering `blobstore_open` of a store with `n_blobs`
+ * blobs, each with one allocated cluster in eight, on a device of
+ * `n_clusters` clusters.
+ */
+static void bench_open_case(size_t n_blobs, uint64_t n_clusters, int last) {
+    bdev_t dev;
+    blobstore_t bs;
+    bench_format(&dev, &bs, n_clusters << 20);
+
+    uint64_t cluster_size = 1ULL << bs.page_shift << bs.cluster_shift;
+    uint32_t blob_clusters = (n_clusters / 2) / n_blobs;
+    void *buf = aligned_alloc(4096, 4096);
+    memset(buf, 1, 4096);
+    for (size_t i = 0; i < n_blobs; i++) {
+        if (blobstore_create_blob(&bs, blob_clusters) < 0) die("failed to create blob");
+        for (uint32_t c = 0; c < blob_clusters; c += 8) {
+            if (blob_write(&bs, bs.head, buf, c * cluster_size, 4096) < 0) die("failed to write blob");
+        }
+    }
+    if (blobstore_commit(&bs) < 0) die("failed to commit");
+
+    /*
+     * `bs` is abandoned without a shutdown, as in a crash, so the first open
+     * has to recover. Shutting that one down leaves a clean store.
+     */
+    blobstore_t recovered;
+    double t0 = now();
+    if (blobstore_open(&recovered, &dev) < 0) die("failed to open blobstore");
+    double t_recover = now() - t0;
+    blobstore_deinit(&recovered);
+
+    t0 = now();
+    if (blobstore_open(&bs, &dev) < 0) die("failed to open blobstore");
+    double t_clean = now() - t0;
+
+    printf("    {\"blobs\": %zu, \"clusters\": %lu, \"clean_ms\": %.3f, \"recover_ms\": %.3f}%s\n",
+        n_blobs, n_clusters, t_clean * 1e3, t_recover * 1e3, last ? "": ",");
+    free(buf);
+    bench_close(&dev, &bs);
+}
+
+static void bench_open(void) {
+    static const size_t blobs[] = {100, 1000, 2000};
+    static const uint64_t clusters[] = {1 << 12, 1 << 14, 1 << 15};
+
+    printf("  \"open\": [\n");
+    for (size_t i = 0; i < 3; i++) {
+        for (size_t j = 0; j < 3; j++) {
+            bench_open_case(blobs[i], clusters[j], i == 2 && j == 2);
+        }
+    }
+    printf("  ],\n");
+}
+
+/**
+ * Measure `bitset_alloc` of a single bit on a bitset filled at random to
+ * various levels. Each allocated bit is freed again to keep the fill level.
+ */
+static void bench_bitset_alloc(void) {
+    static const int fills[] = {0, 50, 90, 99};
+    const size_t capacity = 1 << 20;
+    const size_t n_ops = 1 << 20;
+
+    printf("  \"bitset_alloc\": [\n");
+    for (size_t f = 0; f < 4; f++) {
+        bitset_t set;
+        if (bitset_init(&set, capacity) < 0) die("failed to create bitset");
+
+        srand(1);
+        while (bitset_size(&set) < capacity * fills[f] / 100) {
+            bitset_set(&set, ((size_t) rand() << 16 ^ rand()) % capacity, 1);
+        }
+
+        double t0 = now();
+        for (size_t i = 0; i < n_ops; i++) {
+            uint32_t bit;
+            if (bitset_alloc(&set, &bit, 1) < 0) die("failed to allocate");
+            bitset_free(&set, &bit, 1);
+        }
+        double t = now() - t0;
+
+        printf("    {\"fill_pct\": %d, \"ns_per_alloc\": %.1f}%s\n", fills[f], t * 1e9 / n_ops, f == 3 ? "": ",");
+        bitset_deinit(&set);
+    }
+    printf("  ],\n");
+}
+
+/**
+ * Measure `bitset_alloc_extents` on a bitset whose clear bits are all in runs
+ * of two, so that a best fit cannot stop at the first run it finds. Each
+ * allocation is freed again to keep the layout.
+ */
+static void bench_bitset_alloc_extents(void) {
+    static const size_t sizes[] = {1, 8};
+    const size_t capacity = 1 << 22;
+    const size_t n_ops = 1 << 14;
+
+    bitset_t set;
+    if (bitset_init(&set, capacity) < 0) die("failed to create bitset");
+    for (size_t i = 2; i < capacity; i += 3) {
+        bitset_set(&set, i, 1);
+    }
+
+    /* The first allocation builds the run index, which is not timed. */
+    extent_t first;
+    if (bitset_alloc_extents(&set, 1, capacity, &first, 1) < 0) die("failed to allocate");
+    bitset_free_extents(&set, &first, 1);
+
+    printf("  \"bitset_alloc_extents\": [\n");
+    for (size_t s = 0; s < 2; s++) {
+        double t0 = now();
+        for (size_t i = 0; i < n_ops; i++) {
+            extent_t extents[8];
+            int n_extents = bitset_alloc_extents(&set, sizes[s], capacity, extents, 8);
+            if (n_extents < 0) die("failed to allocate");
+            bitset_free_extents(&set, extents, n_extents);
+        }
+        double t = now() - t0;
+
+        printf("    {\"bits\": %zu, \"ns_per_alloc\": %.1f}%s\n", sizes[s], t * 1e9 / n_ops, s == 1 ? "": ",");
+    }
+    printf("  ],\n");
+    bitset_deinit(&set);
+}
+
+typedef struct read_worker {
+    blobstore_t *bs;
+    blob_t *blob;
+    size_t n_ops;
+    unsigned int seed;
+} read_worker_t;
+
+static void *read_worker_run(void *arg) {
+    read_worker_t *w = (read_worker_t*) arg;
+    uint64_t n_blocks = (uint64_t) w->blob->n_clusters << w->bs->cluster_shift;
+    channel_t ch;
+    if (channel_init(&ch, w->bs) < 0) die("failed to create channel");
+    void *buf = aligned_alloc(4096, 4096);
+
+    for (size_t i = 0; i < w->n_ops; i++) {
+        uint64_t offset = (rand_r(&w->seed) % n_blocks) << w->bs->page_shift;
+        if (channel_read(&ch, w->blob, buf, offset, 4096) < 0) die("failed to read blob");
+    }
+
+    free(buf);
+    channel_deinit(&ch);
+    return NULL;
+}
+
+/**
+ * Read random blocks of one blob from several threads, each through its own
+ * channel, and report the total rate for each number of threads.
+ */
+static void bench_read_threads(void) {
+    bdev_t dev;
+    blobstore_t bs;
+    bench_format(&dev, &bs, 1ULL << 30);
+
+    const uint32_t blob_clusters = 64;
+    const size_t n_ops = 1 << 16;
+    uint64_t cluster_size = 1ULL << bs.page_shift << bs.cluster_shift;
+    void *buf = aligned_alloc(4096, cluster_size);
+    memset(buf, 1, cluster_size);
+    if (blobstore_create_blob(&bs, blob_clusters) < 0) die("failed to create blob");
+    for (uint32_t c = 0; c < blob_clusters; c++) {
+        if (blob_write(&bs, bs.head, buf, c * cluster_size, cluster_size) < 0) die("failed to write blob");
+    }
+    if (blobstore_commit(&bs) < 0) die("failed to commit");
+
+    printf("  \"read_threads\": [\n");
+    for (size_t n_threads = 1; n_threads <= BENCH_MAX_THREADS; n_threads *= 2) {
+        pthread_t threads[BENCH_MAX_THREADS];
+        read_worker_t workers[BENCH_MAX_THREADS];
+
+        double t0 = now();
+        for (size_t t = 0; t < n_threads; t++) {
+            workers[t] = (read_worker_t) {&bs, bs.head, n_ops, t + 1};
+            if (pthread_create(&threads[t], NULL, read_worker_run, &workers[t]) != 0) die("failed to start thread");
+        }
+        for (size_t t = 0; t < n_threads; t++) {
+            pthread_join(threads[t], NULL);
+        }
+        double t = now() - t0;
+
+        printf("    {\"threads\": %zu, \"reads_per_sec\": %.0f}%s\n", n_threads, n_threads * n_ops / t,
+            n_threads == BENCH_MAX_THREADS ? "": ",");
+    }
+    printf("  ],\n");
+
+    free(buf);
+    bench_close(&dev, &bs);
+}
+
+/**
+ * Grow blobs with random single-cluster writes while deleting and
+ * recreating random blobs, then report how scattered the blobs and the
+ * free space have become.
+ */
+static void bench_fragmentation(void) {
+    bdev_t dev;
+    blobstore_t bs;
+    bench_format(&dev, &bs, 4ULL << 30);
+
+    const size_t n_blobs = 64;
+    const uint32_t blob_clusters = 64;
+    uint64_t cluster_size = 1ULL << bs.page_shift << bs.cluster_shift;
+    void *buf = aligned_alloc(4096, 4096);
+    memset(buf, 1, 4096);
+
+    blob_t *blobs[64];
+    for (size_t i = 0; i < n_blobs; i++) {
+        if (blobstore_create_blob(&bs, blob_clusters) < 0) die("failed to create blob");
+        blobs[i] = bs.head;
+    }
+
+    srand(2);
+    for (int op = 0; op < 20000; op++) {
+        size_t i = rand() % n_blobs;
+        if (rand() % 64 == 0) {
+            if (blobstore_delete_blob(&bs, blobs[i]) < 0) die("failed to delete blob");
+            if (blobstore_create_blob(&bs, blob_clusters) < 0) die("failed to create blob");
+            blobs[i] = bs.head;
+            continue;
+        }
+
+        uint64_t offset = (rand() % blob_clusters) * cluster_size;
+        if (blob_write(&bs, blobs[i], buf, offset, 4096) < 0) die("failed to write blob");
+        if (op % 256 == 0 && blobstore_commit(&bs) < 0) die("failed to commit");
+    }
+    if (blobstore_flush(&bs) < 0) die("failed to flush");
+
+    size_t n_extents = 0;
+    size_t n_allocated = 0;
+    for (size_t i = 0; i < n_blobs; i++) {
+        if (blob_load(&bs, blobs[i]) < 0) die("failed to load blob");
+        n_extents += extent_map_size(&blobs[i]->clusters);
+        n_allocated += blobs[i]->n_allocated;
+    }
+
+    size_t n_free_runs = 0;
+    size_t longest = 0;
+    size_t run = 0;
+    size_t capacity = bitset_capacity(&bs.clusters);
+    for (size_t i = 0; i <= capacity; i++) {
+        if (i < capacity && !bitset_get(&bs.clusters, i)) {
+            run++;
+            continue;
+        }
+        if (run) n_free_runs++;
+        if (run > longest) longest = run;
+        run = 0;
+    }
+
+    size_t n_free = capacity - bitset_size(&bs.clusters);
+    printf("  \"fragmentation\": {\"allocated_clusters\": %zu, \"extents\": %zu, \"clusters_per_extent\": %.2f, "
+        "\"free_clusters\": %zu, \"free_runs\": %zu, \"longest_free_run\": %zu}\n",
+        n_allocated, n_extents, n_extents ? (double) n_allocated / n_extents: 0.0,
+        n_free, n_free_runs, longest);
+
+    free(buf);
+    bench_close(&dev, &bs);
+}
+
+int main(int argc, char const *argv[]) {
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [DEVICE]\n", argv[0]);
+        return 1;
+    }
+    if (argc == 2) device_path = argv[1];
+
+    printf("{\n");
+    printf("  \"device\": \"%s\",\n", device_path);
+    bench_create_delete();
+    bench_open();
+    bench_bitset_alloc();
+    bench_bitset_alloc_extents();
+    bench_read_threads();
+    bench_fragmentation();
+    printf("}\n");
+
+    return 0;
+}
@@ -13,6 +13,8 @@ int array_init(array_t *arr, size_t n);
 
 void array_deinit(array_t *arr);
 
+int array_resize(array_t *arr, size_t n);
+
 size_t array_size(array_t *arr);
 
 uint32_t array_get(array_t *arr, size_t i);
@@ -0,0 +1,74 @@
+#ifndef BDEV_H
+#define BDEV_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define BDEV_RAM_PREFIX "ram:"
+
+#define BDEV_RAM_SIZE (1ULL << 30)
+
+#define BDEV_FILE_BLOCK_SIZE 4096
+
+#define BDEV_STRIPE_SIZE (1ULL << 20)
+
+#define BDEV_MAX_MEMBERS 16
+
+struct bdev;
+
+typedef struct bdev_ops {
+    int (*read)(struct bdev *dev, void *buf, size_t len, uint64_t offset);
+    int (*write)(struct bdev *dev, const void *buf, size_t len, uint64_t offset);
+    int (*readv)(struct bdev *dev, const struct iovec *iov, int iovcnt, uint64_t offset);
+    int (*writev)(struct bdev *dev, const struct iovec *iov, int iovcnt, uint64_t offset);
+    int (*flush)(struct bdev *dev);
+    int (*discard)(struct bdev *dev, uint64_t offset, uint64_t len);
+    void (*close)(struct bdev *dev);
+} bdev_ops_t;
+
+typedef struct bdev {
+    const bdev_ops_t *ops;
+    int fd;
+    uint64_t size;
+    uint32_t block_size;
+    uint8_t *data;
+    uint32_t n_members;
+    uint64_t stripe_size;
+    uint64_t member_size;
+    struct bdev *members;
+} bdev_t;
+
+int bdev_open(bdev_t *dev, const char *path, uint64_t size);
+
+int bdev_open_blockdev(bdev_t *dev, const char *path);
+
+int bdev_open_file(bdev_t *dev, const char *path, uint64_t size);
+
+int bdev_open_ram(bdev_t *dev, uint64_t size);
+
+int bdev_open_striped(bdev_t *dev, const char *paths, uint64_t size, uint64_t stripe_size);
+
+void bdev_close(bdev_t *dev);
+
+uint64_t bdev_size(bdev_t *dev);
+
+uint32_t bdev_block_size(bdev_t *dev);
+
+int bdev_read(bdev_t *dev, void *buf, size_t len, uint64_t offset);
+
+int bdev_write(bdev_t *dev, const void *buf, size_t len, uint64_t offset);
+
+int bdev_readv(bdev_t *dev, const struct iovec *iov, int iovcnt, uint64_t offset);
+
+int bdev_writev(bdev_t *dev, const struct iovec *iov, int iovcnt, uint64_t offset);
+
+int bdev_flush(bdev_t *dev);
+
+int bdev_discard(bdev_t *dev, uint64_t offset, uint64_t len);
+
+size_t bdev_map(bdev_t *dev, uint64_t offset, size_t len, uint32_t *member, uint64_t *member_offset);
+
+int bdev_iov_slice(const struct iovec *iov, int iovcnt, size_t skip, size_t len, struct iovec *out);
+
+#endif
@@ -1,29 +1,71 @@
 #ifndef BITSET_H
 #define BITSET_H
 
+#include "extent.h"
+
 #include <stdint.h>
 #include <stddef.h>
 
+#define BITSET_RUN_CLASSES 32
+#define BITSET_FIT_SCAN 32
+
+typedef struct bitset_run {
+    uint32_t start;
+    uint32_t len;
+    uint32_t prev;
+    uint32_t next;
+} bitset_run_t;
+
 typedef struct bitset {
     size_t capacity;
     size_t size;
-    uint32_t *words;
+    size_t cursor;
+    uint64_t *words;
+    uint64_t *full;
+    uint64_t *empty;
+
+    int indexed;
+    bitset_run_t *runs;
+    size_t n_runs;
+    size_t runs_capacity;
+    uint32_t free_runs;
+    uint32_t *slots;
+    size_t n_slots;
+    uint32_t classes[BITSET_RUN_CLASSES];
 } bitset_t;
 
 int bitset_init(bitset_t *set, size_t capacity);
 
+int bitset_grow(bitset_t *set, size_t capacity);
+
 void bitset_deinit(bitset_t *set);
 
 int bitset_get(bitset_t *set, size_t i);
 
 void bitset_set(bitset_t *set, size_t i, int b);
 
+void bitset_set_range(bitset_t *set, size_t start, size_t n, int b);
+
 size_t bitset_capacity(bitset_t *set);
 
 size_t bitset_size(bitset_t *set);
 
+size_t bitset_bytes(bitset_t *set);
+
+void bitset_store(bitset_t *set, void *buf);
+
+void bitset_load(bitset_t *set, const void *buf);
+
 int bitset_alloc(bitset_t *set, uint32_t *arr, size_t n);
 
 void bitset_free(bitset_t *set, uint32_t *arr, size_t n);
 
+int bitset_alloc_extents(bitset_t *set, size_t n, size_t hint, extent_t *extents, size_t max_extents);
+
+size_t bitset_alloc_holes(bitset_t *set, size_t n, extent_t *extents, size_t max_extents);
+
+void bitset_free_extents(bitset_t *set, extent_t *extents, size_t n_extents);
+
+extent_t bitset_next_clear_run(bitset_t *set, size_t i);
+
 #endif
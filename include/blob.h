@@ -2,39 +2,231 @@
 #define BLOB_H
 
 #include "array.h"
+#include "bdev.h"
 #include "bitset.h"
+#include "bufpool.h"
+#include "cache.h"
+#include "extent.h"
+#include "index.h"
+#include "ioq.h"
+#include "journal.h"
 
+#include <pthread.h>
 #include <stdint.h>
+#include <sys/uio.h>
+
+#define BLOBSTORE_QUEUE_DEPTH 128
+
+#define BLOBSTORE_MAP_BUDGET (64UL << 20)
+
+#define BLOBSTORE_JOURNAL_PAGES 2048
+
+#define BLOBSTORE_CACHE_PAGES 2048
+
+#define BLOBSTORE_BUFS 64
+
+#define BLOBSTORE_DISCARD_BATCH 1024
+
+#define BLOBSTORE_MD_EXTENTS 256
+
+#define BLOBSTORE_MD_GROW 64
+
+#define BLOBSTORE_DIR_ROOTS 128
+
+#define BLOB_READ_ONLY 0x1
+
+#define BLOBSTORE_CHECK_THREADS 64
+
+#define BLOBSTORE_FRAG_BUCKETS 32
+
+#define BLOB_DEFRAG_RUNS 16
+
+#define BLOB_DEFRAG_STEP 64
+
+#define CHANNEL_POOL_CLUSTERS 256
+
+#define CHANNEL_POOL_EXTENTS 64
 
 typedef struct blob {
     struct blob *next;
     struct blob *prev;
+    struct blob *lru_next;
+    struct blob *lru_prev;
     uint32_t page_index;
+    uint32_t slot;
     uint8_t uuid[16];
+    uint32_t n_clusters;
+    uint32_t n_allocated;
+    uint32_t flags;
+    int loaded;
+    int referenced;
+    pthread_rwlock_t lock;
+    size_t map_bytes;
     array_t cluster_page_indices;
-    array_t clusters;
+    extent_map_t clusters;
 } blob_t;
 
+struct blobstore;
+
+typedef struct channel {
+    struct blobstore *bs;
+    ioq_t ioq;
+    size_t hint;
+    size_t n_pool;
+    extent_t pool[CHANNEL_POOL_EXTENTS];
+} channel_t;
+
 typedef struct blobstore {
-    int fd;
+    bdev_t *dev;
+    pthread_mutex_t lock;
+    ioq_t ioq;
     uint32_t page_shift;
     uint32_t cluster_shift;
     uint32_t md_shift;
+    uint32_t n_md_extents;
+    map_extent_t md_extents[BLOBSTORE_MD_EXTENTS];
+    int clean;
+    uint32_t bitmap_page;
+    uint32_t bitmap_pages;
+    uint32_t journal_page;
+    uint32_t journal_pages;
+    journal_t journal;
+    cache_t cache;
+    bufpool_t bufs;
+    void *zeros;
+    array_t freeing;
+    array_t discarding;
+    size_t n_discarding;
+    int discard;
+    int flush_data;
     blob_t *head;
+    blob_t *lru_head;
+    blob_t *lru_tail;
+    size_t map_bytes;
+    size_t map_budget;
+    blob_index_t index;
+    uint32_t dir_roots[BLOBSTORE_DIR_ROOTS];
+    array_t dir_pages;
+    array_t dir;
+    bitset_t dir_slots;
     bitset_t md_pages;
     bitset_t clusters;
+    array_t refs;
+    pthread_mutex_t channel_lock;
+    channel_t channel;
 } blobstore_t;
 
+typedef struct blobstore_check {
+    uint64_t n_blobs;
+    uint64_t n_bad_blobs;
+    uint64_t n_double_pages;
+    uint64_t n_leaked_pages;
+    uint64_t n_lost_pages;
+    uint64_t n_double_clusters;
+    uint64_t n_leaked_clusters;
+    uint64_t n_lost_clusters;
+    uint64_t repaired;
+} blobstore_check_t;
+
+/*
+ * Free runs are counted in buckets of length [2^k, 2^(k+1)) clusters.
+ */
+typedef struct blobstore_frag {
+    uint64_t n_free;
+    uint64_t n_free_runs;
+    uint64_t longest_free_run;
+    uint64_t free_runs[BLOBSTORE_FRAG_BUCKETS];
+    uint64_t free_clusters[BLOBSTORE_FRAG_BUCKETS];
+} blobstore_frag_t;
+
+/*
+ * A defragmentation in progress: the clusters of the blob from logical
+ * cluster `lcluster` onwards are still to be moved into the reserved
+ * `target` runs, of which those before `target_pos` are used up.
+ */
+typedef struct blob_defrag {
+    uint8_t uuid[16];
+    uint32_t lcluster;
+    size_t n_target;
+    size_t target_pos;
+    extent_t target[BLOB_DEFRAG_RUNS];
+    uint64_t n_moved;
+} blob_defrag_t;
+
 int blobstore_create_blob(blobstore_t *bs, uint32_t n_clusters);
 
-int blobstore_init(blobstore_t *bs, int fd);
+int blobstore_init(blobstore_t *bs, bdev_t *dev);
 
 void blobstore_deinit(blobstore_t *bs);
 
-int blobstore_open(blobstore_t *bs, int fd);
+int blobstore_open(blobstore_t *bs, bdev_t *dev);
+
+int blobstore_set_queue(blobstore_t *bs, uint32_t depth, int flags);
+
+int blobstore_commit(blobstore_t *bs);
+
+int blobstore_flush(blobstore_t *bs);
+
+void blobstore_discard(blobstore_t *bs);
 
 int blob_nonzero(blob_t *blob, bitset_t *set);
 
 int blobstore_delete_blob(blobstore_t *bs, blob_t *blob);
 
+int blob_load(blobstore_t *bs, blob_t *blob);
+
+void blob_touch(blobstore_t *bs, blob_t *blob);
+
+void blob_unload(blobstore_t *bs, blob_t *blob);
+
+void blobstore_evict(blobstore_t *bs);
+
+void blobstore_set_map_budget(blobstore_t *bs, size_t budget);
+
+void *blobstore_alloc_buf(blobstore_t *bs);
+
+void blobstore_free_buf(blobstore_t *bs, void *buf);
+
+blob_t *blobstore_lookup(blobstore_t *bs, const uint8_t uuid[16]);
+
+int blobstore_check(blobstore_t *bs, int n_threads, int repair, blobstore_check_t *report);
+
+void blobstore_frag(blobstore_t *bs, blobstore_frag_t *frag);
+
+size_t blob_runs(blob_t *blob);
+
+int blob_read(blobstore_t *bs, blob_t *blob, void *buf, uint64_t offset, uint64_t len);
+
+int blob_write(blobstore_t *bs, blob_t *blob, const void *buf, uint64_t offset, uint64_t len);
+
+int blob_readv(blobstore_t *bs, blob_t *blob, const struct iovec *iov, int iovcnt, uint64_t offset);
+
+int blob_writev(blobstore_t *bs, blob_t *blob, const struct iovec *iov, int iovcnt, uint64_t offset);
+
+int blob_unmap(blobstore_t *bs, blob_t *blob, uint64_t offset, uint64_t len);
+
+int blob_resize(blobstore_t *bs, blob_t *blob, uint32_t n_clusters);
+
+int blob_clone(blobstore_t *bs, blob_t *blob);
+
+int blob_snapshot(blobstore_t *bs, blob_t *blob);
+
+int blob_defrag_begin(blobstore_t *bs, blob_t *blob, blob_defrag_t *defrag);
+
+int blob_defrag_step(channel_t *ch, blob_t *blob, blob_defrag_t *defrag, size_t max);
+
+void blob_defrag_end(blobstore_t *bs, blob_defrag_t *defrag);
+
+int channel_init(channel_t *ch, blobstore_t *bs);
+
+void channel_deinit(channel_t *ch);
+
+int channel_read(channel_t *ch, blob_t *blob, void *buf, uint64_t offset, uint64_t len);
+
+int channel_write(channel_t *ch, blob_t *blob, const void *buf, uint64_t offset, uint64_t len);
+
+int channel_readv(channel_t *ch, blob_t *blob, const struct iovec *iov, int iovcnt, uint64_t offset);
+
+int channel_writev(channel_t *ch, blob_t *blob, const struct iovec *iov, int iovcnt, uint64_t offset);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,29 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define BUFPOOL_HUGE_PAGE_SIZE (2UL << 20)
+
+typedef struct bufpool {
+    size_t buf_size;
+    size_t n_bufs;
+    size_t map_size;
+    int huge;
+    uint8_t *base;
+    size_t n_free;
+    void **free;
+    pthread_mutex_t lock;
+} bufpool_t;
+
+int bufpool_init(bufpool_t *pool, size_t buf_size, size_t n_bufs);
+
+void bufpool_deinit(bufpool_t *pool);
+
+void *bufpool_get(bufpool_t *pool);
+
+void bufpool_put(bufpool_t *pool, void *buf);
+
+#endif
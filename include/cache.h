@@ -0,0 +1,42 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "ioq.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct cache_frame {
+    uint32_t index;
+    uint8_t valid;
+    uint8_t referenced;
+    uint8_t dirty;
+    uint8_t pending;
+} cache_frame_t;
+
+typedef struct cache {
+    size_t n_frames;
+    size_t hand;
+    size_t n_dirty;
+    size_t n_pending;
+    size_t map_capacity;
+    int32_t *map;
+    cache_frame_t *frames;
+    uint8_t *pages;
+} cache_t;
+
+int cache_init(cache_t *cache, size_t n_frames);
+
+void cache_deinit(cache_t *cache);
+
+void *cache_lookup(cache_t *cache, uint32_t index);
+
+void *cache_insert(cache_t *cache, uint32_t index);
+
+cache_frame_t *cache_get_frame(cache_t *cache, void *page);
+
+void cache_set_dirty(cache_t *cache, void *page);
+
+int cache_writeback(cache_t *cache, ioq_t *q);
+
+#endif
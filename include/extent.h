@@ -0,0 +1,46 @@
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct extent {
+    uint32_t start;
+    uint32_t len;
+} extent_t;
+
+typedef struct map_extent {
+    uint32_t lcluster;
+    uint32_t pcluster;
+    uint32_t len;
+} map_extent_t;
+
+typedef struct extent_map {
+    size_t size;
+    size_t capacity;
+    map_extent_t *data;
+} extent_map_t;
+
+typedef void (*extent_fn_t)(void *ctx, uint32_t start, uint32_t len);
+
+int extent_map_init(extent_map_t *map);
+
+void extent_map_deinit(extent_map_t *map);
+
+size_t extent_map_size(extent_map_t *map);
+
+map_extent_t *extent_map_get_ref(extent_map_t *map, size_t i);
+
+int extent_map_append(extent_map_t *map, uint32_t lcluster, uint32_t pcluster, uint32_t len);
+
+size_t extent_map_find(extent_map_t *map, uint32_t lcluster);
+
+uint32_t extent_map_lookup(extent_map_t *map, uint32_t lcluster);
+
+int extent_map_insert(extent_map_t *map, uint32_t lcluster, uint32_t pcluster, uint32_t len);
+
+int extent_map_remove(extent_map_t *map, uint32_t lcluster, uint32_t len, extent_fn_t fn, void *ctx);
+
+size_t extent_map_allocated(extent_map_t *map);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct blob;
+
+typedef struct blob_index {
+    size_t capacity;
+    size_t size;
+    struct blob **slots;
+} blob_index_t;
+
+int blob_index_init(blob_index_t *index, size_t capacity);
+
+void blob_index_deinit(blob_index_t *index);
+
+size_t blob_index_size(blob_index_t *index);
+
+int blob_index_insert(blob_index_t *index, struct blob *blob);
+
+struct blob *blob_index_lookup(blob_index_t *index, const uint8_t uuid[16]);
+
+int blob_index_remove(blob_index_t *index, struct blob *blob);
+
+#endif
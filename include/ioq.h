@@ -0,0 +1,66 @@
+#ifndef IOQ_H
+#define IOQ_H
+
+#include "bdev.h"
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#define IOQ_POLL 1
+
+struct ioq_slot;
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+typedef struct ioq {
+    bdev_t *dev;
+    uint32_t n_members;
+    struct ioq *members;
+    int ring_fd;
+    uint32_t depth;
+    uint32_t queued;
+    uint32_t inflight;
+    int error;
+
+    struct ioq_slot *slots;
+    uint32_t *free_slots;
+    uint32_t n_free;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t *sq_mask;
+    uint32_t *sq_array;
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t *cq_mask;
+    struct io_uring_cqe *cqes;
+} ioq_t;
+
+int ioq_init(ioq_t *q, bdev_t *dev, uint32_t depth, int flags);
+
+void ioq_deinit(ioq_t *q);
+
+int ioq_read(ioq_t *q, void *buf, size_t len, uint64_t offset);
+
+int ioq_write(ioq_t *q, const void *buf, size_t len, uint64_t offset);
+
+int ioq_readv(ioq_t *q, const struct iovec *iov, int iovcnt, uint64_t offset);
+
+int ioq_writev(ioq_t *q, const struct iovec *iov, int iovcnt, uint64_t offset);
+
+int ioq_submit(ioq_t *q);
+
+int ioq_wait(ioq_t *q);
+
+int ioq_flush(ioq_t *q);
+
+#endif
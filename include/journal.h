@@ -0,0 +1,30 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "cache.h"
+#include "ioq.h"
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define JOURNAL_TX_PAGES 1018
+
+typedef struct journal {
+    ioq_t *ioq;
+    uint32_t start_page;
+    uint32_t n_pages;
+    uint32_t head;
+    uint64_t sequence;
+} journal_t;
+
+int journal_init(journal_t *j, ioq_t *ioq, uint32_t start_page, uint32_t n_pages);
+
+int journal_format(journal_t *j);
+
+int journal_replay(journal_t *j);
+
+int journal_commit(journal_t *j, cache_t *cache);
+
+int journal_checkpoint(journal_t *j, cache_t *cache);
+
+#endif
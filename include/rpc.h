@@ -0,0 +1,118 @@
+#ifndef RPC_H
+#define RPC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define RPC_MAGIC 0x53425052
+
+#define RPC_SOCKET_PATH "/run/blobstore.sock"
+
+#define RPC_MAX_IO (1UL << 20)
+
+typedef enum rpc_op {
+    RPC_OP_CREATE = 1,
+    RPC_OP_DELETE,
+    RPC_OP_RESIZE,
+    RPC_OP_CLONE,
+    RPC_OP_SNAPSHOT,
+    RPC_OP_INFO,
+    RPC_OP_LIST,
+    RPC_OP_STATS,
+    RPC_OP_READ,
+    RPC_OP_WRITE,
+    RPC_OP_CHECK,
+    RPC_OP_FRAG,
+    RPC_OP_DEFRAG,
+    RPC_OP_MAP,
+} rpc_op_t;
+
+typedef struct rpc_request {
+    uint32_t magic;
+    uint16_t op;
+    uint16_t res0;
+    uint32_t tag;
+    uint32_t len;
+    uint8_t uuid[16];
+    uint64_t arg0;
+    uint64_t arg1;
+} rpc_request_t;
+
+typedef struct rpc_response {
+    uint32_t tag;
+    int32_t status;
+    uint32_t len;
+    uint32_t res0;
+    uint8_t uuid[16];
+} rpc_response_t;
+
+typedef struct rpc_store_info {
+    uint32_t page_shift;
+    uint32_t cluster_shift;
+    uint32_t md_shift;
+    uint32_t res0;
+    uint64_t n_clusters;
+    uint64_t n_free;
+    uint64_t n_allocated;
+    uint64_t n_blobs;
+    uint64_t md_used;
+    uint64_t md_capacity;
+    uint64_t map_bytes;
+} rpc_store_info_t;
+
+typedef struct rpc_blob_info {
+    uint8_t uuid[16];
+    uint32_t page_index;
+    uint32_t n_clusters;
+    uint32_t n_allocated;
+    uint32_t flags;
+    uint64_t n_extents;
+    uint64_t n_cluster_pages;
+} rpc_blob_info_t;
+
+typedef struct rpc_blob_frag {
+    uint8_t uuid[16];
+    uint32_t n_allocated;
+    uint32_t res0;
+    uint64_t n_extents;
+    uint64_t n_runs;
+} rpc_blob_frag_t;
+
+/*
+ * The answer to RPC_OP_MAP, followed by the allocated logical extents of
+ * the blob from cluster `arg0` onwards, as many as fit in RPC_MAX_IO.
+ */
+typedef struct rpc_blob_map {
+    uint64_t cluster_size;
+    uint64_t n_clusters;
+} rpc_blob_map_t;
+
+typedef struct rpc_extent {
+    uint32_t lcluster;
+    uint32_t len;
+} rpc_extent_t;
+
+typedef struct rpc_buf {
+    uint8_t *data;
+    size_t len;
+    size_t pos;
+    size_t capacity;
+} rpc_buf_t;
+
+void rpc_buf_init(rpc_buf_t *buf);
+
+void rpc_buf_deinit(rpc_buf_t *buf);
+
+void *rpc_buf_extend(rpc_buf_t *buf, size_t len);
+
+int rpc_buf_append(rpc_buf_t *buf, const void *data, size_t len);
+
+void rpc_buf_compact(rpc_buf_t *buf);
+
+int rpc_connect(const char *path);
+
+int rpc_send(int fd, const rpc_request_t *req, const void *payload);
+
+int rpc_recv(int fd, rpc_response_t *resp, void **payload);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "blob.h"
+#include "rpc.h"
+
+#include <signal.h>
+#include <sys/un.h>
+
+#define SERVER_MAX_CONNS 64
+
+#define SERVER_READ_SIZE (256UL << 10)
+
+#define SERVER_MAX_BACKLOG (8UL << 20)
+
+#define SERVER_MAX_DEFRAGS 16
+
+typedef struct conn {
+    int fd;
+    int eof;
+    rpc_buf_t in;
+    rpc_buf_t out;
+} conn_t;
+
+typedef struct defrag_job {
+    blob_defrag_t defrag;
+    uint64_t rate;
+    uint64_t due;
+} defrag_job_t;
+
+typedef struct server {
+    blobstore_t *bs;
+    channel_t channel;
+    void *io_buf;
+    int dirty;
+    int fd;
+    char path[sizeof(((struct sockaddr_un*) 0)->sun_path)];
+    size_t n_conns;
+    conn_t conns[SERVER_MAX_CONNS];
+    size_t n_defrags;
+    defrag_job_t defrags[SERVER_MAX_DEFRAGS];
+} server_t;
+
+int server_init(server_t *srv, blobstore_t *bs);
+
+void server_deinit(server_t *srv);
+
+int server_execute(server_t *srv, const rpc_request_t *req, const void *payload, rpc_buf_t *out);
+
+int server_sync(server_t *srv);
+
+int server_defrag(server_t *srv);
+
+int server_listen(server_t *srv, const char *path);
+
+int server_run(server_t *srv, volatile sig_atomic_t *stop);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define HISTOGRAM_SUB_BITS 4
+
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+typedef enum stat_hist {
+    STAT_IO_READ,
+    STAT_IO_WRITE,
+    STAT_IO_FLUSH,
+    STAT_OPEN,
+    STAT_CREATE,
+    STAT_DELETE,
+    STAT_COMMIT,
+    STAT_CHECKPOINT,
+    STAT_MAP_LOAD,
+    STAT_BLOB_READ,
+    STAT_BLOB_WRITE,
+    STAT_COMMIT_PAGES,
+    STAT_ALLOC_SCAN_WORDS,
+    STAT_ALLOC_SCAN_RUNS,
+    STAT_HIST_COUNT
+} stat_hist_t;
+
+typedef enum stat_counter {
+    STAT_BYTES_READ,
+    STAT_BYTES_WRITTEN,
+    STAT_CACHE_HITS,
+    STAT_CACHE_MISSES,
+    STAT_MAP_EVICTIONS,
+    STAT_BYTES_DISCARDED,
+    STAT_COUNTER_COUNT
+} stat_counter_t;
+
+typedef struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+typedef struct stats {
+    struct stats *next;
+    uint64_t counters[STAT_COUNTER_COUNT];
+    histogram_t hists[STAT_HIST_COUNT];
+} stats_t;
+
+uint64_t stats_now(void);
+
+void stats_add(stat_counter_t counter, uint64_t n);
+
+void stats_record(stat_hist_t hist, uint64_t value);
+
+void stats_collect(stats_t *res);
+
+const char *stats_counter_name(stat_counter_t counter);
+
+const char *stats_hist_name(stat_hist_t hist);
+
+const char *stats_hist_unit(stat_hist_t hist);
+
+uint64_t histogram_percentile(histogram_t *hist, double p);
+
+#endif
@@ -1,14 +1,21 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 int parse_u32(const char *str, uint32_t *res);
 
 int parse_u64(const char *str, uint64_t *res);
 
+int parse_size(const char *str, uint64_t *res);
+
 int uuid_init_random(uint8_t uuid[16]);
 
+int uuid_parse(const char *str, uint8_t uuid[16]);
+
 void uuid_print(uint8_t uuid[16]);
 
+int buf_is_zero(const void *buf, size_t len);
+
 #endif
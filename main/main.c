@@ -1,5 +1,8 @@
 #define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <stdint.h>
 #include <string.h>
@@ -7,7 +10,10 @@
 #include <stdlib.h>
 
 #include "blob.h"
+#include "rpc.h"
+#include "server.h"
 #include "util.h"
+#include "stats.h"
 
 typedef struct command {
     const char *name;
@@ -26,21 +32,213 @@ typedef struct command {
     int (*run)(struct command *cmd, int argc, char const *argv[]);
 } command_t;
 
-int blobstore_create_func(command_t *cmd, int argc, char const *argv[]) {
+static const char *device_path = "/dev/nvme0n1";
+
+static uint64_t device_size = 0;
+
+static uint64_t stripe_size = BDEV_STRIPE_SIZE;
+
+static const char *socket_path = RPC_SOCKET_PATH;
+
+#define CLIENT_WINDOW 8
 
-    int fd = open("/dev/nvme0n1", O_RDWR | O_DIRECT);
-    if (fd < 0) {
-        perror("failed to open block device");
+/**
+ * Open the device selected with `--device`, striped with `--stripe` if it
+ * lists several members, or exit on failure.
+ *
+ * @param dev the device
+ */
+void device_open(bdev_t *dev) {
+    int res;
+    if (strchr(device_path, ',')) {
+        res = bdev_open_striped(dev, device_path, device_size, stripe_size);
+    } else {
+        res = bdev_open(dev, device_path, device_size);
+    }
+    if (res < 0) {
+        perror("failed to open device");
         exit(1);
     }
+}
 
+/*
+ * A client sends every request to the daemon serving the blobstore at
+ * `--socket`. Without a daemon, the client opens the blobstore itself and
+ * executes the requests in-process.
+ */
+typedef struct client {
+    int fd;
+    uint32_t tag;
+    bdev_t dev;
     blobstore_t bs;
-    blobstore_init(&bs, fd);
-    
-    close(fd);
+    server_t srv;
+    rpc_buf_t out;
+} client_t;
+
+/**
+ * Connect to the daemon, or open the blobstore if there is none, or exit on
+ * failure.
+ *
+ * @param client the client
+ */
+void client_open(client_t *client) {
+    client->tag = 0;
+    client->fd = rpc_connect(socket_path);
+    if (client->fd >= 0) return;
+
+    device_open(&client->dev);
+    if (blobstore_open(&client->bs, &client->dev) < 0) {
+        fprintf(stderr, "failed to open blobstore\n");
+        exit(1);
+    }
+    if (server_init(&client->srv, &client->bs) < 0) {
+        perror("failed to open blobstore");
+        exit(1);
+    }
+    rpc_buf_init(&client->out);
+}
+
+void client_close(client_t *client) {
+    if (client->fd >= 0) {
+        close(client->fd);
+        return;
+    }
+
+    server_deinit(&client->srv);
+    rpc_buf_deinit(&client->out);
+    blobstore_deinit(&client->bs);
+    bdev_close(&client->dev);
+}
+
+/**
+ * Send a request without waiting for its response, or exit on failure.
+ *
+ * @param client the client
+ * @param req the request
+ * @param payload the payload of the request, or NULL
+ */
+void client_send(client_t *client, rpc_request_t *req, const void *payload) {
+    req->magic = RPC_MAGIC;
+    req->tag = client->tag++;
+    if (client->fd >= 0) {
+        if (rpc_send(client->fd, req, payload) < 0) {
+            perror("failed to send request");
+            exit(1);
+        }
+        return;
+    }
+
+    if (server_execute(&client->srv, req, payload, &client->out) < 0 || server_sync(&client->srv) < 0) {
+        perror("failed to execute request");
+        exit(1);
+    }
+}
+
+/**
+ * Receive the response to the oldest request without a response, or exit
+ * on failure. The payload, if any, must be freed by the caller.
+ *
+ * @param client the client
+ * @param resp the response
+ * @return the payload of the response, or NULL
+ */
+void *client_recv(client_t *client, rpc_response_t *resp) {
+    void *payload = NULL;
+    if (client->fd >= 0) {
+        if (rpc_recv(client->fd, resp, &payload) < 0) {
+            perror("failed to receive response");
+            exit(1);
+        }
+        return payload;
+    }
+
+    rpc_buf_t *out = &client->out;
+    memcpy(resp, out->data + out->pos, sizeof(rpc_response_t));
+    out->pos += sizeof(rpc_response_t);
+    if (resp->len) {
+        payload = malloc(resp->len);
+        if (payload == NULL) {
+            perror("failed to receive response");
+            exit(1);
+        }
+        memcpy(payload, out->data + out->pos, resp->len);
+        out->pos += resp->len;
+    }
+    rpc_buf_compact(out);
+
+    return payload;
+}
+
+void *client_call(client_t *client, rpc_request_t *req, const void *payload, rpc_response_t *resp) {
+    client_send(client, req, payload);
+    return client_recv(client, resp);
+}
+
+/**
+ * Exit if `resp` reports a failure.
+ *
+ * @param resp the response
+ * @param what the failed action
+ */
+void response_check(rpc_response_t *resp, const char *what) {
+    if (resp->status == 0) return;
+
+    if (resp->status == ENOENT) {
+        fprintf(stderr, "blob not found\n");
+    } else {
+        fprintf(stderr, "failed to %s: %s\n", what, strerror(resp->status));
+    }
+    exit(1);
+}
+
+int blobstore_create_func(command_t *cmd, int argc, char const *argv[]) {
+    int fd = rpc_connect(socket_path);
+    if (fd >= 0) {
+        fprintf(stderr, "blobstore is being served\n");
+        exit(1);
+    }
+
+    bdev_t dev;
+    device_open(&dev);
+
+    blobstore_t bs;
+    if (blobstore_init(&bs, &dev) < 0) {
+        fprintf(stderr, "failed to create blobstore\n");
+        bdev_close(&dev);
+        exit(1);
+    }
 
     blobstore_deinit(&bs);
+    bdev_close(&dev);
+
+    return 0;
+}
+
+/**
+ * Run a request on the blob given by the uuid in `uuid_str` that answers
+ * with the uuid of a blob, and print it after `done`.
+ */
+int blob_request(uint16_t op, const char *uuid_str, uint64_t arg0, const char *what, const char *done) {
+    rpc_request_t req = {0};
+    req.op = op;
+    req.arg0 = arg0;
+    if (uuid_str && uuid_parse(uuid_str, req.uuid) < 0) return -1;
+
+    client_t client;
+    client_open(&client);
 
+    rpc_response_t resp;
+    free(client_call(&client, &req, NULL, &resp));
+    response_check(&resp, what);
+
+    printf("%s", done);
+    if (op == RPC_OP_CREATE || op == RPC_OP_CLONE || op == RPC_OP_SNAPSHOT) {
+        printf(" ");
+        uuid_print(resp.uuid);
+    }
+    printf("\n");
+
+    client_close(&client);
     return 0;
 }
 
@@ -50,87 +248,770 @@ int blob_create_func(command_t *cmd, int argc, char const *argv[]) {
     uint64_t n_clusters;
     if (parse_u64(argv[1], &n_clusters) < 0) return -1;
 
-    int fd = open("/dev/nvme0n1", O_RDWR | O_DIRECT);
-    if (fd < 0) {
-        perror("failed to open block device");
-        exit(1);
+    return blob_request(RPC_OP_CREATE, NULL, n_clusters, "create blob", "blob created");
+}
+
+int blob_delete_func(command_t *cmd, int argc, char const *argv[]) {
+    if (argc != 2) return -1;
+
+    return blob_request(RPC_OP_DELETE, argv[1], 0, "delete blob", "blob deleted");
+}
+
+int blob_resize_func(command_t *cmd, int argc, char const *argv[]) {
+    if (argc != 3) return -1;
+
+    uint64_t n_clusters;
+    if (parse_u64(argv[2], &n_clusters) < 0 || n_clusters > UINT32_MAX) return -1;
+
+    return blob_request(RPC_OP_RESIZE, argv[1], n_clusters, "resize blob", "blob resized");
+}
+
+int blob_clone_func(command_t *cmd, int argc, char const *argv[]) {
+    if (argc != 2) return -1;
+
+    return blob_request(RPC_OP_CLONE, argv[1], 0, "clone blob", "clone created");
+}
+
+int blob_snapshot_func(command_t *cmd, int argc, char const *argv[]) {
+    if (argc != 2) return -1;
+
+    return blob_request(RPC_OP_SNAPSHOT, argv[1], 0, "snapshot blob", "snapshot created");
+}
+
+int blob_info_func(command_t *cmd, int argc, char const *argv[]) {
+    if (argc != 2) return -1;
+
+    rpc_request_t req = {0};
+    req.op = RPC_OP_INFO;
+    if (uuid_parse(argv[1], req.uuid) < 0) return -1;
+
+    client_t client;
+    client_open(&client);
+
+    rpc_response_t resp;
+    rpc_blob_info_t *info = client_call(&client, &req, NULL, &resp);
+    response_check(&resp, "load blob");
+
+    printf("uuid:\t\t");
+    uuid_print(info->uuid);
+    printf("\n");
+    printf("page:\t\t%08x\n", info->page_index);
+    printf("clusters:\t%08x\n", info->n_clusters);
+    printf("allocated:\t%08x\n", info->n_allocated);
+    printf("flags:\t\t%s\n", info->flags & BLOB_READ_ONLY ? "read-only": "-");
+    printf("extents:\t%08lx\n", info->n_extents);
+    printf("cluster pages:\t%08lx\n", info->n_cluster_pages);
+
+    free(info);
+    client_close(&client);
+
+    return 0;
+}
+
+/**
+ * Read `LENGTH` bytes at byte `OFFSET` of a blob to the standard output.
+ * The requests are pipelined, keeping up to `CLIENT_WINDOW` in flight. A
+ * length that is not a whole number of blocks is read up to the end of the
+ * last block and the output is cut short.
+ */
+int blob_read_func(command_t *cmd, int argc, char const *argv[]) {
+    if (argc != 4) return -1;
+
+    rpc_request_t req = {0};
+    req.op = RPC_OP_READ;
+    if (uuid_parse(argv[1], req.uuid) < 0) return -1;
+
+    uint64_t offset, len;
+    if (parse_u64(argv[2], &offset) < 0 || parse_u64(argv[3], &len) < 0) return -1;
+
+    uint64_t padded = (len + 4095) & ~4095ULL;
+    if (padded < len) return -1;
+
+    client_t client;
+    client_open(&client);
+
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    while (received < padded) {
+        while (sent < padded && sent - received < CLIENT_WINDOW * RPC_MAX_IO) {
+            req.arg0 = offset + sent;
+            req.arg1 = padded - sent < RPC_MAX_IO ? padded - sent: RPC_MAX_IO;
+            client_send(&client, &req, NULL);
+            sent += req.arg1;
+        }
+
+        rpc_response_t resp;
+        void *data = client_recv(&client, &resp);
+        response_check(&resp, "read blob");
+        size_t n = received < len ? (len - received < resp.len ? len - received: resp.len): 0;
+        if (fwrite(data, 1, n, stdout) != n) {
+            perror("failed to write output");
+            exit(1);
+        }
+        received += resp.len;
+        free(data);
     }
 
-    blobstore_t bs;
-    blobstore_open(&bs, fd);
-    
-    if (blobstore_create_blob(&bs, n_clusters) < 0) {
-        perror("failed to create blob");
+    client_close(&client);
+    return 0;
+}
+
+/**
+ * Write the standard input to a blob from byte `OFFSET`, padding the last
+ * block with zeros. The requests are pipelined like those of `blob read`.
+ */
+int blob_write_func(command_t *cmd, int argc, char const *argv[]) {
+    if (argc != 3) return -1;
+
+    rpc_request_t req = {0};
+    req.op = RPC_OP_WRITE;
+    if (uuid_parse(argv[1], req.uuid) < 0) return -1;
+
+    uint64_t offset;
+    if (parse_u64(argv[2], &offset) < 0) return -1;
+
+    uint8_t *buf = malloc(RPC_MAX_IO);
+    if (buf == NULL) {
+        perror("failed to write blob");
         exit(1);
     }
 
-    close(fd);
+    client_t client;
+    client_open(&client);
 
-    printf("blob created\n");
+    size_t in_flight = 0;
+    for (;;) {
+        size_t n = fread(buf, 1, RPC_MAX_IO, stdin);
+        if (n < RPC_MAX_IO && ferror(stdin)) {
+            perror("failed to read input");
+            exit(1);
+        }
 
-    blobstore_deinit(&bs);
+        if (n > 0) {
+            size_t padded = (n + 4095) & ~4095UL;
+            memset(buf + n, 0, padded - n);
+            req.arg0 = offset;
+            req.len = padded;
+            client_send(&client, &req, buf);
+            offset += padded;
+            in_flight++;
+        }
 
+        while (in_flight > 0 && (in_flight == CLIENT_WINDOW || n < RPC_MAX_IO)) {
+            rpc_response_t resp;
+            free(client_recv(&client, &resp));
+            response_check(&resp, "write blob");
+            in_flight--;
+        }
+        if (n < RPC_MAX_IO) break;
+    }
+
+    free(buf);
+    client_close(&client);
     return 0;
 }
 
+/*
+ * A blob exported with `blob export` is a header giving the size of the
+ * blob in bytes, followed by records that each give the byte offset and
+ * length of the data that follows them. Ranges without a record read as
+ * zeros, and a record of length 0 ends the stream.
+ */
+#define EXPORT_MAGIC 0x58454c42
 
-int blob_delete_func(command_t *cmd, int argc, char const *argv[]) {
-  
-    int fd = open("/dev/nvme0n1", O_RDWR | O_DIRECT);
-    if (fd < 0) {
-        perror("failed to open block device");
+typedef struct export_header {
+    uint32_t magic;
+    uint32_t res0;
+    uint64_t size;
+} export_header_t;
+
+typedef struct export_record {
+    uint64_t offset;
+    uint64_t len;
+} export_record_t;
+
+static void export_write(FILE *out, const void *data, size_t len) {
+    if (fwrite(data, 1, len, out) != len) {
+        perror("failed to write output");
         exit(1);
     }
+}
 
-    blobstore_t bs;
-    blobstore_open(&bs, fd);
-    
-    if (blobstore_delete_blob(&bs, bs.head) < 0) {
-        perror("failed to delete blob");
+/*
+ * Write zeros to the non-seekable raw image `out` from byte `*pos` up to
+ * byte `end`.
+ */
+static void export_zeros(FILE *out, uint64_t *pos, uint64_t end, const void *zeros) {
+    while (*pos < end) {
+        size_t n = end - *pos < RPC_MAX_IO ? end - *pos: RPC_MAX_IO;
+        export_write(out, zeros, n);
+        *pos += n;
+    }
+}
+
+/**
+ * Write a blob to the standard output or to `FILE` in the sparse export
+ * format, or with `--raw` as a plain image that is left sparse when the
+ * output is seekable. Only the allocated clusters are read, and blocks of
+ * them that are all zero are skipped.
+ */
+int blob_export_func(command_t *cmd, int argc, char const *argv[]) {
+    if (argc < 2) return -1;
+
+    rpc_request_t req = {0};
+    if (uuid_parse(argv[1], req.uuid) < 0) return -1;
+
+    int raw = 0;
+    const char *path = NULL;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--raw") == 0) {
+            raw = 1;
+        } else if (path == NULL) {
+            path = argv[i];
+        } else {
+            return -1;
+        }
+    }
+
+    FILE *out = path ? fopen(path, "w"): stdout;
+    if (out == NULL) {
+        perror("failed to open output");
         exit(1);
     }
 
-    close(fd);
+    client_t client;
+    client_open(&client);
 
-    printf("blob deleted\n");
+    /* Collect the allocated extents, which may take several requests. */
+    uint64_t cluster_size = 0;
+    uint64_t n_clusters = 0;
+    rpc_extent_t *extents = NULL;
+    size_t n_extents = 0;
+    req.op = RPC_OP_MAP;
+    for (;;) {
+        rpc_response_t resp;
+        rpc_blob_map_t *map = client_call(&client, &req, NULL, &resp);
+        response_check(&resp, "map blob");
+        cluster_size = map->cluster_size;
+        n_clusters = map->n_clusters;
 
-    blobstore_deinit(&bs);
+        size_t n = (resp.len - sizeof(rpc_blob_map_t)) / sizeof(rpc_extent_t);
+        if (n > 0) {
+            extents = realloc(extents, (n_extents + n) * sizeof(rpc_extent_t));
+            if (extents == NULL) {
+                perror("failed to map blob");
+                exit(1);
+            }
+            memcpy(extents + n_extents, map + 1, n * sizeof(rpc_extent_t));
+            n_extents += n;
+            req.arg0 = extents[n_extents - 1].lcluster + extents[n_extents - 1].len;
+        }
+        free(map);
+        if (n == 0 || req.arg0 >= n_clusters) break;
+    }
+
+    uint64_t size = n_clusters * cluster_size;
+    int seekable = raw && fseeko(out, 0, SEEK_CUR) == 0;
+    void *zeros = raw && !seekable ? calloc(1, RPC_MAX_IO): NULL;
+    if (raw && !seekable && zeros == NULL) {
+        perror("failed to export blob");
+        exit(1);
+    }
+    if (!raw) {
+        export_header_t header = {EXPORT_MAGIC, 0, size};
+        export_write(out, &header, sizeof(header));
+    }
+
+    /* The reads are pipelined like those of `blob read`. */
+    uint64_t offsets[CLIENT_WINDOW];
+    size_t head = 0;
+    size_t in_flight = 0;
+    size_t e = 0;
+    uint64_t pos = n_extents ? extents[0].lcluster * cluster_size: 0;
+    uint64_t written = 0;
+    req.op = RPC_OP_READ;
+    while (e < n_extents || in_flight > 0) {
+        while (e < n_extents && in_flight < CLIENT_WINDOW) {
+            uint64_t end = (uint64_t) (extents[e].lcluster + extents[e].len) * cluster_size;
+            req.arg0 = pos;
+            req.arg1 = end - pos < RPC_MAX_IO ? end - pos: RPC_MAX_IO;
+            client_send(&client, &req, NULL);
+            offsets[(head + in_flight++) % CLIENT_WINDOW] = pos;
+
+            pos += req.arg1;
+            if (pos == end && ++e < n_extents) pos = extents[e].lcluster * cluster_size;
+        }
+
+        rpc_response_t resp;
+        void *data = client_recv(&client, &resp);
+        response_check(&resp, "read blob");
+        uint64_t offset = offsets[head];
+        head = (head + 1) % CLIENT_WINDOW;
+        in_flight--;
+
+        if (!buf_is_zero(data, resp.len)) {
+            if (!raw) {
+                export_record_t record = {offset, resp.len};
+                export_write(out, &record, sizeof(record));
+            } else if (seekable) {
+                if (fseeko(out, offset, SEEK_SET) < 0) {
+                    perror("failed to write output");
+                    exit(1);
+                }
+            } else {
+                export_zeros(out, &written, offset, zeros);
+            }
+            export_write(out, data, resp.len);
+            written = offset + resp.len;
+        }
+        free(data);
+    }
+    client_close(&client);
 
+    if (!raw) {
+        export_record_t record = {0, 0};
+        export_write(out, &record, sizeof(record));
+    } else if (!seekable) {
+        export_zeros(out, &written, size, zeros);
+    }
+    if (fflush(out) != 0 || (seekable && ftruncate(fileno(out), size) < 0)) {
+        perror("failed to write output");
+        exit(1);
+    }
+
+    if (path) fclose(out);
+    free(zeros);
+    free(extents);
     return 0;
 }
 
-int blobstore_list_func(command_t *cmd, int argc, char const *argv[]) {
-    int fd = open("/dev/nvme0n1", O_RDWR | O_DIRECT);
-    if (fd < 0) {
-        perror("failed to open block device");
+typedef struct importer {
+    client_t client;
+    rpc_request_t req;
+    size_t in_flight;
+} importer_t;
+
+/*
+ * Write `len` bytes of `buf` at byte `offset` of the imported blob, padding
+ * the last block with zeros, unless they are all zero: the blob is new, so
+ * it reads as zeros wherever nothing is written.
+ */
+static void import_write(importer_t *imp, uint8_t *buf, uint64_t offset, size_t len) {
+    if (!buf_is_zero(buf, len)) {
+        size_t padded = (len + 4095) & ~4095UL;
+        memset(buf + len, 0, padded - len);
+        imp->req.arg0 = offset;
+        imp->req.len = padded;
+        client_send(&imp->client, &imp->req, buf);
+        imp->in_flight++;
+    }
+
+    while (imp->in_flight == CLIENT_WINDOW || (len == 0 && imp->in_flight > 0)) {
+        rpc_response_t resp;
+        free(client_recv(&imp->client, &resp));
+        response_check(&resp, "write blob");
+        imp->in_flight--;
+    }
+}
+
+static void import_read(FILE *in, void *buf, size_t len) {
+    if (fread(buf, 1, len, in) != len) {
+        fprintf(stderr, "failed to read input: %s\n", ferror(in) ? strerror(errno): "truncated");
         exit(1);
     }
+}
 
-    blobstore_t bs;
-    blobstore_open(&bs, fd);
+static void import_pread(int fd, uint8_t *buf, size_t len, uint64_t offset) {
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            fprintf(stderr, "failed to read input: %s\n", n < 0 ? strerror(errno): "truncated");
+            exit(1);
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+}
+
+/**
+ * Create a blob from the standard input or from `FILE` in the sparse export
+ * format, or with `--raw` from a plain image file, whose holes are skipped.
+ * Blocks that are all zero are not written, so they take no clusters.
+ */
+int blob_import_func(command_t *cmd, int argc, char const *argv[]) {
+    int raw = 0;
+    const char *path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--raw") == 0) {
+            raw = 1;
+        } else if (path == NULL) {
+            path = argv[i];
+        } else {
+            return -1;
+        }
+    }
+
+    FILE *in = path ? fopen(path, "r"): stdin;
+    if (in == NULL) {
+        perror("failed to open input");
+        exit(1);
+    }
+
+    uint64_t size;
+    if (raw) {
+        struct stat st;
+        if (fstat(fileno(in), &st) < 0 || !S_ISREG(st.st_mode)) {
+            fprintf(stderr, "raw import needs a regular file\n");
+            exit(1);
+        }
+        size = st.st_size;
+    } else {
+        export_header_t header;
+        import_read(in, &header, sizeof(header));
+        if (header.magic != EXPORT_MAGIC) {
+            fprintf(stderr, "not a blob export\n");
+            exit(1);
+        }
+        size = header.size;
+    }
+
+    uint8_t *buf = malloc(RPC_MAX_IO);
+    if (buf == NULL) {
+        perror("failed to import blob");
+        exit(1);
+    }
+
+    importer_t imp = {0};
+    client_open(&imp.client);
+
+    rpc_response_t resp;
+    imp.req.op = RPC_OP_STATS;
+    rpc_store_info_t *info = client_call(&imp.client, &imp.req, NULL, &resp);
+    response_check(&resp, "collect statistics");
+    uint64_t cluster_size = 1ULL << info->page_shift << info->cluster_shift;
+    free(info);
+
+    imp.req.op = RPC_OP_CREATE;
+    imp.req.arg0 = size ? (size + cluster_size - 1) / cluster_size: 1;
+    free(client_call(&imp.client, &imp.req, NULL, &resp));
+    response_check(&resp, "create blob");
+    memcpy(imp.req.uuid, resp.uuid, 16);
+
+    imp.req.op = RPC_OP_WRITE;
+    imp.req.arg0 = 0;
+    if (raw) {
+        /* Holes are found with SEEK_DATA where the file system supports it. */
+        int fd = fileno(in);
+        uint64_t off = 0;
+        while (off < size) {
+            off_t data = lseek(fd, off, SEEK_DATA);
+            if (data < 0 && errno == ENXIO) break;
+            if (data < 0) data = off;
+            off_t hole = lseek(fd, data, SEEK_HOLE);
+            if (hole < 0 || hole > size) hole = size;
+
+            for (uint64_t pos = data & ~4095UL; pos < hole;) {
+                size_t n = hole - pos < RPC_MAX_IO ? hole - pos: RPC_MAX_IO;
+                import_pread(fd, buf, n, pos);
+                import_write(&imp, buf, pos, n);
+                pos += n;
+            }
+            off = hole;
+        }
+    } else {
+        for (;;) {
+            export_record_t record;
+            import_read(in, &record, sizeof(record));
+            if (record.len == 0) break;
+            if (record.offset % 4096 || record.offset > size || record.len > size - record.offset) {
+                fprintf(stderr, "corrupt blob export\n");
+                exit(1);
+            }
+
+            for (uint64_t done = 0; done < record.len;) {
+                size_t n = record.len - done < RPC_MAX_IO ? record.len - done: RPC_MAX_IO;
+                import_read(in, buf, n);
+                import_write(&imp, buf, record.offset + done, n);
+                done += n;
+            }
+        }
+    }
+    import_write(&imp, buf, 0, 0);
+
+    printf("blob imported ");
+    uuid_print(imp.req.uuid);
+    printf("\n");
+
+    client_close(&imp.client);
+    if (path) fclose(in);
+    free(buf);
+    return 0;
+}
+
+int blobstore_list_func(command_t *cmd, int argc, char const *argv[]) {
+    client_t client;
+    client_open(&client);
+
+    rpc_request_t req = {0};
+    req.op = RPC_OP_LIST;
+
+    rpc_response_t resp;
+    rpc_store_info_t *info = client_call(&client, &req, NULL, &resp);
+    response_check(&resp, "list blobs");
     
-    printf("page size:\t%08llx\n", 1ULL << bs.page_shift);
-    printf("cluster size:\t%08llx\n", 1ULL << bs.page_shift << bs.cluster_shift);
-    printf("metadata size:\t%08llx\n", 1ULL << bs.page_shift << bs.cluster_shift << bs.md_shift);
-    printf("clusters:\t%08lx\n", bitset_capacity(&bs.clusters));
+    printf("page size:\t%08llx\n", 1ULL << info->page_shift);
+    printf("cluster size:\t%08llx\n", 1ULL << info->page_shift << info->cluster_shift);
+    printf("metadata size:\t%08llx\n", 1ULL << info->page_shift << info->cluster_shift << info->md_shift);
+    printf("clusters:\t%08lx\n", info->n_clusters);
+
+    rpc_blob_info_t *blobs = (rpc_blob_info_t*) (info + 1);
+    for (uint64_t i = 0; i < info->n_blobs; i++) {
+        rpc_blob_info_t *curr = &blobs[i];
+        uuid_print(curr->uuid);
+
+        uint32_t used = (uint64_t) curr->n_allocated * 100 / curr->n_clusters;
+
+        printf(" 0x%04x 0x%08x %d%%\n", curr->page_index, curr->n_clusters, used);
+    }
+
+    free(info);
+    client_close(&client);
+
+    return 0;
+}
+
+int blobstore_stats_func(command_t *cmd, int argc, char const *argv[]) {
+    client_t client;
+    client_open(&client);
+
+    rpc_request_t req = {0};
+    req.op = RPC_OP_STATS;
+
+    rpc_response_t resp;
+    rpc_store_info_t *info = client_call(&client, &req, NULL, &resp);
+    response_check(&resp, "collect statistics");
+    client_close(&client);
+
+    printf("blobs:\t\t\t%lu\n", info->n_blobs);
+    printf("clusters:\t\t%lu\n", info->n_clusters);
+    printf("free clusters:\t\t%lu\n", info->n_free);
+    printf("allocated clusters:\t%lu\n", info->n_allocated);
+    printf("metadata pages:\t\t%lu/%lu\n", info->md_used, info->md_capacity);
+    printf("loaded map bytes:\t%lu\n", info->map_bytes);
+
+    /* Collected by the server, which may be this process. */
+    stats_t *stats = (stats_t*) (info + 1);
+    if (client.fd < 0) stats_collect(stats);
+
+    printf("\n");
+    for (int i = 0; i < STAT_COUNTER_COUNT; i++) {
+        printf("%-20s%lu\n", stats_counter_name(i), stats->counters[i]);
+    }
+
+    printf("\n%-20s%10s%12s%12s%12s%12s  %s\n", "operation", "count", "p50", "p99", "p999", "max", "unit");
+    for (int i = 0; i < STAT_HIST_COUNT; i++) {
+        histogram_t *hist = &stats->hists[i];
+        printf("%-20s%10lu%12lu%12lu%12lu%12lu  %s\n", stats_hist_name(i), hist->count,
+            histogram_percentile(hist, 0.5), histogram_percentile(hist, 0.99),
+            histogram_percentile(hist, 0.999), hist->max, stats_hist_unit(i));
+    }
+
+    free(info);
+    return 0;
+}
+
+/**
+ * Check the consistency of the blobstore with `--threads` workers (default
+ * one per CPU), and with `--repair` rebuild its free maps. Exits with 1 if
+ * problems were found and not repaired.
+ */
+int blobstore_check_func(command_t *cmd, int argc, char const *argv[]) {
+    rpc_request_t req = {0};
+    req.op = RPC_OP_CHECK;
+    req.arg0 = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--repair") == 0) {
+            req.arg1 = 1;
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            if (parse_u64(argv[++i], &req.arg0) < 0 || req.arg0 == 0) return -1;
+        } else {
+            return -1;
+        }
+    }
+
+    client_t client;
+    client_open(&client);
+
+    rpc_response_t resp;
+    blobstore_check_t *report = client_call(&client, &req, NULL, &resp);
+    response_check(&resp, "check blobstore");
+    client_close(&client);
+
+    printf("blobs:\t\t\t\t%lu\n", report->n_blobs);
+    printf("broken cluster maps:\t\t%lu\n", report->n_bad_blobs);
+    printf("double-allocated pages:\t\t%lu\n", report->n_double_pages);
+    printf("leaked pages:\t\t\t%lu\n", report->n_leaked_pages);
+    printf("lost pages:\t\t\t%lu\n", report->n_lost_pages);
+    printf("double-allocated clusters:\t%lu\n", report->n_double_clusters);
+    printf("leaked clusters:\t\t%lu\n", report->n_leaked_clusters);
+    printf("lost clusters:\t\t\t%lu\n", report->n_lost_clusters);
+
+    /* A repair resolves everything but broken cluster maps and shared pages. */
+    uint64_t n_problems = report->n_bad_blobs + report->n_double_pages;
+    if (!report->repaired) {
+        n_problems += report->n_leaked_pages + report->n_lost_pages + report->n_double_clusters +
+            report->n_leaked_clusters + report->n_lost_clusters;
+    }
+    if (report->repaired) printf("\nfree maps rebuilt\n");
+
+    free(report);
+    if (n_problems) exit(1);
+    return 0;
+}
+
+/**
+ * Show how fragmented the free space of the blobstore is, as a histogram of
+ * the lengths of its free runs, and into how many physical runs the clusters
+ * of every blob are split.
+ */
+int blobstore_frag_func(command_t *cmd, int argc, char const *argv[]) {
+    if (argc != 1) return -1;
+
+    client_t client;
+    client_open(&client);
+
+    rpc_request_t req = {0};
+    req.op = RPC_OP_FRAG;
+
+    rpc_response_t resp;
+    blobstore_frag_t *frag = client_call(&client, &req, NULL, &resp);
+    response_check(&resp, "collect fragmentation");
+    client_close(&client);
 
-    blob_t *curr = bs.head;
-    while (curr) {
+    printf("free clusters:\t\t%lu\n", frag->n_free);
+    printf("free runs:\t\t%lu\n", frag->n_free_runs);
+    printf("longest free run:\t%lu\n", frag->longest_free_run);
+
+    printf("\n%-24s%12s%12s\n", "run length", "runs", "clusters");
+    for (int k = 0; k < BLOBSTORE_FRAG_BUCKETS; k++) {
+        if (frag->free_runs[k] == 0) continue;
+
+        char range[32];
+        snprintf(range, sizeof(range), "%lu-%lu", 1UL << k, (2UL << k) - 1);
+        printf("%-24s%12lu%12lu\n", range, frag->free_runs[k], frag->free_clusters[k]);
+    }
+
+    rpc_blob_frag_t *blobs = (rpc_blob_frag_t*) (frag + 1);
+    size_t n_blobs = (resp.len - sizeof(blobstore_frag_t)) / sizeof(rpc_blob_frag_t);
+    if (n_blobs) printf("\n%-37s%12s%12s%12s\n", "blob", "allocated", "extents", "runs");
+    for (size_t i = 0; i < n_blobs; i++) {
+        rpc_blob_frag_t *curr = &blobs[i];
         uuid_print(curr->uuid);
+        printf(" %12u%12lu%12lu\n", curr->n_allocated, curr->n_extents, curr->n_runs);
+    }
+
+    free(frag);
+    return 0;
+}
+
+/**
+ * Move the clusters of a blob into as few runs as possible, copying at most
+ * `--rate` MiB per second. A daemon moves them in the background; without
+ * one, the command returns once they have been moved.
+ */
+int blob_defrag_func(command_t *cmd, int argc, char const *argv[]) {
+    rpc_request_t req = {0};
+    req.op = RPC_OP_DEFRAG;
+    if (argc != 2 && argc != 4) return -1;
+    if (uuid_parse(argv[1], req.uuid) < 0) return -1;
+    if (argc == 4) {
+        if (strcmp(argv[2], "--rate") != 0 || parse_u64(argv[3], &req.arg0) < 0) return -1;
+        req.arg0 <<= 20;
+    }
+
+    client_t client;
+    client_open(&client);
+
+    rpc_response_t resp;
+    uint64_t *n_clusters = client_call(&client, &req, NULL, &resp);
+    response_check(&resp, "defragment blob");
+
+    if (*n_clusters == 0) {
+        printf("blob not fragmented\n");
+    } else if (client.fd >= 0) {
+        printf("moving %lu clusters\n", *n_clusters);
+    } else {
+        int timeout;
+        while ((timeout = server_defrag(&client.srv)) >= 0) {
+            if (server_sync(&client.srv) < 0) {
+                perror("failed to defragment blob");
+                exit(1);
+            }
+            if (timeout) usleep(timeout * 1000);
+        }
+        if (server_sync(&client.srv) < 0) {
+            perror("failed to defragment blob");
+            exit(1);
+        }
+        printf("blob defragmented\n");
+    }
+
+    free(n_clusters);
+    client_close(&client);
+    return 0;
+}
+
+static volatile sig_atomic_t serve_stop = 0;
+
+static void serve_signal(int sig) {
+    serve_stop = 1;
+}
 
-        bitset_t nonzero = {0};
-        blob_nonzero(curr, &nonzero);
-        uint32_t used = bitset_size(&nonzero) * 100 / bitset_capacity(&nonzero);
-        bitset_deinit(&nonzero);
-        
-        printf(" 0x%04x 0x%08lx %d%%\n", curr->page_index, array_size(&curr->clusters), used);
-        curr = curr->next;
+/**
+ * Keep the blobstore open and serve requests on `--socket` until
+ * interrupted, then flush the blobstore.
+ */
+int serve_func(command_t *cmd, int argc, char const *argv[]) {
+    if (argc != 1) return -1;
+
+    bdev_t dev;
+    device_open(&dev);
+
+    blobstore_t bs;
+    if (blobstore_open(&bs, &dev) < 0) {
+        fprintf(stderr, "failed to open blobstore\n");
+        exit(1);
     }
 
-    close(fd);
+    server_t srv;
+    if (server_init(&srv, &bs) < 0 || server_listen(&srv, socket_path) < 0) {
+        perror("failed to listen");
+        exit(1);
+    }
+
+    struct sigaction action = {0};
+    action.sa_handler = serve_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    printf("serving on %s\n", socket_path);
+    fflush(stdout);
 
+    int res = server_run(&srv, &serve_stop);
+    if (res < 0) perror("failed to serve");
+
+    server_deinit(&srv);
+    if (blobstore_flush(&bs) < 0) {
+        perror("failed to flush blobstore");
+        res = -1;
+    }
     blobstore_deinit(&bs);
+    bdev_close(&dev);
 
+    if (res < 0) exit(1);
     return 0;
 }
 
@@ -166,7 +1047,61 @@ int blob_cmd_func(command_t *cmd, int argc, char const *argv[]) {
     delete_cmd.brief = "delete a blob.";
     delete_cmd.run = blob_delete_func;
 
-    command_t *subcmds[] = {&create_cmd, &delete_cmd};
+    command_t resize_cmd = {0};
+    resize_cmd.parent = cmd;
+    resize_cmd.name = "resize";
+    resize_cmd.brief = "resize a blob.";
+    resize_cmd.run = blob_resize_func;
+
+    command_t clone_cmd = {0};
+    clone_cmd.parent = cmd;
+    clone_cmd.name = "clone";
+    clone_cmd.brief = "clone a blob.";
+    clone_cmd.run = blob_clone_func;
+
+    command_t snapshot_cmd = {0};
+    snapshot_cmd.parent = cmd;
+    snapshot_cmd.name = "snapshot";
+    snapshot_cmd.brief = "snapshot a blob.";
+    snapshot_cmd.run = blob_snapshot_func;
+
+    command_t info_cmd = {0};
+    info_cmd.parent = cmd;
+    info_cmd.name = "info";
+    info_cmd.brief = "show a blob.";
+    info_cmd.run = blob_info_func;
+
+    command_t read_cmd = {0};
+    read_cmd.parent = cmd;
+    read_cmd.name = "read";
+    read_cmd.brief = "read a blob to stdout.";
+    read_cmd.run = blob_read_func;
+
+    command_t write_cmd = {0};
+    write_cmd.parent = cmd;
+    write_cmd.name = "write";
+    write_cmd.brief = "write stdin to a blob.";
+    write_cmd.run = blob_write_func;
+
+    command_t defrag_cmd = {0};
+    defrag_cmd.parent = cmd;
+    defrag_cmd.name = "defrag";
+    defrag_cmd.brief = "defragment a blob [--rate MB/s].";
+    defrag_cmd.run = blob_defrag_func;
+
+    command_t export_cmd = {0};
+    export_cmd.parent = cmd;
+    export_cmd.name = "export";
+    export_cmd.brief = "export a blob to stdout or a file [--raw].";
+    export_cmd.run = blob_export_func;
+
+    command_t import_cmd = {0};
+    import_cmd.parent = cmd;
+    import_cmd.name = "import";
+    import_cmd.brief = "import a blob from stdin or a file [--raw].";
+    import_cmd.run = blob_import_func;
+
+    command_t *subcmds[] = {&create_cmd, &delete_cmd, &resize_cmd, &clone_cmd, &snapshot_cmd, &info_cmd, &read_cmd, &write_cmd, &defrag_cmd, &export_cmd, &import_cmd};
     if (argc == 1) goto error;
 
     for (int i = 0; i < (sizeof(subcmds) / sizeof(command_t*)); i++) {
@@ -194,7 +1129,25 @@ int blobstore_cmd_func(command_t *cmd, int argc, char const *argv[]) {
     list_cmd.brief = "list all blobs.";
     list_cmd.run = blobstore_list_func;
 
-    command_t *subcmds[] = {&create_cmd, &list_cmd};
+    command_t stats_cmd = {0};
+    stats_cmd.parent = cmd;
+    stats_cmd.name = "stats";
+    stats_cmd.brief = "show statistics.";
+    stats_cmd.run = blobstore_stats_func;
+
+    command_t check_cmd = {0};
+    check_cmd.parent = cmd;
+    check_cmd.name = "check";
+    check_cmd.brief = "check consistency [--repair] [--threads N].";
+    check_cmd.run = blobstore_check_func;
+
+    command_t frag_cmd = {0};
+    frag_cmd.parent = cmd;
+    frag_cmd.name = "frag";
+    frag_cmd.brief = "show fragmentation.";
+    frag_cmd.run = blobstore_frag_func;
+
+    command_t *subcmds[] = {&create_cmd, &list_cmd, &stats_cmd, &check_cmd, &frag_cmd};
     if (argc == 1) goto error;
 
     for (int i = 0; i < (sizeof(subcmds) / sizeof(command_t*)); i++) {
@@ -209,6 +1162,15 @@ error:
     return -1;
 }
 
+void root_options_help() {
+    printf("\nOptions:\n");
+    printf("   -d, --device PATH  block device, regular file, or ram: (default %s).\n", device_path);
+    printf("                      a comma-separated list stripes across several.\n");
+    printf("   -s, --size SIZE    minimum size of a file or RAM disk, e.g. 4G.\n");
+    printf("   --stripe SIZE      stripe size across devices, or 0 to concatenate (default 1M).\n");
+    printf("   -S, --socket PATH  socket of the blobstore daemon (default %s).\n", socket_path);
+}
+
 int root_cmd_func(command_t *cmd, int argc, char const *argv[]) {
     command_t blobstore_cmd = {0};
     blobstore_cmd.parent = cmd;
@@ -222,7 +1184,31 @@ int root_cmd_func(command_t *cmd, int argc, char const *argv[]) {
     blob_cmd.brief = "manage blob.";
     blob_cmd.run = blob_cmd_func;
 
-    command_t *subcmds[] = {&blobstore_cmd, &blob_cmd};
+    command_t serve_cmd = {0};
+    serve_cmd.parent = cmd;
+    serve_cmd.name = "serve";
+    serve_cmd.brief = "serve the blobstore.";
+    serve_cmd.run = serve_func;
+
+    command_t *subcmds[] = {&blobstore_cmd, &blob_cmd, &serve_cmd};
+
+    while (argc > 2 && argv[1][0] == '-') {
+        if (strcmp(argv[1], "-d") == 0 || strcmp(argv[1], "--device") == 0) {
+            device_path = argv[2];
+        } else if (strcmp(argv[1], "-s") == 0 || strcmp(argv[1], "--size") == 0) {
+            if (parse_size(argv[2], &device_size) < 0) goto error;
+        } else if (strcmp(argv[1], "--stripe") == 0) {
+            if (parse_size(argv[2], &stripe_size) < 0) goto error;
+        } else if (strcmp(argv[1], "-S") == 0 || strcmp(argv[1], "--socket") == 0) {
+            socket_path = argv[2];
+        } else {
+            goto error;
+        }
+
+        argv[2] = argv[0];
+        argc -= 2;
+        argv += 2;
+    }
     if (argc == 1) goto error;
 
     for (int i = 0; i < (sizeof(subcmds) / sizeof(command_t*)); i++) {
@@ -234,6 +1220,7 @@ int root_cmd_func(command_t *cmd, int argc, char const *argv[]) {
 
 error:
     cmd_subcommand_help(cmd, subcmds, (sizeof(subcmds) / sizeof(command_t*)));
+    root_options_help();
     return -1;
 }
 
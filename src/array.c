@@ -2,9 +2,10 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 int array_init(array_t *arr, size_t n) {
-    arr->data = (uint32_t*) calloc(n, sizeof(uint32_t));
+    arr->data = (uint32_t*) calloc(n ? n: 1, sizeof(uint32_t));
     if (arr->data == NULL) return -1;
 
     arr->size = n;
@@ -17,6 +18,25 @@ void array_deinit(array_t *arr) {
     arr->size = 0;
 }
 
+/**
+ * Resize `arr` to `n` elements. Elements past the previous size are zeroed.
+ *
+ * \param arr the array.
+ * \param n the new size.
+ * \return 0 if success else -1
+ */
+int array_resize(array_t *arr, size_t n) {
+    uint32_t *data = (uint32_t*) realloc(arr->data, (n ? n: 1) * sizeof(uint32_t));
+    if (data == NULL) return -1;
+
+    if (n > arr->size) {
+        memset(&data[arr->size], 0, (n - arr->size) * sizeof(uint32_t));
+    }
+    arr->data = data;
+    arr->size = n;
+    return 0;
+}
+
 size_t array_size(array_t *arr) {
     return arr->size;
 }
@@ -0,0 +1,478 @@
+#define _GNU_SOURCE
+#include "bdev.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+
+/*
+ * A bdev is the device a blobstore lives on. Each backend provides the
+ * operations of a `bdev_ops_t`. Backends with a file descriptor set `fd`,
+ * which lets I/O queues submit requests to it directly; the RAM disk has
+ * none and is only reached through its operations. A striped device spans
+ * several member devices, and I/O queues reach its members through their
+ * own queues.
+ */
+
+static int fd_read(bdev_t *dev, void *buf, size_t len, uint64_t offset) {
+    ssize_t n = pread(dev->fd, buf, len, offset);
+    return n < 0 || (size_t) n != len ? -1: 0;
+}
+
+static int fd_write(bdev_t *dev, const void *buf, size_t len, uint64_t offset) {
+    ssize_t n = pwrite(dev->fd, buf, len, offset);
+    return n < 0 || (size_t) n != len ? -1: 0;
+}
+
+static size_t iov_length(const struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+static int fd_readv(bdev_t *dev, const struct iovec *iov, int iovcnt, uint64_t offset) {
+    ssize_t n = preadv(dev->fd, iov, iovcnt, offset);
+    return n < 0 || (size_t) n != iov_length(iov, iovcnt) ? -1: 0;
+}
+
+static int fd_writev(bdev_t *dev, const struct iovec *iov, int iovcnt, uint64_t offset) {
+    ssize_t n = pwritev(dev->fd, iov, iovcnt, offset);
+    return n < 0 || (size_t) n != iov_length(iov, iovcnt) ? -1: 0;
+}
+
+static int fd_flush(bdev_t *dev) {
+    return fdatasync(dev->fd);
+}
+
+static void fd_close(bdev_t *dev) {
+    close(dev->fd);
+    dev->fd = -1;
+}
+
+static int blockdev_discard(bdev_t *dev, uint64_t offset, uint64_t len) {
+    uint64_t range[2] = {offset, len};
+    return ioctl(dev->fd, BLKDISCARD, range) < 0 ? -1: 0;
+}
+
+static int file_discard(bdev_t *dev, uint64_t offset, uint64_t len) {
+    return fallocate(dev->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+}
+
+static int ram_read(bdev_t *dev, void *buf, size_t len, uint64_t offset) {
+    if (offset > dev->size || len > dev->size - offset) return -1;
+    memcpy(buf, dev->data + offset, len);
+    return 0;
+}
+
+static int ram_write(bdev_t *dev, const void *buf, size_t len, uint64_t offset) {
+    if (offset > dev->size || len > dev->size - offset) return -1;
+    memcpy(dev->data + offset, buf, len);
+    return 0;
+}
+
+static int ram_readv(bdev_t *dev, const struct iovec *iov, int iovcnt, uint64_t offset) {
+    for (int i = 0; i < iovcnt; i++) {
+        if (ram_read(dev, iov[i].iov_base, iov[i].iov_len, offset) < 0) return -1;
+        offset += iov[i].iov_len;
+    }
+    return 0;
+}
+
+static int ram_writev(bdev_t *dev, const struct iovec *iov, int iovcnt, uint64_t offset) {
+    for (int i = 0; i < iovcnt; i++) {
+        if (ram_write(dev, iov[i].iov_base, iov[i].iov_len, offset) < 0) return -1;
+        offset += iov[i].iov_len;
+    }
+    return 0;
+}
+
+static int ram_flush(bdev_t *dev) {
+    return 0;
+}
+
+static int ram_discard(bdev_t *dev, uint64_t offset, uint64_t len) {
+    if (offset > dev->size || len > dev->size - offset) return -1;
+    memset(dev->data + offset, 0, len);
+    return 0;
+}
+
+static void ram_close(bdev_t *dev) {
+    munmap(dev->data, dev->size);
+    dev->data = NULL;
+}
+
+static int striped_io(bdev_t *dev, const struct iovec *iov, int iovcnt, uint64_t offset, int write) {
+    struct iovec *slice = malloc(iovcnt * sizeof(struct iovec));
+    if (slice == NULL) return -1;
+
+    int res = 0;
+    size_t len = iov_length(iov, iovcnt);
+    for (size_t done = 0; done < len && res == 0;) {
+        uint32_t member;
+        uint64_t member_offset;
+        size_t n = bdev_map(dev, offset + done, len - done, &member, &member_offset);
+        int cnt = bdev_iov_slice(iov, iovcnt, done, n, slice);
+        if (write) {
+            res = bdev_writev(&dev->members[member], slice, cnt, member_offset);
+        } else {
+            res = bdev_readv(&dev->members[member], slice, cnt, member_offset);
+        }
+        done += n;
+    }
+
+    free(slice);
+    return res;
+}
+
+static int striped_read(bdev_t *dev, void *buf, size_t len, uint64_t offset) {
+    struct iovec iov = {buf, len};
+    return striped_io(dev, &iov, 1, offset, 0);
+}
+
+static int striped_write(bdev_t *dev, const void *buf, size_t len, uint64_t offset) {
+    struct iovec iov = {(void*) buf, len};
+    return striped_io(dev, &iov, 1, offset, 1);
+}
+
+static int striped_readv(bdev_t *dev, const struct iovec *iov, int iovcnt, uint64_t offset) {
+    return striped_io(dev, iov, iovcnt, offset, 0);
+}
+
+static int striped_writev(bdev_t *dev, const struct iovec *iov, int iovcnt, uint64_t offset) {
+    return striped_io(dev, iov, iovcnt, offset, 1);
+}
+
+static int striped_flush(bdev_t *dev) {
+    int res = 0;
+    for (uint32_t i = 0; i < dev->n_members; i++) {
+        if (bdev_flush(&dev->members[i]) < 0) res = -1;
+    }
+    return res;
+}
+
+static int striped_discard(bdev_t *dev, uint64_t offset, uint64_t len) {
+    while (len > 0) {
+        uint32_t member;
+        uint64_t member_offset;
+        size_t n = bdev_map(dev, offset, len, &member, &member_offset);
+        if (bdev_discard(&dev->members[member], member_offset, n) < 0) return -1;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void striped_close(bdev_t *dev) {
+    for (uint32_t i = 0; i < dev->n_members; i++) {
+        bdev_close(&dev->members[i]);
+    }
+    free(dev->members);
+    dev->members = NULL;
+    dev->n_members = 0;
+}
+
+static const bdev_ops_t blockdev_ops = {
+    fd_read, fd_write, fd_readv, fd_writev, fd_flush, blockdev_discard, fd_close
+};
+
+static const bdev_ops_t file_ops = {
+    fd_read, fd_write, fd_readv, fd_writev, fd_flush, file_discard, fd_close
+};
+
+static const bdev_ops_t ram_ops = {
+    ram_read, ram_write, ram_readv, ram_writev, ram_flush, ram_discard, ram_close
+};
+
+static const bdev_ops_t striped_ops = {
+    striped_read, striped_write, striped_readv, striped_writev, striped_flush, striped_discard, striped_close
+};
+
+/**
+ * Open the device at `path`. A path of the form `ram:` selects a RAM disk
+ * of `size` bytes, or `BDEV_RAM_SIZE` if `size` is 0. A comma-separated
+ * list of paths selects a device striped across them in units of
+ * `BDEV_STRIPE_SIZE`. Otherwise the backend is chosen from the type of the
+ * file at `path`, and a regular file that does not exist yet is created.
+ *
+ * \param dev the device.
+ * \param path the device path.
+ * \param size the minimum size of a file or RAM disk in bytes, or 0.
+ * \return 0 if success else -1
+ */
+int bdev_open(bdev_t *dev, const char *path, uint64_t size) {
+    if (strchr(path, ',')) {
+        return bdev_open_striped(dev, path, size, BDEV_STRIPE_SIZE);
+    }
+
+    if (strncmp(path, BDEV_RAM_PREFIX, strlen(BDEV_RAM_PREFIX)) == 0) {
+        return bdev_open_ram(dev, size ? size: BDEV_RAM_SIZE);
+    }
+
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISBLK(st.st_mode)) {
+        return bdev_open_blockdev(dev, path);
+    }
+
+    return bdev_open_file(dev, path, size);
+}
+
+/**
+ * Open the raw block device at `path` for direct I/O.
+ *
+ * \param dev the device.
+ * \param path the device path.
+ * \return 0 if success else -1
+ */
+int bdev_open_blockdev(bdev_t *dev, const char *path) {
+    memset(dev, 0, sizeof(bdev_t));
+    dev->ops = &blockdev_ops;
+    dev->fd = open(path, O_RDWR | O_DIRECT);
+    if (dev->fd < 0) return -1;
+
+    size_t block_size;
+    if (ioctl(dev->fd, BLKGETSIZE64, &dev->size) < 0) goto error;
+    if (ioctl(dev->fd, BLKBSZGET, &block_size) < 0) goto error;
+    dev->block_size = block_size;
+
+    return 0;
+
+error:
+    close(dev->fd);
+    return -1;
+}
+
+/**
+ * Open the regular file at `path` as a device, creating it if needed and
+ * growing it to at least `size` bytes. The space is reserved with
+ * `fallocate` where the file system supports it. Direct I/O is used unless
+ * the file system does not support it, as on tmpfs.
+ *
+ * \param dev the device.
+ * \param path the file path.
+ * \param size the minimum size in bytes, or 0.
+ * \return 0 if success else -1
+ */
+int bdev_open_file(bdev_t *dev, const char *path, uint64_t size) {
+    memset(dev, 0, sizeof(bdev_t));
+    dev->ops = &file_ops;
+    dev->block_size = BDEV_FILE_BLOCK_SIZE;
+    dev->fd = open(path, O_RDWR | O_CREAT | O_DIRECT, 0644);
+    if (dev->fd < 0 && errno == EINVAL) {
+        dev->fd = open(path, O_RDWR | O_CREAT, 0644);
+    }
+    if (dev->fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(dev->fd, &st) < 0) goto error;
+    if (!S_ISREG(st.st_mode)) goto error;
+
+    dev->size = st.st_size;
+    if (size > dev->size) {
+        if (fallocate(dev->fd, 0, 0, size) < 0 && ftruncate(dev->fd, size) < 0) goto error;
+        dev->size = size;
+    }
+    dev->size -= dev->size % dev->block_size;
+
+    return 0;
+
+error:
+    close(dev->fd);
+    return -1;
+}
+
+/**
+ * Create a zero-filled RAM disk of `size` bytes. Its content is lost when it
+ * is closed.
+ *
+ * \param dev the device.
+ * \param size the size in bytes.
+ * \return 0 if success else -1
+ */
+int bdev_open_ram(bdev_t *dev, uint64_t size) {
+    memset(dev, 0, sizeof(bdev_t));
+    dev->ops = &ram_ops;
+    dev->fd = -1;
+    dev->block_size = BDEV_FILE_BLOCK_SIZE;
+    dev->size = size - size % dev->block_size;
+    if (dev->size == 0) return -1;
+
+    dev->data = mmap(NULL, dev->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (dev->data == MAP_FAILED) {
+        dev->data = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Open the comma-separated member devices in `paths` as one device. The
+ * device is split into stripes of `stripe_size` bytes, which are dealt out
+ * to the members in turn. A `stripe_size` of 0 concatenates the members
+ * instead. Every member contributes as many bytes as the smallest one, and
+ * `size` is divided evenly among them.
+ *
+ * \param dev the device.
+ * \param paths the comma-separated member paths, in order.
+ * \param size the minimum size of the device in bytes, or 0.
+ * \param stripe_size the stripe size in bytes, or 0.
+ * \return 0 if success else -1
+ */
+int bdev_open_striped(bdev_t *dev, const char *paths, uint64_t size, uint64_t stripe_size) {
+    memset(dev, 0, sizeof(bdev_t));
+    dev->ops = &striped_ops;
+    dev->fd = -1;
+
+    char *list = strdup(paths);
+    dev->members = calloc(BDEV_MAX_MEMBERS, sizeof(bdev_t));
+    if (list == NULL || dev->members == NULL) goto error;
+
+    size_t n = 1;
+    for (const char *c = paths; *c; c++) {
+        if (*c == ',') n++;
+    }
+    if (n > BDEV_MAX_MEMBERS) goto error;
+
+    char *save = NULL;
+    for (char *path = strtok_r(list, ",", &save); path; path = strtok_r(NULL, ",", &save)) {
+        bdev_t *member = &dev->members[dev->n_members];
+        if (bdev_open(member, path, size ? (size - 1) / n + 1: 0) < 0) goto error;
+        dev->n_members++;
+
+        if (dev->n_members == 1) dev->block_size = member->block_size;
+        if (member->block_size != dev->block_size) goto error;
+        if (dev->n_members == 1 || member->size < dev->member_size) dev->member_size = member->size;
+    }
+    if (dev->n_members != n) goto error;
+
+    dev->stripe_size = stripe_size ? stripe_size: dev->member_size;
+    if (dev->stripe_size % dev->block_size) goto error;
+    dev->member_size -= dev->member_size % dev->stripe_size;
+    dev->size = dev->member_size * n;
+    if (dev->size == 0) goto error;
+
+    free(list);
+    return 0;
+
+error:
+    if (dev->members) striped_close(dev);
+    free(dev->members);
+    free(list);
+    return -1;
+}
+
+void bdev_close(bdev_t *dev) {
+    dev->ops->close(dev);
+}
+
+uint64_t bdev_size(bdev_t *dev) {
+    return dev->size;
+}
+
+uint32_t bdev_block_size(bdev_t *dev) {
+    return dev->block_size;
+}
+
+int bdev_read(bdev_t *dev, void *buf, size_t len, uint64_t offset) {
+    return dev->ops->read(dev, buf, len, offset);
+}
+
+int bdev_write(bdev_t *dev, const void *buf, size_t len, uint64_t offset) {
+    return dev->ops->write(dev, buf, len, offset);
+}
+
+int bdev_readv(bdev_t *dev, const struct iovec *iov, int iovcnt, uint64_t offset) {
+    return dev->ops->readv(dev, iov, iovcnt, offset);
+}
+
+int bdev_writev(bdev_t *dev, const struct iovec *iov, int iovcnt, uint64_t offset) {
+    return dev->ops->writev(dev, iov, iovcnt, offset);
+}
+
+/**
+ * Make all completed writes to `dev` durable.
+ *
+ * \param dev the device.
+ * \return 0 if success else -1
+ */
+int bdev_flush(bdev_t *dev) {
+    return dev->ops->flush(dev);
+}
+
+/**
+ * Tell `dev` that the byte range [`offset`, `offset + len`) no longer holds
+ * data. It reads back as zeros or as its old content.
+ *
+ * \param dev the device.
+ * \param offset the byte offset.
+ * \param len the length in bytes.
+ * \return 0 if success else -1
+ */
+int bdev_discard(bdev_t *dev, uint64_t offset, uint64_t len) {
+    return dev->ops->discard(dev, offset, len);
+}
+
+/**
+ * Find where the byte range [`offset`, `offset + len`) of `dev` starts on
+ * its members. A device without members is its own member 0.
+ *
+ * \param dev the device.
+ * \param offset the byte offset.
+ * \param len the length in bytes.
+ * \param member the index of the member holding `offset`.
+ * \param member_offset the byte offset on that member.
+ * \return the length of the part of the range stored contiguously there.
+ */
+size_t bdev_map(bdev_t *dev, uint64_t offset, size_t len, uint32_t *member, uint64_t *member_offset) {
+    if (dev->n_members == 0) {
+        *member = 0;
+        *member_offset = offset;
+        return len;
+    }
+
+    uint64_t stripe = offset / dev->stripe_size;
+    uint64_t within = offset % dev->stripe_size;
+    *member = stripe % dev->n_members;
+    *member_offset = stripe / dev->n_members * dev->stripe_size + within;
+    return len < dev->stripe_size - within ? len: dev->stripe_size - within;
+}
+
+/**
+ * Describe the `len` bytes after the first `skip` bytes of the buffers of
+ * `iov` with iovecs stored in `out`, which has room for `iovcnt` of them.
+ *
+ * \param iov the buffers.
+ * \param iovcnt the number of buffers.
+ * \param skip the number of bytes to skip.
+ * \param len the number of bytes to describe.
+ * \param out the iovecs receiving the slice.
+ * \return the number of iovecs in the slice.
+ */
+int bdev_iov_slice(const struct iovec *iov, int iovcnt, size_t skip, size_t len, struct iovec *out) {
+    int n = 0;
+    for (int i = 0; i < iovcnt && len > 0; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+
+        size_t m = iov[i].iov_len - skip;
+        if (m > len) m = len;
+        out[n].iov_base = (uint8_t*) iov[i].iov_base + skip;
+        out[n].iov_len = m;
+        n++;
+        len -= m;
+        skip = 0;
+    }
+    return n;
+}
@@ -1,36 +1,497 @@
 #include "bitset.h"
+#include "stats.h"
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+
+/*
+ * The set is stored as 64-bit words plus two summary levels with one bit per
+ * word: `full` is set when the word has no free bits left and `empty` when it
+ * has no used bits. Bits past the capacity are kept set so that searches
+ * never return them.
+ *
+ * The clear runs are also indexed for allocation. Each run is a node on the
+ * doubly linked list of its size class, the floor of the base-2 logarithm of
+ * its length, and an open-addressing hash table finds a node from the start
+ * of its run. Changing a range of bits re-indexes only the runs touching it,
+ * so a best-fit search visits a bounded number of runs whatever the
+ * fragmentation. The index is only built by the first extent allocation, so
+ * sets used for single bits do not pay for it. If it cannot grow, it is
+ * dropped and the searches fall back to scanning the bits.
+ */
+
+#define ceil_div_ul(a, b) (((a) + (b) - 1) / (b))
+
+#define RUN_NONE UINT32_MAX
+
+static uint64_t word_mask(size_t lo, size_t hi) {
+    uint64_t mask = hi == 64 ? ~0ULL: (1ULL << hi) - 1;
+    return mask & ~((1ULL << lo) - 1);
+}
+
+static void bitset_update_summary(bitset_t *set, size_t word) {
+    uint64_t bit = 1ULL << (word & 63);
+    if (set->words[word] == ~0ULL) {
+        set->full[word >> 6] |= bit;
+    } else {
+        set->full[word >> 6] &= ~bit;
+    }
+    if (set->words[word] == 0) {
+        set->empty[word >> 6] |= bit;
+    } else {
+        set->empty[word >> 6] &= ~bit;
+    }
+}
+
+/**
+ * Find the first clear bit at or after `i`, skipping full words through the
+ * summary level.
+ *
+ * \return the index of the bit, or the capacity if there is none.
+ */
+static size_t bitset_find_clear(bitset_t *set, size_t i) {
+    if (i >= set->capacity) return set->capacity;
+
+    size_t word = i >> 6;
+    uint64_t free_bits = ~set->words[word] & word_mask(i & 63, 64);
+    if (free_bits) {
+        return (word << 6) + __builtin_ctzll(free_bits);
+    }
+
+    size_t n_words = ceil_div_ul(set->capacity, 64);
+    size_t n_summary = ceil_div_ul(n_words, 64);
+    word++;
+    for (size_t s = word >> 6; s < n_summary; s++) {
+        uint64_t open = ~set->full[s];
+        if (s == word >> 6) open &= word_mask(word & 63, 64);
+        if (open == 0) continue;
+
+        size_t w = (s << 6) + __builtin_ctzll(open);
+        return (w << 6) + __builtin_ctzll(~set->words[w]);
+    }
+
+    return set->capacity;
+}
+
+/**
+ * Find the first set bit at or after `i`, skipping empty words through the
+ * summary level. Bits past the capacity are always set, so the search stops
+ * at the capacity.
+ */
+static size_t bitset_find_set(bitset_t *set, size_t i) {
+    if (i >= set->capacity) return set->capacity;
+
+    size_t n_words = ceil_div_ul(set->capacity, 64);
+    size_t n_summary = ceil_div_ul(n_words, 64);
+    size_t word = i >> 6;
+    uint64_t used = set->words[word] & word_mask(i & 63, 64);
+    if (used == 0) {
+        word++;
+        for (size_t s = word >> 6; s < n_summary && used == 0; s++) {
+            uint64_t busy = ~set->empty[s];
+            if (s == word >> 6) busy &= word_mask(word & 63, 64);
+            if (busy == 0) continue;
+
+            word = (s << 6) + __builtin_ctzll(busy);
+            if (word >= n_words) break;
+            used = set->words[word];
+        }
+    }
+    if (used == 0) return set->capacity;
+
+    size_t res = (word << 6) + __builtin_ctzll(used);
+    return res < set->capacity ? res: set->capacity;
+}
+
+/**
+ * Find the first run of clear bits starting at or after `i`.
+ *
+ * \param set the bitset.
+ * \param i the first bit to consider.
+ * \return the run, of length 0 if there is none.
+ */
+extent_t bitset_next_clear_run(bitset_t *set, size_t i) {
+    extent_t run = {0, 0};
+    size_t start = bitset_find_clear(set, i);
+    if (start < set->capacity) {
+        run.start = start;
+        run.len = bitset_find_set(set, start) - start;
+    }
+    return run;
+}
+
+/**
+ * Find the first bit of the clear run that ends just before `i`: one past
+ * the last set bit before `i`, or 0 if there is none.
+ */
+static size_t bitset_run_begin(bitset_t *set, size_t i) {
+    if (i == 0) return 0;
+
+    size_t word = (i - 1) >> 6;
+    uint64_t used = set->words[word] & word_mask(0, ((i - 1) & 63) + 1);
+    if (used) return (word << 6) + 64 - __builtin_clzll(used);
+
+    for (size_t s = (word >> 6) + 1; s-- > 0;) {
+        uint64_t busy = ~set->empty[s];
+        if (s == word >> 6) busy &= word_mask(0, word & 63);
+        if (busy == 0) continue;
+
+        size_t w = (s << 6) + 63 - __builtin_clzll(busy);
+        return (w << 6) + 64 - __builtin_clzll(set->words[w]);
+    }
+
+    return 0;
+}
+
+static size_t run_class(size_t len) {
+    size_t class = 63 - __builtin_clzll(len);
+    return class < BITSET_RUN_CLASSES ? class: BITSET_RUN_CLASSES - 1;
+}
+
+static size_t run_hash(uint32_t start) {
+    uint64_t h = start * 0xff51afd7ed558ccdULL;
+    return (size_t) (h ^ (h >> 32));
+}
+
+static void bitset_index_drop(bitset_t *set) {
+    free(set->runs);
+    free(set->slots);
+    set->indexed = 0;
+    set->runs = NULL;
+    set->n_runs = 0;
+    set->runs_capacity = 0;
+    set->free_runs = RUN_NONE;
+    set->slots = NULL;
+    set->n_slots = 0;
+    for (size_t c = 0; c < BITSET_RUN_CLASSES; c++) {
+        set->classes[c] = RUN_NONE;
+    }
+}
+
+static void bitset_index_place(bitset_t *set, uint32_t r) {
+    size_t mask = set->n_slots - 1;
+    size_t i = run_hash(set->runs[r].start) & mask;
+    while (set->slots[i]) {
+        i = (i + 1) & mask;
+    }
+    set->slots[i] = r + 1;
+}
+
+/**
+ * Make room in the index for one more run: double the node array when it is
+ * used up and the hash table when it would become more than 70% full.
+ *
+ * \return 0 if success else -1
+ */
+static int bitset_index_reserve(bitset_t *set) {
+    if (set->free_runs == RUN_NONE) {
+        size_t capacity = set->runs_capacity ? set->runs_capacity * 2: 16;
+        if (capacity > RUN_NONE) return -1;
+        bitset_run_t *runs = realloc(set->runs, capacity * sizeof(bitset_run_t));
+        if (runs == NULL) return -1;
+        set->runs = runs;
+
+        for (size_t r = set->runs_capacity; r < capacity; r++) {
+            runs[r].next = r + 1 < capacity ? r + 1: RUN_NONE;
+        }
+        set->free_runs = set->runs_capacity;
+        set->runs_capacity = capacity;
+    }
+
+    if ((set->n_runs + 1) * 10 > set->n_slots * 7) {
+        size_t n_slots = set->n_slots ? set->n_slots * 2: 32;
+        uint32_t *slots = calloc(n_slots, sizeof(uint32_t));
+        if (slots == NULL) return -1;
+
+        free(set->slots);
+        set->slots = slots;
+        set->n_slots = n_slots;
+        for (size_t c = 0; c < BITSET_RUN_CLASSES; c++) {
+            for (uint32_t r = set->classes[c]; r != RUN_NONE; r = set->runs[r].next) {
+                bitset_index_place(set, r);
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void bitset_index_add(bitset_t *set, size_t start, size_t len) {
+    if (!set->indexed) return;
+    if (bitset_index_reserve(set) < 0) {
+        bitset_index_drop(set);
+        return;
+    }
+
+    uint32_t r = set->free_runs;
+    bitset_run_t *run = &set->runs[r];
+    set->free_runs = run->next;
+
+    size_t class = run_class(len);
+    run->start = start;
+    run->len = len;
+    run->prev = RUN_NONE;
+    run->next = set->classes[class];
+    if (run->next != RUN_NONE) set->runs[run->next].prev = r;
+    set->classes[class] = r;
+
+    bitset_index_place(set, r);
+    set->n_runs++;
+}
+
+/**
+ * Remove the run starting at `start` from the index.
+ *
+ * \return the length of the run
+ */
+static size_t bitset_index_remove(bitset_t *set, size_t start) {
+    size_t mask = set->n_slots - 1;
+    size_t i = run_hash(start) & mask;
+    for (;;) {
+        assert(set->slots[i]);
+        if (set->runs[set->slots[i] - 1].start == start) break;
+        i = (i + 1) & mask;
+    }
+
+    uint32_t r = set->slots[i] - 1;
+    bitset_run_t *run = &set->runs[r];
+    if (run->prev != RUN_NONE) {
+        set->runs[run->prev].next = run->next;
+    } else {
+        set->classes[run_class(run->len)] = run->next;
+    }
+    if (run->next != RUN_NONE) set->runs[run->next].prev = run->prev;
+    size_t len = run->len;
+    run->next = set->free_runs;
+    set->free_runs = r;
+    set->n_runs--;
+
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (set->slots[j] == 0) break;
+
+        /* Move the entry back unless its home slot lies cyclically in (i, j]. */
+        size_t home = run_hash(set->runs[set->slots[j] - 1].start) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            set->slots[i] = set->slots[j];
+            i = j;
+        }
+    }
+    set->slots[i] = 0;
+    return len;
+}
+
+/**
+ * Remove from the index the clear runs starting in [`from`, `end`], before
+ * the bits in front of `end` change.
+ *
+ * \return the end of the last run removed, or `end` if it is further
+ */
+static size_t bitset_index_unlink(bitset_t *set, size_t from, size_t end) {
+    size_t to = end;
+    size_t i = bitset_find_clear(set, from);
+    while (i <= end && i < set->capacity) {
+        size_t len = bitset_index_remove(set, i);
+        if (i + len > to) to = i + len;
+        i = bitset_find_clear(set, i + len);
+    }
+    return to;
+}
+
+/**
+ * Build the run index if it is not there yet.
+ *
+ * \return 0 if success else -1
+ */
+static int bitset_index_build(bitset_t *set) {
+    if (set->indexed) return 0;
+
+    set->indexed = 1;
+    for (extent_t run = bitset_next_clear_run(set, 0); run.len > 0;
+         run = bitset_next_clear_run(set, run.start + run.len)) {
+        bitset_index_add(set, run.start, run.len);
+    }
+    return set->indexed ? 0: -1;
+}
+
+/**
+ * Rebuild both summary levels from the words and drop the run index, which
+ * the next extent allocation builds again.
+ */
+static void bitset_rebuild(bitset_t *set) {
+    size_t n_words = ceil_div_ul(set->capacity, 64);
+    size_t n_summary = ceil_div_ul(n_words, 64);
+
+    memset(set->full, 0, (n_summary ? n_summary: 1) * sizeof(uint64_t));
+    memset(set->empty, 0, (n_summary ? n_summary: 1) * sizeof(uint64_t));
+    for (size_t w = 0; w < n_words; w++) {
+        bitset_update_summary(set, w);
+    }
+    if (n_words & 63) {
+        set->full[n_summary - 1] |= ~word_mask(0, n_words & 63);
+    }
+
+    bitset_index_drop(set);
+}
 
 int bitset_init(bitset_t *set, size_t capacity) {
+    size_t n_words = ceil_div_ul(capacity, 64);
+    size_t n_summary = ceil_div_ul(n_words, 64);
+
     set->size = 0;
-    set->words = calloc((capacity - 1) / 32 + 1, sizeof(uint32_t));
-    if (set->words == NULL) return -1;
+    set->cursor = 0;
+    set->runs = NULL;
+    set->runs_capacity = 0;
+    set->slots = NULL;
+    set->n_slots = 0;
+    set->words = calloc(n_words ? n_words: 1, sizeof(uint64_t));
+    set->full = calloc(n_summary ? n_summary: 1, sizeof(uint64_t));
+    set->empty = calloc(n_summary ? n_summary: 1, sizeof(uint64_t));
+    if (set->words == NULL || set->full == NULL || set->empty == NULL) {
+        free(set->words);
+        free(set->full);
+        free(set->empty);
+        set->words = NULL;
+        set->full = NULL;
+        set->empty = NULL;
+        return -1;
+    }
     set->capacity = capacity;
+
+    if (capacity & 63) {
+        set->words[n_words - 1] = ~word_mask(0, capacity & 63);
+    }
+    bitset_rebuild(set);
+
+    return 0;
+}
+
+/**
+ * Grow `set` to `capacity` bits. The new bits are clear.
+ *
+ * \param set the bitset.
+ * \param capacity the new capacity, at least the current one.
+ * \return 0 if success else -1
+ */
+int bitset_grow(bitset_t *set, size_t capacity) {
+    if (capacity < set->capacity) return -1;
+
+    size_t old_words = ceil_div_ul(set->capacity, 64);
+    size_t n_words = ceil_div_ul(capacity, 64);
+    size_t n_summary = ceil_div_ul(n_words, 64);
+
+    uint64_t *words = realloc(set->words, (n_words ? n_words: 1) * sizeof(uint64_t));
+    if (words == NULL) return -1;
+    set->words = words;
+
+    uint64_t *full = realloc(set->full, (n_summary ? n_summary: 1) * sizeof(uint64_t));
+    if (full == NULL) return -1;
+    set->full = full;
+
+    uint64_t *empty = realloc(set->empty, (n_summary ? n_summary: 1) * sizeof(uint64_t));
+    if (empty == NULL) return -1;
+    set->empty = empty;
+
+    /* The bits past the old capacity become clear, and those past the new one set. */
+    memset(words + old_words, 0, (n_words - old_words) * sizeof(uint64_t));
+    if (set->capacity & 63) {
+        words[old_words - 1] &= word_mask(0, set->capacity & 63);
+    }
+    if (capacity & 63) {
+        words[n_words - 1] |= ~word_mask(0, capacity & 63);
+    }
+    set->capacity = capacity;
+    bitset_rebuild(set);
+
     return 0;
 }
 
 void bitset_deinit(bitset_t *set) {
     set->size = 0;
     free(set->words);
+    free(set->full);
+    free(set->empty);
     set->words = NULL;
+    set->full = NULL;
+    set->empty = NULL;
+    bitset_index_drop(set);
 }
 
 int bitset_get(bitset_t *set, size_t i) {
-    if (i > set->capacity) return 0;
-    size_t word = i >> 5;
-    size_t bit = i - (word << 5);
-    return (set->words[word] & (1UL << bit)) != 0;
+    if (i >= set->capacity) return 0;
+    return (set->words[i >> 6] >> (i & 63)) & 1;
 }
 
 void bitset_set(bitset_t *set, size_t i, int b) {
-    if (i > set->capacity) return;
-    size_t word = i >> 5;
-    size_t bit = i - (word << 5);
-    set->size += b - bitset_get(set, i);
-    set->words[word] &= ~(1 << bit);
-    set->words[word] |= ((uint32_t) b & 1) << bit;
+    if (i >= set->capacity) return;
+    size_t word = i >> 6;
+    uint64_t bit = 1ULL << (i & 63);
+    int prev = (set->words[word] & bit) != 0;
+    if (prev == (b != 0)) return;
+    if (set->indexed) {
+        bitset_set_range(set, i, 1, b);
+        return;
+    }
+
+    if (b) {
+        set->words[word] |= bit;
+        set->size++;
+    } else {
+        set->words[word] &= ~bit;
+        set->size--;
+    }
+    bitset_update_summary(set, word);
+}
+
+/**
+ * Set (`b` = 1) or clear (`b` = 0) the `n` bits starting at `start`, a word
+ * at a time. Only the clear runs touching the range are re-indexed.
+ *
+ * \param set the bitset.
+ * \param start the first bit.
+ * \param n the number of bits.
+ * \param b the value.
+ */
+void bitset_set_range(bitset_t *set, size_t start, size_t n, int b) {
+    if (start >= set->capacity || n == 0) return;
+    if (n > set->capacity - start) n = set->capacity - start;
+
+    size_t end = start + n;
+    size_t from = 0;
+    size_t to = 0;
+    if (set->indexed) {
+        from = bitset_run_begin(set, start);
+        to = bitset_index_unlink(set, from, end);
+    }
+
+    for (size_t i = start; i < end;) {
+        size_t word = i >> 6;
+        size_t lo = i & 63;
+        size_t hi = end - (word << 6) < 64 ? end - (word << 6): 64;
+        uint64_t mask = word_mask(lo, hi);
+
+        uint64_t prev = set->words[word];
+        if (b) {
+            set->words[word] |= mask;
+            set->size += __builtin_popcountll(~prev & mask);
+        } else {
+            set->words[word] &= ~mask;
+            set->size -= __builtin_popcountll(prev & mask);
+        }
+        bitset_update_summary(set, word);
+
+        i = (word << 6) + hi;
+    }
+
+    /* Setting keeps the parts of the runs outside the range, clearing merges them. */
+    if (b) {
+        if (from < start) bitset_index_add(set, from, start - from);
+        if (end < to) bitset_index_add(set, end, to - end);
+    } else {
+        bitset_index_add(set, from, to - from);
+    }
 }
 
 size_t bitset_capacity(bitset_t *set) {
@@ -41,23 +502,260 @@ size_t bitset_size(bitset_t *set) {
     return set->size;
 }
 
-int bitset_alloc(bitset_t *set, uint32_t *arr, size_t n) {
-    size_t j = 0;
-    for (size_t i = 0; i < bitset_capacity(set); i++) {
-        if (j == n) break;
-        if (bitset_get(set, i) == 0) {
-            bitset_set(set, i, 1);
-            arr[j++] = i;
+/**
+ * The size in bytes of the serialized form of `set`.
+ */
+size_t bitset_bytes(bitset_t *set) {
+    return ceil_div_ul(set->capacity, 64) * sizeof(uint64_t);
+}
+
+/**
+ * Serialize the bits of `set` into `buf`, which must hold `bitset_bytes(set)`
+ * bytes.
+ *
+ * \param set the bitset.
+ * \param buf the destination buffer.
+ */
+void bitset_store(bitset_t *set, void *buf) {
+    memcpy(buf, set->words, bitset_bytes(set));
+}
+
+/**
+ * Replace the bits of `set` with the serialized form in `buf` and rebuild
+ * the summary levels, the run index and the size.
+ *
+ * \param set the bitset.
+ * \param buf the source buffer of `bitset_bytes(set)` bytes.
+ */
+void bitset_load(bitset_t *set, const void *buf) {
+    size_t n_words = ceil_div_ul(set->capacity, 64);
+    memcpy(set->words, buf, bitset_bytes(set));
+
+    set->size = 0;
+    set->cursor = 0;
+    for (size_t w = 0; w < n_words; w++) {
+        if (w == n_words - 1 && (set->capacity & 63)) {
+            set->words[w] |= ~word_mask(0, set->capacity & 63);
+            set->size += __builtin_popcountll(set->words[w] & word_mask(0, set->capacity & 63));
+        } else {
+            set->size += __builtin_popcountll(set->words[w]);
         }
     }
-    
-    if (j == n) return 0;
+    bitset_rebuild(set);
+}
 
-    for (size_t i = 0; i < j; i++) {
-        bitset_set(set, arr[i], 0);
+/**
+ * Find the best fit by scanning every clear run, for when the run index has
+ * been dropped.
+ */
+static extent_t bitset_scan_fit(bitset_t *set, size_t n) {
+    extent_t fit = {0, 0};
+    extent_t largest = {0, 0};
+    size_t n_runs = 0;
+
+    size_t i = bitset_find_clear(set, 0);
+    while (i < set->capacity) {
+        size_t end = bitset_find_set(set, i);
+        size_t len = end - i;
+        n_runs++;
+
+        if (len >= n && (fit.len == 0 || len < fit.len)) {
+            fit.start = i;
+            fit.len = len;
+            if (len == n) break;
+        }
+        if (len > largest.len) {
+            largest.start = i;
+            largest.len = len;
+        }
+
+        i = bitset_find_clear(set, end);
     }
 
-    return -1;
+    stats_record(STAT_ALLOC_SCAN_RUNS, n_runs);
+    return fit.len ? fit: largest;
+}
+
+/**
+ * Visit up to `max_visits` runs of size class `c`, keeping in `fit` the
+ * smallest run of at least `n` bits.
+ *
+ * \return the number of runs visited
+ */
+static size_t bitset_fit_class(bitset_t *set, size_t c, size_t n, size_t max_visits, extent_t *fit) {
+    size_t n_visited = 0;
+    for (uint32_t r = set->classes[c]; r != RUN_NONE && n_visited < max_visits; r = set->runs[r].next) {
+        bitset_run_t *run = &set->runs[r];
+        n_visited++;
+        if (run->len >= n && (fit->len == 0 || run->len < fit->len)) {
+            fit->start = run->start;
+            fit->len = run->len;
+            if (run->len == n) break;
+        }
+    }
+    return n_visited;
+}
+
+/**
+ * Find the clear run that best fits `n` bits: the smallest run of at least
+ * `n` bits, or the largest run if none is long enough. The search starts at
+ * the size class of `n` and looks at no more than `BITSET_FIT_SCAN` runs of
+ * each class, so the fit is the best among the runs visited. With `whole`, a
+ * run shorter than `n` is of no use, and the class of `n`, which also holds
+ * shorter runs, is searched to the end before giving up.
+ */
+static extent_t bitset_best_fit(bitset_t *set, size_t n, int whole) {
+    if (bitset_index_build(set) < 0) return bitset_scan_fit(set, n);
+
+    extent_t fit = {0, 0};
+    size_t n_runs = 0;
+    size_t first = run_class(n);
+
+    for (size_t c = first; c < BITSET_RUN_CLASSES && fit.len == 0; c++) {
+        n_runs += bitset_fit_class(set, c, n, BITSET_FIT_SCAN, &fit);
+    }
+    if (fit.len == 0 && whole) {
+        n_runs += bitset_fit_class(set, first, n, SIZE_MAX, &fit);
+    }
+
+    /* Nothing is long enough: every run is in the class of `n` or below. */
+    for (size_t c = first + 1; c-- > 0 && fit.len == 0;) {
+        size_t n_visited = 0;
+        for (uint32_t r = set->classes[c]; r != RUN_NONE && n_visited < BITSET_FIT_SCAN; r = set->runs[r].next) {
+            bitset_run_t *run = &set->runs[r];
+            n_visited++;
+            if (run->len > fit.len) {
+                fit.start = run->start;
+                fit.len = run->len;
+            }
+        }
+        n_runs += n_visited;
+    }
+
+    stats_record(STAT_ALLOC_SCAN_RUNS, n_runs);
+    return fit;
+}
+
+/**
+ * Allocate `n` clear bits as a small number of contiguous runs. The run
+ * starting at `hint` is extended first when it is clear, so that appending to
+ * an existing extent stays sequential. The remainder is placed best-fit: the
+ * smallest free run that holds it, or else the largest runs available.
+ *
+ * \param set the bitset.
+ * \param n the number of bits to allocate.
+ * \param hint the preferred first bit, or the capacity for no preference.
+ * \param extents the array receiving the allocated runs.
+ * \param max_extents the capacity of `extents`.
+ * \return the number of runs if success else -1
+ */
+int bitset_alloc_extents(bitset_t *set, size_t n, size_t hint, extent_t *extents, size_t max_extents) {
+    if (n > set->capacity - set->size) return -1;
+
+    size_t n_extents = 0;
+    while (n > 0) {
+        if (n_extents == max_extents) {
+            bitset_free_extents(set, extents, n_extents);
+            return -1;
+        }
+
+        extent_t run = {0, 0};
+        if (n_extents == 0 && hint < set->capacity && !bitset_get(set, hint)) {
+            run.start = hint;
+            run.len = bitset_find_set(set, hint) - hint;
+        } else {
+            run = bitset_best_fit(set, n, n_extents + 1 == max_extents);
+        }
+        assert(run.len > 0);
+
+        if (run.len > n) run.len = n;
+        bitset_set_range(set, run.start, run.len, 1);
+        extents[n_extents++] = run;
+        n -= run.len;
+    }
+
+    return n_extents;
+}
+
+/**
+ * Allocate up to `n` clear bits as at most `max_extents` runs, taking the
+ * smallest clear runs first so that the long runs are kept for large
+ * allocations. The runs are taken in one pass over the size classes.
+ *
+ * \param set the bitset.
+ * \param n the maximum number of bits to allocate.
+ * \param extents the array receiving the allocated runs.
+ * \param max_extents the capacity of `extents`.
+ * \return the number of runs
+ */
+size_t bitset_alloc_holes(bitset_t *set, size_t n, extent_t *extents, size_t max_extents) {
+    size_t n_extents = 0;
+
+    if (bitset_index_build(set) < 0) {
+        extent_t run = bitset_next_clear_run(set, 0);
+        while (n > 0 && n_extents < max_extents && run.len > 0) {
+            if (run.len > n) run.len = n;
+            bitset_set_range(set, run.start, run.len, 1);
+            extents[n_extents++] = run;
+            n -= run.len;
+            run = bitset_next_clear_run(set, run.start + run.len);
+        }
+        stats_record(STAT_ALLOC_SCAN_RUNS, n_extents);
+        return n_extents;
+    }
+
+    for (size_t c = 0; c < BITSET_RUN_CLASSES; c++) {
+        while (n > 0 && n_extents < max_extents && set->classes[c] != RUN_NONE) {
+            bitset_run_t *run = &set->runs[set->classes[c]];
+            extent_t hole = {run->start, run->len < n ? run->len: n};
+            bitset_set_range(set, hole.start, hole.len, 1);
+            extents[n_extents++] = hole;
+            n -= hole.len;
+        }
+    }
+
+    stats_record(STAT_ALLOC_SCAN_RUNS, n_extents);
+    return n_extents;
+}
+
+void bitset_free_extents(bitset_t *set, extent_t *extents, size_t n_extents) {
+    for (size_t i = 0; i < n_extents; i++) {
+        bitset_set_range(set, extents[i].start, extents[i].len, 0);
+    }
+}
+
+/**
+ * Allocate `n` clear bits, storing their indices in `arr`. The search is
+ * next-fit: it resumes where the previous allocation stopped and wraps
+ * around once.
+ *
+ * \param set the bitset.
+ * \param arr the array receiving the allocated indices.
+ * \param n the number of bits to allocate.
+ * \return 0 if success else -1
+ */
+int bitset_alloc(bitset_t *set, uint32_t *arr, size_t n) {
+    if (n > set->capacity - set->size) return -1;
+
+    size_t i = set->cursor;
+    for (size_t j = 0; j < n; j++) {
+        size_t from = i >> 6;
+        size_t n_words = 0;
+        i = bitset_find_clear(set, i);
+        if (i == set->capacity) {
+            n_words = ((set->capacity + 63) >> 6) - from;
+            from = 0;
+            i = bitset_find_clear(set, 0);
+        }
+        assert(i < set->capacity);
+        stats_record(STAT_ALLOC_SCAN_WORDS, n_words + (i >> 6) - from + 1);
+
+        bitset_set(set, i, 1);
+        arr[j] = i++;
+    }
+
+    set->cursor = i < set->capacity ? i: 0;
+    return 0;
 }
 
 void bitset_free(bitset_t *set, uint32_t *arr, size_t n) {
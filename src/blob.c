@@ -4,6 +4,7 @@
 #include "bitset.h"
 #include "array.h"
 #include "util.h"
+#include "stats.h"
 
 #include <fcntl.h>
 #include <unistd.h>
@@ -12,14 +13,24 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
-
-#include <sys/ioctl.h>
-#include <linux/fs.h>
+#include <limits.h>
 
 #define PAGE_SIZE 4096
 
+#define BLOBSTORE_MAGIC 0x12345678
+#define BLOBSTORE_VERSION 7
+
+#define CLUSTER_PAGE_EXTENTS 340
+
+#define DIR_PAGE_ENTRIES 1024
+
+/* The blob page, a directory page, its root page and the superblob page. */
+#define MD_OP_PAGES 4
+
 #define ceil_div_ul(a, b) ((a - 1) / b + 1)
 
+#define page_offset(index) ((uint64_t) (index) * PAGE_SIZE)
+
 typedef struct superblob_page {
     uint32_t magic;
     uint32_t page_shift;
@@ -27,7 +38,19 @@ typedef struct superblob_page {
     uint32_t clusters;
     uint32_t md_shift;
     uint32_t next;
-    uint8_t res20[4072];
+    uint32_t version;
+    uint32_t clean;
+    uint32_t bitmap_page;
+    uint32_t bitmap_pages;
+    uint32_t journal_page;
+    uint32_t journal_pages;
+    uint32_t n_md_extents;
+    map_extent_t md_extents[BLOBSTORE_MD_EXTENTS];
+    uint32_t dir_roots[BLOBSTORE_DIR_ROOTS];
+    uint32_t n_devices;
+    uint64_t stripe_size;
+    uint64_t device_size;
+    uint8_t res3656[440];
 } __attribute__((aligned(PAGE_SIZE))) superblob_page_t;
 
 static_assert(sizeof(superblob_page_t) == PAGE_SIZE);
@@ -37,421 +60,3461 @@ typedef struct blob_page {
     uint8_t uuid[16];
     uint32_t n_clusters;
     uint32_t clusters;
-    uint8_t res28[4068];
+    uint32_t n_allocated;
+    uint32_t flags;
+    uint8_t res36[4060];
 } __attribute__((aligned(PAGE_SIZE))) blob_page_t;
 
 static_assert(sizeof(blob_page_t) == PAGE_SIZE);
 
+/*
+ * A blob's cluster map is stored as a chain of cluster pages holding its
+ * extents in logical order.
+ */
 typedef struct cluster_page {
     uint32_t next;
-    uint32_t clusters[512];
-    uint8_t res2052[2044];
+    uint32_t n_extents;
+    map_extent_t extents[CLUSTER_PAGE_EXTENTS];
+    uint8_t res4088[8];
 } __attribute__((aligned(PAGE_SIZE))) cluster_page_t;
 
 static_assert(sizeof(cluster_page_t) == PAGE_SIZE);
 
-int page_write(int fd, void *page, uint32_t index) {
-    int n_written = pwrite(fd, page, PAGE_SIZE, (uint64_t) index * PAGE_SIZE);
-    if (n_written < 0) {
-        return n_written;
-    }
-
-    return 0;
+/*
+ * The blob directory is a two-level table of blob page indices indexed by
+ * slot. Each root page named in the superblob page lists the directory
+ * pages of up to DIR_PAGE_ENTRIES * DIR_PAGE_ENTRIES slots, and each
+ * directory page the blob pages of DIR_PAGE_ENTRIES slots. Free entries
+ * are 0. Stores before version 6 chain their blob pages through `next`.
+ */
+typedef struct dir_page {
+    uint32_t entries[DIR_PAGE_ENTRIES];
+} __attribute__((aligned(PAGE_SIZE))) dir_page_t;
+
+static_assert(sizeof(dir_page_t) == PAGE_SIZE);
+
+/*
+ * Locking: all metadata of a blobstore (the blob list and index, loaded
+ * cluster maps and their LRU, the allocators, the page cache, the journal
+ * and the metadata I/O queue) is guarded by the recursive `bs->lock`. Each
+ * blob also has a reader-writer lock, held shared across data I/O that only
+ * reads its cluster map and exclusively by anything that changes or unloads
+ * the map, so data I/O to a loaded map does not need `bs->lock` to read it.
+ * Blob locks are always taken before `bs->lock`, which is never held across
+ * data I/O. The default channel of the blobstore has its own lock, taken
+ * before either of them.
+ */
+static void blobstore_lock(blobstore_t *bs) {
+    pthread_mutex_lock(&bs->lock);
 }
 
-int page_read(int fd, void *page, uint32_t index) {
-    int n_read = pread(fd, page, PAGE_SIZE, (uint64_t) index * PAGE_SIZE);
-    if (n_read < 0) {
-        return n_read;
-    }
+static void blobstore_unlock(blobstore_t *bs) {
+    pthread_mutex_unlock(&bs->lock);
+}
 
-    return 0;
+static void blobstore_locks_init(blobstore_t *bs) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&bs->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_mutex_init(&bs->channel_lock, NULL);
 }
 
-int blobstore_write_blob_page(blobstore_t *bs, blob_t *blob, blob_t *next) {
-    blob_page_t blob_page = {0};
-    blob_page.next = next ? next->page_index: 0;
-    blob_page.n_clusters = array_size(&blob->clusters);
-    blob_page.clusters = array_get(&blob->cluster_page_indices, 0);
-    memcpy(blob_page.uuid, blob->uuid, 16);
-    
-    if (page_write(bs->fd, &blob_page, blob->page_index) < 0) {
+int page_write(ioq_t *q, void *page, uint32_t index) {
+    if (ioq_write(q, page, PAGE_SIZE, page_offset(index)) < 0) {
         return -1;
     }
 
-    return 0;
+    return ioq_wait(q);
 }
 
-int blobstore_write_superblob_page(blobstore_t *bs, blob_t *head) {
-    superblob_page_t superblob_page = {0};
-    superblob_page.magic = 0x12345678;
-    superblob_page.page_shift = bs->page_shift;
-    superblob_page.cluster_shift = bs->cluster_shift;
-    superblob_page.md_shift = bs->md_shift;
-    superblob_page.next = 0;
-    superblob_page.clusters = bitset_capacity(&bs->clusters);
-    if (head) {
-        superblob_page.next = head->page_index;
+int page_read(ioq_t *q, void *page, uint32_t index) {
+    if (ioq_read(q, page, PAGE_SIZE, page_offset(index)) < 0) {
+        return -1;
     }
 
-    return page_write(bs->fd, &superblob_page, 0);
+    return ioq_wait(q);
 }
 
-size_t llog2(size_t x) {
-    size_t res = 0;
-    while (x >>= 1) ++res;
-    return res;
+static uint64_t cluster_pages(blobstore_t *bs) {
+    return (1ULL << bs->page_shift << bs->cluster_shift) / PAGE_SIZE;
 }
 
-int blobstore_init(blobstore_t *bs, int fd) {
-    bs->fd = fd;
-
-    uint64_t size;
-    if (ioctl(fd, BLKGETSIZE64, &size) < 0) {
-        perror("failed to get block device size");
-        exit(1);
+/**
+ * Translate the metadata page `index` to its home page on the device. The
+ * metadata region is a list of cluster extents through which the metadata
+ * pages are numbered consecutively. The cache and the journal track
+ * metadata pages by their home page.
+ *
+ * \param bs the blobstore.
+ * \param index the metadata page index.
+ * \param home the home page.
+ * \return 0 if success else -1
+ */
+static int md_page(blobstore_t *bs, uint32_t index, uint32_t *home) {
+    uint64_t pages_per_cluster = cluster_pages(bs);
+    uint64_t lcluster = index / pages_per_cluster;
+
+    size_t lo = 0;
+    size_t hi = bs->n_md_extents;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        map_extent_t *ext = &bs->md_extents[mid];
+        if ((uint64_t) ext->lcluster + ext->len <= lcluster) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
     }
+    if (lo == bs->n_md_extents) return -1;
 
-    size_t logical_block_size;
-    if (ioctl(fd, BLKBSZGET, &logical_block_size) < 0) {
-        perror("failed to get block device logical block size");
-        exit(1);
-    }
+    map_extent_t *ext = &bs->md_extents[lo];
+    *home = (ext->pcluster + (lcluster - ext->lcluster)) * pages_per_cluster + index % pages_per_cluster;
+    return 0;
+}
 
-    bs->page_shift = llog2(logical_block_size);
-    bs->cluster_shift = 8;
-    bs->md_shift = 0;
-    bs->head = NULL;
+/**
+ * Store `page` as the new content of the metadata page `index` in the
+ * cache. It reaches the journal with the next commit. This fails if the
+ * page would not fit in the pending transaction or the cache, which the
+ * operation prevents by calling `md_reserve` first.
+ *
+ * \param bs the blobstore.
+ * \param page the page.
+ * \param index the page index.
+ * \return 0 if success else -1
+ */
+int md_write(blobstore_t *bs, void *page, uint32_t index) {
+    uint32_t home;
+    if (md_page(bs, index, &home) < 0) return -1;
+
+    void *frame = cache_lookup(&bs->cache, home);
+    int pending = frame && cache_get_frame(&bs->cache, frame)->pending;
+    if (!pending && bs->cache.n_pending == JOURNAL_TX_PAGES) return -1;
+    if (frame == NULL) frame = cache_insert(&bs->cache, home);
+    if (frame == NULL) return -1;
+
+    memcpy(frame, page, PAGE_SIZE);
+    cache_set_dirty(&bs->cache, frame);
+    return 0;
+}
 
-    size_t n_md_pages = 1UL << bs->cluster_shift << bs->md_shift;
-    if (bitset_init(&bs->md_pages, n_md_pages) < 0) return -1;
-    bitset_set(&bs->md_pages, 0, 1);
+/**
+ * Make room for an operation that stages up to `n_pages` metadata pages, by
+ * committing the pending updates if the transaction is too full and
+ * checkpointing them if the cache has too few clean frames. It must be
+ * called with the blobstore locked before the operation stages anything or
+ * queues clusters for release, so that only whole operations are committed.
+ *
+ * \param bs the blobstore.
+ * \param n_pages the number of pages the operation may stage.
+ * \return 0 if success else -1
+ */
+static int md_reserve(blobstore_t *bs, size_t n_pages) {
+    if (n_pages > JOURNAL_TX_PAGES) return -1;
 
-    size_t n_clusters = size >> bs->page_shift >> bs->cluster_shift;
-    if (bitset_init(&bs->clusters, n_clusters) < 0) return -1;
-    for (size_t i = 0; i < (1UL << bs->md_shift); i++) {
-        bitset_set(&bs->clusters, i, 1);
+    if (bs->cache.n_pending + n_pages > JOURNAL_TX_PAGES && blobstore_commit(bs) < 0) {
+        return -1;
     }
-
-    if (blobstore_write_superblob_page(bs, NULL) < 0) {
+    if (bs->cache.n_frames - bs->cache.n_dirty < n_pages &&
+        (blobstore_commit(bs) < 0 || journal_checkpoint(&bs->journal, &bs->cache) < 0)) {
         return -1;
     }
 
     return 0;
 }
 
-void blob_deinit(blob_t *blob) {
-    array_deinit(&blob->clusters);
-    array_deinit(&blob->cluster_page_indices);
+/**
+ * Keep a clean copy of the metadata page just read from the home page
+ * `home`, unless the cache has no clean frame to spare.
+ */
+static void md_fill(blobstore_t *bs, void *page, uint32_t home) {
+    void *frame = cache_insert(&bs->cache, home);
+    if (frame) memcpy(frame, page, PAGE_SIZE);
 }
 
-int clusters_read(int fd, blob_t *blob, uint32_t i, uint32_t page_index) {
-    cluster_page_t cluster_page;
-    if (page_read(fd, &cluster_page, page_index) < 0) {
-        return -1;
-    }
-
-    array_set(&blob->cluster_page_indices, i, page_index);
-    
-    size_t n_clusters = array_size(&blob->clusters);
-    size_t n = 512 * (i + 1) > n_clusters ? n_clusters % 512: 512;
-    uint32_t *ref = array_get_ref(&blob->clusters, 512 * i);
-    memcpy(ref, cluster_page.clusters, n * sizeof(uint32_t));
-    if (cluster_page.next) {
-        if (i + 1 == array_size(&blob->cluster_page_indices)) return -1;
-        return clusters_read(fd, blob, i + 1, cluster_page.next);
+/**
+ * Read the metadata page `index` through the cache.
+ *
+ * \param bs the blobstore.
+ * \param page the destination page.
+ * \param index the page index.
+ * \return 0 if success else -1
+ */
+int md_read(blobstore_t *bs, void *page, uint32_t index) {
+    uint32_t home;
+    if (md_page(bs, index, &home) < 0) return -1;
+
+    void *frame = cache_lookup(&bs->cache, home);
+    if (frame) {
+        stats_add(STAT_CACHE_HITS, 1);
+        memcpy(page, frame, PAGE_SIZE);
+        return 0;
     }
+    stats_add(STAT_CACHE_MISSES, 1);
 
+    if (page_read(&bs->ioq, page, home) < 0) return -1;
+    md_fill(bs, page, home);
     return 0;
 }
 
-int blob_read_one(int fd, uint32_t page_index, blob_t *blob, uint32_t *next) {
-    blob_page_t blob_page;
-    if (page_read(fd, &blob_page, page_index) < 0) {
-        return -1;
+int blobstore_write_blob_page(blobstore_t *bs, blob_t *blob) {
+    blob_page_t blob_page = {0};
+    blob_page.n_clusters = blob->n_clusters;
+    blob_page.n_allocated = blob->n_allocated;
+    blob_page.flags = blob->flags;
+    if (array_size(&blob->cluster_page_indices)) {
+        blob_page.clusters = array_get(&blob->cluster_page_indices, 0);
     }
-
-    if (blob_page.n_clusters == 0) return -1;
-
-    blob->page_index = page_index;
-    memcpy(blob->uuid, blob_page.uuid, 16);
-
-    if (array_init(&blob->clusters, blob_page.n_clusters) < 0) {
+    memcpy(blob_page.uuid, blob->uuid, 16);
+    
+    if (md_write(bs, &blob_page, blob->page_index) < 0) {
         return -1;
     }
 
-    size_t n_cluster_pages = ceil_div_ul(blob_page.n_clusters, 512);
-    if (array_init(&blob->cluster_page_indices, n_cluster_pages) < 0) {
-        goto error0;
-    }
-
-    if (clusters_read(fd, blob, 0, blob_page.clusters) < 0) {
-        goto error1;
-    }
-
-    *next = blob_page.next;
-
     return 0;
-
-error1:
-    array_deinit(&blob->cluster_page_indices);
-error0:
-    array_deinit(&blob->clusters);
-    return -1;
 }
 
-void blob_list_deinit(blob_t *head) {
-    blob_t *iter = head;
-    while (iter) {
-        blob_t *next = iter->next;
-        blob_deinit(iter);
-        free(iter);
-        iter = next;
+/**
+ * Set or clear the bits of `set` named by the nonzero entries of `indices`.
+ * Runs of consecutive indices are applied as a single range.
+ *
+ * \param set the bitset.
+ * \param indices the indices, where 0 marks an unused entry.
+ * \param b the value.
+ */
+void bitset_set_indices(bitset_t *set, array_t *indices, int b) {
+    size_t n = array_size(indices);
+    size_t i = 0;
+    while (i < n) {
+        uint32_t start = array_get(indices, i++);
+        if (start == 0) continue;
+
+        size_t len = 1;
+        while (i < n && array_get(indices, i) == start + len) {
+            i++;
+            len++;
+        }
+        bitset_set_range(set, start, len, b);
     }
 }
 
-int blob_read(int fd, uint32_t next_page_index, blob_t **res) {
-    blob_t *head = NULL;
-    blob_t *prev = NULL;
-    while (next_page_index) {
-        blob_t *blob = (blob_t*) calloc(1, sizeof(blob_t));
-        if (blob == NULL) goto error;
-        if (head == NULL) head = blob;
-
-        if (blob_read_one(fd, next_page_index, blob, &next_page_index) < 0) {
-            free(blob);
-            goto error;
-        }
-
-        blob->prev = prev;
-        if (blob->prev) {
-            blob->prev->next = blob;
+/**
+ * Allocate `n` bits of `set` in as few contiguous runs as possible, starting
+ * at `hint` when it is free, and store the individual indices in `arr`.
+ *
+ * \param set the bitset.
+ * \param arr the array receiving the allocated indices.
+ * \param n the number of bits.
+ * \param hint the preferred first index.
+ * \return 0 if success else -1
+ */
+int bitset_alloc_runs(bitset_t *set, uint32_t *arr, size_t n, size_t hint) {
+    extent_t *extents = (extent_t*) calloc(n, sizeof(extent_t));
+    if (extents == NULL) return -1;
+
+    int n_extents = bitset_alloc_extents(set, n, hint, extents, n);
+    for (int i = 0; i < n_extents; i++) {
+        for (uint32_t j = 0; j < extents[i].len; j++) {
+            *arr++ = extents[i].start + j;
         }
-        prev = blob;
     }
-    
-    *res = head;
-    return 0;
 
-error:
-    blob_list_deinit(head);
-    return -1;
+    free(extents);
+    return n_extents < 0 ? -1: 0;
 }
 
-int blobstore_open(blobstore_t *bs, int fd) {
-
-    uint64_t size;
-    if (ioctl(fd, BLKGETSIZE64, &size) < 0) {
-        perror("failed to get block device size");
-        exit(1);
-    }
-
-    size_t logical_block_size;
-    if (ioctl(fd, BLKBSZGET, &logical_block_size) < 0) {
-        perror("failed to get block device logical block size");
-        exit(1);
-    }
-
-    superblob_page_t sb;
-    if (page_read(fd, &sb, 0) < 0) {
-        return -1;
-    }
-
-    if (logical_block_size != 1ULL << sb.page_shift) return -1;
-    uint64_t cluster_size_bytes = (1ULL << sb.page_shift << sb.cluster_shift);
-    if (size < sb.clusters * cluster_size_bytes) return -1;
-
-    bs->fd = fd;
-    bs->page_shift = sb.page_shift;
-    bs->cluster_shift = sb.cluster_shift;
-    bs->md_shift = sb.md_shift;
-
-    size_t n_md_pages = 1UL << bs->cluster_shift << bs->md_shift;
-    if (bitset_init(&bs->md_pages, n_md_pages) < 0) return -1;
-    bitset_set(&bs->md_pages, 0, 1);
-
-    if (bitset_init(&bs->clusters, sb.clusters) < 0) return -1;
-    for (size_t i = 0; i < (1UL << bs->md_shift); i++) {
-        bitset_set(&bs->clusters, i, 1);
-    }
+static size_t blob_map_pages(blob_t *blob) {
+    size_t n_extents = extent_map_size(&blob->clusters);
+    return (n_extents + CLUSTER_PAGE_EXTENTS - 1) / CLUSTER_PAGE_EXTENTS;
+}
 
-    if (blob_read(bs->fd, sb.next, &bs->head) < 0) {
-        return -1;
-    }
+/**
+ * Bound the number of metadata pages an operation stages when it persists
+ * the cluster map of `blob` from extent `first` onwards after adding up to
+ * `n_added` extents, for `md_reserve`.
+ */
+static size_t blob_persist_pages(blob_t *blob, size_t first, size_t n_added) {
+    size_t n_extents = extent_map_size(&blob->clusters) + n_added;
+    size_t n_pages = (n_extents + CLUSTER_PAGE_EXTENTS - 1) / CLUSTER_PAGE_EXTENTS;
+    size_t first_page = first / CLUSTER_PAGE_EXTENTS;
+    if (first_page > n_pages) first_page = n_pages;
+
+    /* The page before the first one is relinked when the chain changes length. */
+    return n_pages - first_page + 1 + MD_OP_PAGES;
+}
 
-    for (blob_t *iter = bs->head; iter; iter = iter->next) {
-        bitset_set(&bs->md_pages, iter->page_index, 1);
+void cluster_page_fill(blob_t *blob, size_t i, cluster_page_t *cluster_page) {
+    size_t n_cluster_pages = blob_map_pages(blob);
+    size_t n_extents = extent_map_size(&blob->clusters);
+    size_t first = CLUSTER_PAGE_EXTENTS * i;
+    size_t n = n_extents - first < CLUSTER_PAGE_EXTENTS ? n_extents - first: CLUSTER_PAGE_EXTENTS;
 
-        size_t n_cluster_pages = array_size(&iter->cluster_page_indices);
-        for (size_t i = 0; i < n_cluster_pages; i++) {
-            bitset_set(&bs->md_pages, array_get(&iter->cluster_page_indices, i), 1);
-        }
+    memset(cluster_page, 0, sizeof(cluster_page_t));
+    cluster_page->next = (i + 1) < n_cluster_pages ? array_get(&blob->cluster_page_indices, i + 1): 0;
+    cluster_page->n_extents = n;
+    memcpy(cluster_page->extents, extent_map_get_ref(&blob->clusters, first), n * sizeof(map_extent_t));
+}
 
-        size_t n_clusters = array_size(&iter->clusters);
-        for (size_t i = 0; i < n_clusters; i++) {
-            uint32_t cluster_id = array_get(&iter->clusters, i);
-            if (cluster_id != 0) {
-                bitset_set(&bs->clusters, cluster_id, 1);
-            }
+/**
+ * Stage the cluster pages [`first`, `last`) of `blob`.
+ *
+ * \param bs the blobstore.
+ * \param blob the blob.
+ * \param first the index of the first cluster page.
+ * \param last the index one past the last cluster page.
+ * \return 0 if success else -1
+ */
+int blob_write_cluster_pages(blobstore_t *bs, blob_t *blob, size_t first, size_t last) {
+    cluster_page_t cluster_page;
+    for (size_t i = first; i < last; i++) {
+        cluster_page_fill(blob, i, &cluster_page);
+        if (md_write(bs, &cluster_page, array_get(&blob->cluster_page_indices, i)) < 0) {
+            return -1;
         }
     }
 
     return 0;
 }
 
+static void superblob_page_fill(blobstore_t *bs, superblob_page_t *superblob_page) {
+    memset(superblob_page, 0, sizeof(superblob_page_t));
+    superblob_page->magic = BLOBSTORE_MAGIC;
+    superblob_page->version = BLOBSTORE_VERSION;
+    superblob_page->page_shift = bs->page_shift;
+    superblob_page->cluster_shift = bs->cluster_shift;
+    superblob_page->md_shift = bs->md_shift;
+    superblob_page->clusters = bitset_capacity(&bs->clusters);
+    superblob_page->clean = bs->clean;
+    superblob_page->bitmap_page = bs->bitmap_page;
+    superblob_page->bitmap_pages = bs->bitmap_pages;
+    superblob_page->journal_page = bs->journal_page;
+    superblob_page->journal_pages = bs->journal_pages;
+    superblob_page->n_md_extents = bs->n_md_extents;
+    memcpy(superblob_page->md_extents, bs->md_extents, bs->n_md_extents * sizeof(map_extent_t));
+    memcpy(superblob_page->dir_roots, bs->dir_roots, sizeof(bs->dir_roots));
+    superblob_page->n_devices = bs->dev->n_members ? bs->dev->n_members: 1;
+    superblob_page->stripe_size = bs->dev->stripe_size;
+    superblob_page->device_size = bs->dev->n_members ? bs->dev->member_size: bs->dev->size;
+}
+
+int blobstore_write_superblob_page(blobstore_t *bs) {
+    superblob_page_t superblob_page;
+    superblob_page_fill(bs, &superblob_page);
+    return md_write(bs, &superblob_page, 0);
+}
+
 /**
- * Release all resources associated with the blobstore `bs`.
- * 
- * \param bs the blobstore. 
+ * Write the superblob page to its home location, bypassing the journal, and
+ * flush it. This is only valid while no metadata update is pending.
+ *
+ * \param bs the blobstore.
+ * \return 0 if success else -1
  */
-void blobstore_deinit(blobstore_t *bs) {
-    bitset_deinit(&bs->clusters);
-    bitset_deinit(&bs->md_pages);
-    blob_list_deinit(bs->head);
+static int blobstore_sync_superblob_page(blobstore_t *bs) {
+    superblob_page_t superblob_page;
+    superblob_page_fill(bs, &superblob_page);
+    if (page_write(&bs->ioq, &superblob_page, 0) < 0) return -1;
+
+    void *frame = cache_lookup(&bs->cache, 0);
+    if (frame) memcpy(frame, &superblob_page, PAGE_SIZE);
+
+    return ioq_flush(&bs->ioq);
 }
 
 /**
- * Create a blob of the given size in `n_clusters`. 
- * 
+ * Clear the clean-shutdown flag on disk before the first metadata update
+ * after the blobstore was opened clean. From then on the persisted bitmaps
+ * are stale until `blobstore_deinit` rewrites them.
+ *
  * \param bs the blobstore.
- * \param n_clusters the size of the blob in clusters.
  * \return 0 if success else -1
  */
-int blobstore_create_blob(blobstore_t *bs, uint32_t n_clusters) {
-    uint32_t page_index;
+int blobstore_mark_dirty(blobstore_t *bs) {
+    if (!bs->clean) return 0;
 
-    if (n_clusters == 0) return -1;
-    if (bitset_alloc(&bs->md_pages, &page_index, 1) < 0) {
+    bs->clean = 0;
+    if (blobstore_sync_superblob_page(bs) < 0) {
+        bs->clean = 1;
         return -1;
     }
 
-    blob_t *blob = (blob_t*) calloc(1, sizeof(blob_t));
-    if (blob == NULL) {
-        goto error1;
-    }
+    return 0;
+}
 
-    blob->page_index = page_index;
-    blob->prev = NULL;
-    blob->next = bs->head;
+static int blobstore_grow_md(blobstore_t *bs, size_t n_pages);
 
-    if (uuid_init_random(blob->uuid) < 0) {
-        goto error2;
-    }
+/**
+ * Persist the cluster map of `blob` after the extents from index `first`
+ * onwards have changed. Cluster pages are appended to or released from the
+ * tail of the chain as the number of extents changes, and only the pages
+ * from the one holding extent `first` onwards are rewritten, followed by the
+ * blob page.
+ *
+ * \param bs the blobstore.
+ * \param blob the blob.
+ * \param first the index of the first changed extent.
+ * \return 0 if success else -1
+ */
+int blob_persist_map(blobstore_t *bs, blob_t *blob, size_t first) {
+    if (blobstore_mark_dirty(bs) < 0) return -1;
+
+    size_t n_pages = array_size(&blob->cluster_page_indices);
+    size_t n_needed = blob_map_pages(blob);
+    size_t first_page = first / CLUSTER_PAGE_EXTENTS;
+
+    if (n_needed > n_pages) {
+        if (array_resize(&blob->cluster_page_indices, n_needed) < 0) return -1;
+
+        size_t hint = n_pages ? array_get(&blob->cluster_page_indices, n_pages - 1) + 1: blob->page_index + 1;
+        uint32_t *ref = array_get_ref(&blob->cluster_page_indices, n_pages);
+        if (bitset_alloc_runs(&bs->md_pages, ref, n_needed - n_pages, hint) < 0 &&
+            (blobstore_grow_md(bs, n_needed - n_pages) < 0 ||
+             bitset_alloc_runs(&bs->md_pages, ref, n_needed - n_pages, hint) < 0)) {
+            array_resize(&blob->cluster_page_indices, n_pages);
+            return -1;
+        }
 
-    if (array_init(&blob->clusters, n_clusters) < 0) {
-        goto error2;
-    }
-    size_t n_cluster_pages = ceil_div_ul(n_clusters, 512);
-    if (array_init(&blob->cluster_page_indices, n_cluster_pages) < 0) {
-        goto error3;
+        /* The old tail page must be relinked to the new pages. */
+        if (n_pages && first_page > n_pages - 1) first_page = n_pages - 1;
+    } else if (n_needed < n_pages && n_needed && first_page > n_needed - 1) {
+        first_page = n_needed - 1;
     }
 
-    uint32_t *ref = array_get_ref(&blob->cluster_page_indices, 0);
-    if (bitset_alloc(&bs->md_pages, ref, n_cluster_pages) < 0) {
-        goto error4;
+    if (blob_write_cluster_pages(bs, blob, first_page, n_needed) < 0) {
+        goto error;
     }
 
-    for (size_t i = 0; i < n_cluster_pages; i++) {
-        uint32_t next = (i + 1) < n_cluster_pages ? array_get(&blob->cluster_page_indices, i + 1): 0;
-        cluster_page_t cluster_page = {0};
-        cluster_page.next = next;
-        if (page_write(bs->fd, &cluster_page, array_get(&blob->cluster_page_indices, i)) < 0) {
-            goto error5;
+    /* The pages past the new end go first, so that an empty map is written with no chain. */
+    if (n_needed < n_pages) {
+        for (size_t i = n_needed; i < n_pages; i++) {
+            bitset_set(&bs->md_pages, array_get(&blob->cluster_page_indices, i), 0);
         }
+        array_resize(&blob->cluster_page_indices, n_needed);
     }
 
-    if (blobstore_write_blob_page(bs, blob, blob->next) < 0) {
-        goto error5;
+    /* The blob page holds the head of the chain and the allocated count. */
+    if (blobstore_write_blob_page(bs, blob) < 0) {
+        goto error;
     }
 
-    if (blobstore_write_superblob_page(bs, blob) < 0) {
-        goto error5;
-    }
+    return 0;
 
-    if (bs->head) {
-        bs->head->prev = blob;
+error:
+    if (n_needed > n_pages) {
+        for (size_t i = n_pages; i < n_needed; i++) {
+            bitset_set(&bs->md_pages, array_get(&blob->cluster_page_indices, i), 0);
+        }
+        array_resize(&blob->cluster_page_indices, n_pages);
     }
-    bs->head = blob;
+    return -1;
+}
 
-    return 0;
+static size_t bitmap_pages(bitset_t *set) {
+    return (bitset_bytes(set) + PAGE_SIZE - 1) / PAGE_SIZE;
+}
 
-error5:
-    bitset_free(&bs->md_pages, ref, n_cluster_pages);
-error4:
-    array_deinit(&blob->cluster_page_indices);
-error3:
-    array_deinit(&blob->clusters);
-error2:
-    free(blob);
-error1:
-    bitset_free(&bs->md_pages, &page_index, 1);
-    return -1;
+static size_t refs_pages(blobstore_t *bs) {
+    return (array_size(&bs->refs) * sizeof(uint32_t) + PAGE_SIZE - 1) / PAGE_SIZE;
 }
 
 /**
- * Delete `blob` from the blobstore `bs`. This will allow all clusters and
- * metadata used by `blob` to be reused by another `blob`.
- * 
- * \param bs the blobstore
- * \param blob the blob
+ * Transfer the metadata page bitmap and the cluster reference counts to or
+ * from the bitmap region, which holds the metadata page bitmap followed by
+ * the reference count of every cluster, each padded to whole pages. The
+ * region is contiguous and is transferred with a single request. The
+ * cluster allocation bitmap is derived from the reference counts on load.
  */
-int blobstore_delete_blob(blobstore_t *bs, blob_t *blob) {
-    if (blob == NULL) return -1;
+static int blobstore_bitmaps_io(blobstore_t *bs, int write) {
+    size_t md_pages = bitmap_pages(&bs->md_pages);
+    size_t len = (size_t) bs->bitmap_pages * PAGE_SIZE;
+    size_t n_clusters = array_size(&bs->refs);
+    uint8_t *buf = aligned_alloc(PAGE_SIZE, len);
+    if (buf == NULL) return -1;
+    memset(buf, 0, len);
+
+    if (write) {
+        bitset_store(&bs->md_pages, buf);
+        memcpy(buf + md_pages * PAGE_SIZE, array_get_ref(&bs->refs, 0), n_clusters * sizeof(uint32_t));
+    }
 
-    if (blob->prev) {
-        if (blobstore_write_blob_page(bs, blob->prev, blob->next) < 0) {
-            return -1;
-        }
+    int res = -1;
+    uint64_t offset = page_offset(bs->bitmap_page);
+    if (write && ioq_write(&bs->ioq, buf, len, offset) < 0) goto done;
+    if (!write && ioq_read(&bs->ioq, buf, len, offset) < 0) goto done;
+    if (ioq_wait(&bs->ioq) < 0) goto done;
 
-        blob->prev->next = blob->next;
-    } else if (bs->head == blob) {
-        if (blobstore_write_superblob_page(bs, blob->next) < 0) {
-            return -1;
+    if (!write) {
+        bitset_load(&bs->md_pages, buf);
+        memcpy(array_get_ref(&bs->refs, 0), buf + md_pages * PAGE_SIZE, n_clusters * sizeof(uint32_t));
+        for (size_t i = 0; i < n_clusters; i++) {
+            bitset_set(&bs->clusters, i, array_get(&bs->refs, i) != 0);
         }
-
-        bs->head = blob->next;
-    } else {
-        return -1;
     }
+    res = 0;
 
-    if (blob->next) {
-        blob->next->prev = blob->prev;
+done:
+    free(buf);
+    return res;
+}
+
+/**
+ * Set the reference count of the clusters [`start`, `start + len`) to `ref`
+ * and mark them as allocated or free accordingly.
+ */
+static void clusters_set_ref(blobstore_t *bs, uint32_t start, uint32_t len, uint32_t ref) {
+    uint32_t *refs = array_get_ref(&bs->refs, start);
+    for (uint32_t i = 0; i < len; i++) {
+        refs[i] = ref;
     }
+    bitset_set_range(&bs->clusters, start, len, ref != 0);
+}
 
-    size_t n_cluster_pages = array_size(&blob->cluster_page_indices);
-    for (size_t i = 0; i < n_cluster_pages; i++) {
-        bitset_set(&bs->md_pages, array_get(&blob->cluster_page_indices, i), 0);
+/**
+ * Take a reference to each of the clusters [`start`, `start + len`).
+ */
+static void clusters_ref(blobstore_t *bs, uint32_t start, uint32_t len) {
+    uint32_t *refs = array_get_ref(&bs->refs, start);
+    for (uint32_t i = 0; i < len; i++) {
+        if (refs[i]++ == 0) bitset_set(&bs->clusters, start + i, 1);
     }
+}
 
-    size_t n_clusters = array_size(&blob->clusters);
-    for (size_t i = 0; i < n_clusters; i++) {
-        uint32_t cluster_id = array_get(&blob->clusters, i);
-        if (cluster_id != 0) {
-            bitset_set(&bs->clusters, cluster_id, 0);
-        }
+/**
+ * Queue the unreferenced clusters [`start`, `start + len`) for discard. They
+ * stay allocated until they are discarded, or are released right away if
+ * they cannot be queued.
+ */
+static void clusters_release(blobstore_t *bs, uint32_t start, uint32_t len) {
+    size_t n = array_size(&bs->discarding);
+    if (array_resize(&bs->discarding, n + 2) < 0) {
+        bitset_set_range(&bs->clusters, start, len, 0);
+        return;
     }
 
-    blob_deinit(blob);
-    free(blob);
+    array_set(&bs->discarding, n, start);
+    array_set(&bs->discarding, n + 1, len);
+    bs->n_discarding += len;
+}
 
-    return 0;
+/**
+ * Drop a reference to each of the clusters [`start`, `start + len`), and
+ * release the runs of clusters that are no longer referenced.
+ */
+static void clusters_unref(blobstore_t *bs, uint32_t start, uint32_t len) {
+    uint32_t *refs = array_get_ref(&bs->refs, start);
+    for (uint32_t i = 0; i < len;) {
+        uint32_t j = i;
+        while (j < len && --refs[j] == 0) j++;
+        if (j > i) clusters_release(bs, start + i, j - i);
+        i = j + 1;
+    }
 }
 
 /**
- * Initialize `set` to represent the cluster sparsity of `blob`.
- * 
- * \param blob the blob
- * \param set the bitset to initialize.
- * \return 0 if success else -1
+ * Take or drop a reference to every cluster backing the extents of `blob`.
+ *
+ * \param bs the blobstore.
+ * \param blob the blob.
+ * \param b 1 to take a reference, 0 to drop it.
  */
-int blob_nonzero(blob_t *blob, bitset_t *set) {
-    size_t n_clusters = array_size(&blob->clusters);
-    if (bitset_init(set, n_clusters) < 0) return -1;
-    for (size_t i = 0; i < n_clusters; i++) {
-        if (array_get(&blob->clusters, i)) {
-            bitset_set(set, i, 1);
+void blob_mark_clusters(blobstore_t *bs, blob_t *blob, int b) {
+    size_t n_extents = extent_map_size(&blob->clusters);
+    for (size_t i = 0; i < n_extents; i++) {
+        map_extent_t *ext = extent_map_get_ref(&blob->clusters, i);
+        if (b) {
+            clusters_ref(bs, ext->pcluster, ext->len);
+        } else {
+            clusters_unref(bs, ext->pcluster, ext->len);
         }
     }
+}
 
-    return 0;
+/**
+ * Mark the clusters backing the page range [`page`, `page + n_pages`) as
+ * allocated (`b` = 1) or free (`b` = 0).
+ */
+static void blobstore_reserve_pages(blobstore_t *bs, uint32_t page, uint32_t n_pages, int b) {
+    uint64_t pages_per_cluster = cluster_pages(bs);
+    if (n_pages == 0) return;
+
+    uint64_t first = page / pages_per_cluster;
+    uint64_t last = ((uint64_t) page + n_pages - 1) / pages_per_cluster;
+    clusters_set_ref(bs, first, last - first + 1, b);
+}
+
+/**
+ * Allocate whole clusters for a region of `n_pages` metadata pages,
+ * preferably right after the metadata region.
+ *
+ * \param bs the blobstore.
+ * \param n_pages the size of the region in pages.
+ * \param page the first page of the region.
+ * \return 0 if success else -1
+ */
+static int blobstore_alloc_pages(blobstore_t *bs, uint32_t n_pages, uint32_t *page) {
+    uint64_t pages_per_cluster = cluster_pages(bs);
+    size_t n_region = (n_pages + pages_per_cluster - 1) / pages_per_cluster;
+
+    extent_t region;
+    if (bitset_alloc_extents(&bs->clusters, n_region, 1UL << bs->md_shift, &region, 1) < 0) {
+        return -1;
+    }
+    clusters_set_ref(bs, region.start, region.len, 1);
+
+    *page = region.start * pages_per_cluster;
+    return 0;
+}
+
+/**
+ * Extend the metadata region by at least `n_pages` pages. The region grows
+ * by as many clusters as it already has, up to `BLOBSTORE_MD_GROW` at a
+ * time, preferably right after its last extent. The new extent is recorded
+ * in the superblob page.
+ *
+ * \param bs the blobstore.
+ * \param n_pages the number of pages needed.
+ * \return 0 if success else -1
+ */
+static int blobstore_grow_md(blobstore_t *bs, size_t n_pages) {
+    uint64_t pages_per_cluster = cluster_pages(bs);
+    map_extent_t *last = &bs->md_extents[bs->n_md_extents - 1];
+    uint64_t n_md = (uint64_t) last->lcluster + last->len;
+    size_t n_needed = ceil_div_ul(n_pages, pages_per_cluster);
+    size_t n = n_md < BLOBSTORE_MD_GROW ? n_md: BLOBSTORE_MD_GROW;
+    if (n < n_needed) n = n_needed;
+    if ((n_md + n) * pages_per_cluster > UINT32_MAX) return -1;
+
+    if (blobstore_mark_dirty(bs) < 0) return -1;
+
+    size_t n_free = bitset_capacity(&bs->clusters) - bitset_size(&bs->clusters);
+    if (n_free < n && bs->n_discarding) blobstore_discard(bs);
+
+    extent_t run;
+    uint32_t hint = last->pcluster + last->len;
+    if (bitset_alloc_extents(&bs->clusters, n, hint, &run, 1) < 0 &&
+        bitset_alloc_extents(&bs->clusters, n_needed, hint, &run, 1) < 0) {
+        return -1;
+    }
+
+    int merge = run.start == hint;
+    if ((!merge && bs->n_md_extents == BLOBSTORE_MD_EXTENTS) ||
+        bitset_grow(&bs->md_pages, (n_md + run.len) * pages_per_cluster) < 0) {
+        bitset_free_extents(&bs->clusters, &run, 1);
+        return -1;
+    }
+    clusters_set_ref(bs, run.start, run.len, 1);
+
+    if (merge) {
+        last->len += run.len;
+    } else {
+        map_extent_t *ext = &bs->md_extents[bs->n_md_extents++];
+        ext->lcluster = n_md;
+        ext->pcluster = run.start;
+        ext->len = run.len;
+    }
+
+    return blobstore_write_superblob_page(bs);
+}
+
+/**
+ * Allocate a single metadata page, growing the metadata region if it is
+ * full.
+ *
+ * \param bs the blobstore.
+ * \param page_index the allocated page.
+ * \return 0 if success else -1
+ */
+static int blobstore_alloc_md_page(blobstore_t *bs, uint32_t *page_index) {
+    if (bitset_alloc(&bs->md_pages, page_index, 1) == 0) return 0;
+    if (blobstore_grow_md(bs, 1) < 0) return -1;
+    return bitset_alloc(&bs->md_pages, page_index, 1);
+}
+
+/**
+ * Stage the `i`-th directory page of the level whose entries are `entries`
+ * to the metadata page `page_index`.
+ */
+static int dir_write_page(blobstore_t *bs, array_t *entries, size_t i, uint32_t page_index) {
+    dir_page_t dir_page = {0};
+    size_t first = i * DIR_PAGE_ENTRIES;
+    size_t n = array_size(entries) - first < DIR_PAGE_ENTRIES ? array_size(entries) - first: DIR_PAGE_ENTRIES;
+    memcpy(dir_page.entries, array_get_ref(entries, first), n * sizeof(uint32_t));
+    return md_write(bs, &dir_page, page_index);
+}
+
+/**
+ * Make room in the blob directory for `slot`, allocating its directory page
+ * and root page if they do not exist yet. Nothing is staged.
+ *
+ * \param bs the blobstore.
+ * \param slot the slot.
+ * \return 1 if pages were allocated, 0 if not, -1 on error
+ */
+static int dir_extend(blobstore_t *bs, uint32_t slot) {
+    size_t p = slot / DIR_PAGE_ENTRIES;
+    size_t r = p / DIR_PAGE_ENTRIES;
+    if (r >= BLOBSTORE_DIR_ROOTS) return -1;
+
+    if (array_size(&bs->dir) <= slot && array_resize(&bs->dir, (p + 1) * DIR_PAGE_ENTRIES) < 0) return -1;
+    if (array_size(&bs->dir_pages) <= p && array_resize(&bs->dir_pages, p + 1) < 0) return -1;
+    if (array_get(&bs->dir_pages, p)) return 0;
+
+    if (bs->dir_roots[r] == 0 && blobstore_alloc_md_page(bs, &bs->dir_roots[r]) < 0) return -1;
+    if (blobstore_alloc_md_page(bs, array_get_ref(&bs->dir_pages, p)) < 0) return -1;
+    return 1;
+}
+
+/**
+ * Point the directory entry `slot` to the blob page `page_index`, or clear
+ * it with 0. Only the directory page of the slot is staged, unless the
+ * directory has to be extended, in which case its root page and the
+ * superblob page follow.
+ *
+ * \param bs the blobstore.
+ * \param slot the slot.
+ * \param page_index the blob page, or 0.
+ * \return 0 if success else -1
+ */
+static int dir_set(blobstore_t *bs, uint32_t slot, uint32_t page_index) {
+    int extended = dir_extend(bs, slot);
+    if (extended < 0) return -1;
+
+    size_t p = slot / DIR_PAGE_ENTRIES;
+    size_t r = p / DIR_PAGE_ENTRIES;
+    uint32_t old = array_get(&bs->dir, slot);
+    array_set(&bs->dir, slot, page_index);
+    if (dir_write_page(bs, &bs->dir, p, array_get(&bs->dir_pages, p)) < 0) {
+        array_set(&bs->dir, slot, old);
+        return -1;
+    }
+    if (!extended) return 0;
+
+    if (dir_write_page(bs, &bs->dir_pages, r, bs->dir_roots[r]) < 0) return -1;
+    return blobstore_write_superblob_page(bs);
+}
+
+/**
+ * Allocate a free directory slot, growing the slot bitmap by a directory
+ * page worth of slots if it is full.
+ */
+static int dir_alloc_slot(blobstore_t *bs, uint32_t *slot) {
+    if (bitset_alloc(&bs->dir_slots, slot, 1) == 0) return 0;
+
+    size_t capacity = bitset_capacity(&bs->dir_slots) + DIR_PAGE_ENTRIES;
+    if (capacity > (size_t) BLOBSTORE_DIR_ROOTS * DIR_PAGE_ENTRIES * DIR_PAGE_ENTRIES) return -1;
+    if (bitset_grow(&bs->dir_slots, capacity) < 0) return -1;
+    return bitset_alloc(&bs->dir_slots, slot, 1);
+}
+
+/**
+ * Move the bitmap region to a larger one if the bitmaps have outgrown it.
+ * The bitmaps are only persisted on a clean shutdown, so the region only
+ * needs to fit them then.
+ *
+ * \param bs the blobstore.
+ * \return 0 if success else -1
+ */
+static int blobstore_bitmaps_reserve(blobstore_t *bs) {
+    size_t n_pages = bitmap_pages(&bs->md_pages) + refs_pages(bs);
+    if (n_pages <= bs->bitmap_pages) return 0;
+
+    uint32_t page;
+    if (blobstore_alloc_pages(bs, n_pages, &page) < 0) return -1;
+
+    blobstore_reserve_pages(bs, bs->bitmap_page, bs->bitmap_pages, 0);
+    bs->bitmap_page = page;
+    bs->bitmap_pages = n_pages;
+    return 0;
+}
+
+/**
+ * Set up the pool of cluster-sized I/O buffers of the blobstore `bs`. The
+ * first buffer is kept as the zero cluster used to fill fresh clusters.
+ *
+ * \param bs the blobstore.
+ * \return 0 if success else -1
+ */
+static int blobstore_bufs_init(blobstore_t *bs) {
+    size_t cluster_size = 1UL << bs->page_shift << bs->cluster_shift;
+    if (bufpool_init(&bs->bufs, cluster_size, BLOBSTORE_BUFS) < 0) return -1;
+
+    /* The pool is freshly mapped anonymous memory, which reads as zeros. */
+    bs->zeros = bufpool_get(&bs->bufs);
+    return 0;
+}
+
+/**
+ * Take a cluster-sized buffer suitable for direct I/O from the buffer pool
+ * of the blobstore `bs`.
+ *
+ * \param bs the blobstore.
+ * \return the buffer, or NULL if the pool is exhausted.
+ */
+void *blobstore_alloc_buf(blobstore_t *bs) {
+    return bufpool_get(&bs->bufs);
+}
+
+/**
+ * Return a buffer taken with `blobstore_alloc_buf` to the buffer pool of the
+ * blobstore `bs`.
+ *
+ * \param bs the blobstore.
+ * \param buf the buffer.
+ */
+void blobstore_free_buf(blobstore_t *bs, void *buf) {
+    bufpool_put(&bs->bufs, buf);
+}
+
+size_t llog2(size_t x) {
+    size_t res = 0;
+    while (x >>= 1) ++res;
+    return res;
+}
+
+int blobstore_init(blobstore_t *bs, bdev_t *dev) {
+    blobstore_locks_init(bs);
+    bs->dev = dev;
+    if (ioq_init(&bs->ioq, dev, BLOBSTORE_QUEUE_DEPTH, 0) < 0) return -1;
+
+    uint64_t size = bdev_size(dev);
+    bs->page_shift = llog2(bdev_block_size(dev));
+    bs->cluster_shift = 8;
+    bs->md_shift = 0;
+    bs->head = NULL;
+    bs->lru_head = NULL;
+    bs->lru_tail = NULL;
+    bs->map_bytes = 0;
+    bs->map_budget = BLOBSTORE_MAP_BUDGET;
+    if (blob_index_init(&bs->index, 0) < 0) return -1;
+    memset(bs->dir_roots, 0, sizeof(bs->dir_roots));
+    if (array_init(&bs->dir_pages, 0) < 0) return -1;
+    if (array_init(&bs->dir, 0) < 0) return -1;
+    if (bitset_init(&bs->dir_slots, 0) < 0) return -1;
+    if (array_init(&bs->freeing, 0) < 0) return -1;
+    if (array_init(&bs->discarding, 0) < 0) return -1;
+    bs->n_discarding = 0;
+    bs->discard = 1;
+    bs->flush_data = 0;
+
+    /* The metadata region starts out as the first 1 << md_shift clusters. */
+    bs->n_md_extents = 1;
+    bs->md_extents[0].lcluster = 0;
+    bs->md_extents[0].pcluster = 0;
+    bs->md_extents[0].len = 1U << bs->md_shift;
+
+    size_t n_md_pages = cluster_pages(bs) << bs->md_shift;
+    if (bitset_init(&bs->md_pages, n_md_pages) < 0) return -1;
+    bitset_set(&bs->md_pages, 0, 1);
+
+    size_t n_clusters = size >> bs->page_shift >> bs->cluster_shift;
+    if (n_clusters <= 1UL << bs->md_shift) return -1;
+    if (bitset_init(&bs->clusters, n_clusters) < 0) return -1;
+    if (array_init(&bs->refs, n_clusters) < 0) return -1;
+    clusters_set_ref(bs, 0, 1UL << bs->md_shift, 1);
+
+    /* Reserve whole clusters right after the metadata region for the bitmaps and the journal. */
+    bs->bitmap_pages = bitmap_pages(&bs->md_pages) + refs_pages(bs);
+    if (blobstore_alloc_pages(bs, bs->bitmap_pages, &bs->bitmap_page) < 0) {
+        return -1;
+    }
+
+    bs->journal_pages = BLOBSTORE_JOURNAL_PAGES;
+    if (blobstore_alloc_pages(bs, bs->journal_pages, &bs->journal_page) < 0) {
+        return -1;
+    }
+
+    if (journal_init(&bs->journal, &bs->ioq, bs->journal_page, bs->journal_pages) < 0) {
+        return -1;
+    }
+
+    if (cache_init(&bs->cache, BLOBSTORE_CACHE_PAGES) < 0) {
+        return -1;
+    }
+
+    if (blobstore_bufs_init(bs) < 0) {
+        return -1;
+    }
+
+    if (journal_format(&bs->journal) < 0) {
+        return -1;
+    }
+
+    bs->clean = 0;
+    if (blobstore_sync_superblob_page(bs) < 0) {
+        return -1;
+    }
+
+    if (channel_init(&bs->channel, bs) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+void blob_deinit(blob_t *blob) {
+    extent_map_deinit(&blob->clusters);
+    array_deinit(&blob->cluster_page_indices);
+    pthread_rwlock_destroy(&blob->lock);
+}
+
+/**
+ * Unpack the `i`-th cluster page of `blob` into its cluster map and record
+ * the index of the following page of the chain.
+ *
+ * \param blob the blob.
+ * \param i the index of the cluster page within the chain.
+ * \param cluster_page the cluster page.
+ * \return 0 if success else -1
+ */
+int clusters_unpack(blob_t *blob, size_t i, cluster_page_t *cluster_page) {
+    if (cluster_page->n_extents > CLUSTER_PAGE_EXTENTS) return -1;
+
+    for (size_t j = 0; j < cluster_page->n_extents; j++) {
+        map_extent_t *ext = &cluster_page->extents[j];
+        if ((uint64_t) ext->lcluster + ext->len > blob->n_clusters) return -1;
+        if (extent_map_append(&blob->clusters, ext->lcluster, ext->pcluster, ext->len) < 0) {
+            return -1;
+        }
+    }
+
+    if (cluster_page->next) {
+        if (array_resize(&blob->cluster_page_indices, i + 2) < 0) return -1;
+        array_set(&blob->cluster_page_indices, i + 1, cluster_page->next);
+    }
+
+    return 0;
+}
+
+/**
+ * Read the cluster maps of every blob in the list starting at `head`. Each
+ * cluster page chain is a sequence of dependent reads, so the chains are walked in
+ * lockstep: the i-th page of every blob is read in one batch, keeping up to
+ * a full queue of requests in flight.
+ *
+ * Pages found in the cache are taken from there instead.
+ *
+ * \param bs the blobstore.
+ * \param head the first blob of the list.
+ * \param end the blob following the last one to read, or NULL.
+ * \return 0 if success else -1
+ */
+int clusters_read(blobstore_t *bs, blob_t *head, blob_t *end) {
+    ioq_t *q = &bs->ioq;
+    cluster_page_t *cluster_pages = aligned_alloc(PAGE_SIZE, q->depth * sizeof(cluster_page_t));
+    if (cluster_pages == NULL) return -1;
+
+    blob_t **owners = (blob_t**) calloc(q->depth, sizeof(blob_t*));
+    if (owners == NULL) goto error;
+
+    for (size_t i = 0; ; i++) {
+        size_t n_read = 0;
+        blob_t *iter = head;
+        while (iter != end) {
+            size_t n = 0;
+            for (; iter != end && n < q->depth; iter = iter->next) {
+                if (i >= array_size(&iter->cluster_page_indices)) continue;
+                uint32_t home;
+                if (md_page(bs, array_get(&iter->cluster_page_indices, i), &home) < 0) goto error;
+
+                void *frame = cache_lookup(&bs->cache, home);
+                if (frame) {
+                    memcpy(&cluster_pages[n], frame, PAGE_SIZE);
+                } else if (ioq_read(q, &cluster_pages[n], PAGE_SIZE, page_offset(home)) < 0) {
+                    goto error;
+                }
+                owners[n++] = iter;
+            }
+
+            if (ioq_wait(q) < 0) goto error;
+            for (size_t j = 0; j < n; j++) {
+                uint32_t home;
+                md_page(bs, array_get(&owners[j]->cluster_page_indices, i), &home);
+                if (cache_lookup(&bs->cache, home) == NULL) {
+                    md_fill(bs, &cluster_pages[j], home);
+                }
+                if (clusters_unpack(owners[j], i, &cluster_pages[j]) < 0) goto error;
+            }
+            n_read += n;
+        }
+
+        if (n_read == 0) break;
+    }
+
+    free(owners);
+    free(cluster_pages);
+    return 0;
+
+error:
+    ioq_wait(q);
+    free(owners);
+    free(cluster_pages);
+    return -1;
+}
+
+/**
+ * Set up `blob` from the blob page `blob_page` stored at `page_index`.
+ */
+static int blob_unpack(blob_t *blob, uint32_t page_index, blob_page_t *blob_page) {
+    if (blob_page->n_clusters == 0) return -1;
+
+    blob->page_index = page_index;
+    blob->n_clusters = blob_page->n_clusters;
+    blob->n_allocated = blob_page->n_allocated;
+    blob->flags = blob_page->flags;
+    memcpy(blob->uuid, blob_page->uuid, 16);
+
+    extent_map_init(&blob->clusters);
+    if (array_init(&blob->cluster_page_indices, blob_page->clusters ? 1: 0) < 0) {
+        return -1;
+    }
+
+    if (blob_page->clusters) {
+        array_set(&blob->cluster_page_indices, 0, blob_page->clusters);
+    }
+    pthread_rwlock_init(&blob->lock, NULL);
+
+    return 0;
+}
+
+int blob_read_one(blobstore_t *bs, uint32_t page_index, blob_t *blob, uint32_t *next) {
+    blob_page_t blob_page;
+    if (md_read(bs, &blob_page, page_index) < 0) {
+        return -1;
+    }
+
+    if (blob_unpack(blob, page_index, &blob_page) < 0) return -1;
+    *next = blob_page.next;
+
+    return 0;
+}
+
+void blob_list_deinit(blob_t *head) {
+    blob_t *iter = head;
+    while (iter) {
+        blob_t *next = iter->next;
+        blob_deinit(iter);
+        free(iter);
+        iter = next;
+    }
+}
+
+static void blob_list_append(blob_t **head, blob_t **tail, blob_t *blob) {
+    blob->prev = *tail;
+    if (*tail) {
+        (*tail)->next = blob;
+    } else {
+        *head = blob;
+    }
+    *tail = blob;
+}
+
+/**
+ * Read the metadata pages `indices[0..n)` into `pages`, issuing the reads
+ * of the pages missing from the cache as a single batch, and keep them in
+ * the cache. `n` is at most the depth of the metadata I/O queue.
+ *
+ * \param bs the blobstore.
+ * \param indices the metadata page indices.
+ * \param n the number of pages.
+ * \param pages the `n` page-aligned pages to read into.
+ * \return 0 if success else -1
+ */
+static int md_read_batch(blobstore_t *bs, const uint32_t *indices, size_t n, void *pages) {
+    ioq_t *q = &bs->ioq;
+    uint8_t *buf = pages;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t home;
+        if (md_page(bs, indices[i], &home) < 0) goto error;
+
+        void *frame = cache_lookup(&bs->cache, home);
+        if (frame) {
+            stats_add(STAT_CACHE_HITS, 1);
+            memcpy(buf + i * PAGE_SIZE, frame, PAGE_SIZE);
+        } else {
+            stats_add(STAT_CACHE_MISSES, 1);
+            if (ioq_read(q, buf + i * PAGE_SIZE, PAGE_SIZE, page_offset(home)) < 0) goto error;
+        }
+    }
+
+    if (ioq_wait(q) < 0) return -1;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t home;
+        md_page(bs, indices[i], &home);
+        if (cache_lookup(&bs->cache, home) == NULL) {
+            md_fill(bs, buf + i * PAGE_SIZE, home);
+        }
+    }
+    return 0;
+
+error:
+    ioq_wait(q);
+    return -1;
+}
+
+/**
+ * Read the directory pages named by the nonzero entries of `pages` into
+ * `entries`, which is resized to DIR_PAGE_ENTRIES entries per page. Pages
+ * are read in batches of the depth of the metadata I/O queue.
+ */
+static int dir_read_level(blobstore_t *bs, array_t *pages, array_t *entries) {
+    size_t depth = bs->ioq.depth;
+    size_t n_pages = array_size(pages);
+    if (array_resize(entries, n_pages * DIR_PAGE_ENTRIES) < 0) return -1;
+
+    int res = -1;
+    dir_page_t *dir_pages = aligned_alloc(PAGE_SIZE, depth * sizeof(dir_page_t));
+    uint32_t *indices = (uint32_t*) calloc(depth, sizeof(uint32_t));
+    size_t *positions = (size_t*) calloc(depth, sizeof(size_t));
+    if (dir_pages == NULL || indices == NULL || positions == NULL) goto done;
+
+    for (size_t i = 0; i < n_pages;) {
+        size_t n = 0;
+        for (; i < n_pages && n < depth; i++) {
+            if (array_get(pages, i) == 0) continue;
+            positions[n] = i;
+            indices[n++] = array_get(pages, i);
+        }
+
+        if (md_read_batch(bs, indices, n, dir_pages) < 0) goto done;
+        for (size_t j = 0; j < n; j++) {
+            memcpy(array_get_ref(entries, positions[j] * DIR_PAGE_ENTRIES), dir_pages[j].entries, PAGE_SIZE);
+        }
+    }
+    res = 0;
+
+done:
+    free(positions);
+    free(indices);
+    free(dir_pages);
+    return res;
+}
+
+/**
+ * Read the blob directory named by `sb` and the blob pages it lists into
+ * a list starting at `*head`. Each level of the directory and the blob
+ * pages are read in batches of the depth of the metadata I/O queue, so the
+ * number of dependent reads does not grow with the number of blobs. On
+ * error `*head` holds the blobs read so far.
+ */
+static int blob_dir_read(blobstore_t *bs, superblob_page_t *sb, blob_t **head) {
+    array_t roots;
+    if (array_init(&roots, BLOBSTORE_DIR_ROOTS) < 0) return -1;
+    memcpy(array_get_ref(&roots, 0), sb->dir_roots, sizeof(sb->dir_roots));
+    memcpy(bs->dir_roots, sb->dir_roots, sizeof(sb->dir_roots));
+    int res = dir_read_level(bs, &roots, &bs->dir_pages);
+    array_deinit(&roots);
+    if (res < 0) return -1;
+
+    /* Only the directory pages up to the last one in use are kept. */
+    size_t n_pages = array_size(&bs->dir_pages);
+    while (n_pages && array_get(&bs->dir_pages, n_pages - 1) == 0) n_pages--;
+    if (array_resize(&bs->dir_pages, n_pages) < 0) return -1;
+    if (dir_read_level(bs, &bs->dir_pages, &bs->dir) < 0) return -1;
+    if (bitset_grow(&bs->dir_slots, array_size(&bs->dir)) < 0) return -1;
+
+    size_t depth = bs->ioq.depth;
+    size_t n_slots = array_size(&bs->dir);
+    blob_t *tail = NULL;
+    res = -1;
+    blob_page_t *blob_pages = aligned_alloc(PAGE_SIZE, depth * sizeof(blob_page_t));
+    uint32_t *indices = (uint32_t*) calloc(depth, sizeof(uint32_t));
+    uint32_t *slots = (uint32_t*) calloc(depth, sizeof(uint32_t));
+    if (blob_pages == NULL || indices == NULL || slots == NULL) goto done;
+
+    for (size_t i = 0; i < n_slots;) {
+        size_t n = 0;
+        for (; i < n_slots && n < depth; i++) {
+            if (array_get(&bs->dir, i) == 0) continue;
+            slots[n] = i;
+            indices[n++] = array_get(&bs->dir, i);
+        }
+
+        if (md_read_batch(bs, indices, n, blob_pages) < 0) goto done;
+        for (size_t j = 0; j < n; j++) {
+            blob_t *blob = (blob_t*) calloc(1, sizeof(blob_t));
+            if (blob == NULL) goto done;
+
+            if (blob_unpack(blob, indices[j], &blob_pages[j]) < 0) {
+                free(blob);
+                goto done;
+            }
+            blob->slot = slots[j];
+            bitset_set(&bs->dir_slots, slots[j], 1);
+            blob_list_append(head, &tail, blob);
+        }
+    }
+    res = 0;
+
+done:
+    free(slots);
+    free(indices);
+    free(blob_pages);
+    return res;
+}
+
+/**
+ * Read the blob page chain of a store from before version 6, starting at
+ * `page_index`, into a list starting at `*head`.
+ */
+static int blob_chain_read(blobstore_t *bs, uint32_t page_index, blob_t **head) {
+    blob_t *tail = NULL;
+    while (page_index) {
+        blob_t *blob = (blob_t*) calloc(1, sizeof(blob_t));
+        if (blob == NULL) return -1;
+
+        if (blob_read_one(bs, page_index, blob, &page_index) < 0) {
+            free(blob);
+            return -1;
+        }
+        blob_list_append(head, &tail, blob);
+    }
+
+    return 0;
+}
+
+int blob_list_read(blobstore_t *bs, superblob_page_t *sb, blob_t **res, int load) {
+    blob_t *head = NULL;
+    if (sb->version < 6 && blob_chain_read(bs, sb->next, &head) < 0) goto error;
+    if (sb->version >= 6 && blob_dir_read(bs, sb, &head) < 0) goto error;
+
+    if (load) {
+        if (clusters_read(bs, head, NULL) < 0) goto error;
+        for (blob_t *iter = head; iter; iter = iter->next) {
+            iter->loaded = 1;
+        }
+    }
+
+    *res = head;
+    return 0;
+
+error:
+    blob_list_deinit(head);
+    return -1;
+}
+
+/**
+ * Give every blob of a store from before version 6 a directory slot, stage
+ * the directory bottom up so that the superblob page naming it goes last,
+ * and commit it. The store is not marked dirty first: the commit clears
+ * the clean flag along with switching to the directory, and until then
+ * the old superblob page stays valid.
+ *
+ * \param bs the blobstore.
+ * \return 0 if success else -1
+ */
+static int dir_build(blobstore_t *bs) {
+    bs->clean = 0;
+    for (blob_t *iter = bs->head; iter; iter = iter->next) {
+        if (dir_alloc_slot(bs, &iter->slot) < 0 || dir_extend(bs, iter->slot) < 0) return -1;
+        array_set(&bs->dir, iter->slot, iter->page_index);
+    }
+
+    /* Nothing reaches the new pages before the superblob page, so they may span several commits. */
+    for (size_t p = 0; p < array_size(&bs->dir_pages); p++) {
+        if (md_reserve(bs, 1) < 0 || dir_write_page(bs, &bs->dir, p, array_get(&bs->dir_pages, p)) < 0) return -1;
+    }
+    for (size_t r = 0; r < BLOBSTORE_DIR_ROOTS; r++) {
+        if (bs->dir_roots[r] == 0) continue;
+        if (md_reserve(bs, 1) < 0 || dir_write_page(bs, &bs->dir_pages, r, bs->dir_roots[r]) < 0) return -1;
+    }
+    if (md_reserve(bs, 1) < 0 || blobstore_write_superblob_page(bs) < 0) return -1;
+
+    return blobstore_commit(bs);
+}
+
+int blobstore_open(blobstore_t *bs, bdev_t *dev) {
+    uint64_t start = stats_now();
+    blobstore_locks_init(bs);
+    uint64_t size = bdev_size(dev);
+    if (ioq_init(&bs->ioq, dev, BLOBSTORE_QUEUE_DEPTH, 0) < 0) return -1;
+
+    superblob_page_t sb;
+    if (page_read(&bs->ioq, &sb, 0) < 0) {
+        goto error;
+    }
+
+    if (sb.magic != BLOBSTORE_MAGIC || sb.version < 4 || sb.version > BLOBSTORE_VERSION) goto error;
+    if (bdev_block_size(dev) != 1ULL << sb.page_shift) goto error;
+
+    /* A striped store must be opened with the same members and stripe size. */
+    uint32_t n_devices = sb.version >= 7 ? sb.n_devices: 1;
+    if (n_devices != (dev->n_members ? dev->n_members: 1)) goto error;
+    if (n_devices > 1 && (sb.stripe_size != dev->stripe_size || sb.device_size > dev->member_size)) goto error;
+
+    uint64_t cluster_size_bytes = (1ULL << sb.page_shift << sb.cluster_shift);
+    if (size < sb.clusters * cluster_size_bytes) goto error;
+
+    /* Bring the home pages up to date before anything else is read. */
+    if (journal_init(&bs->journal, &bs->ioq, sb.journal_page, sb.journal_pages) < 0) {
+        goto error;
+    }
+
+    if (journal_replay(&bs->journal) < 0 || page_read(&bs->ioq, &sb, 0) < 0) {
+        goto error;
+    }
+
+    if (cache_init(&bs->cache, BLOBSTORE_CACHE_PAGES) < 0) {
+        goto error;
+    }
+
+    bs->dev = dev;
+    bs->page_shift = sb.page_shift;
+    bs->cluster_shift = sb.cluster_shift;
+    if (blobstore_bufs_init(bs) < 0) {
+        goto error2;
+    }
+
+    bs->md_shift = sb.md_shift;
+
+    bs->bitmap_page = sb.bitmap_page;
+    bs->bitmap_pages = sb.bitmap_pages;
+    bs->journal_page = sb.journal_page;
+    bs->journal_pages = sb.journal_pages;
+    bs->head = NULL;
+    bs->lru_head = NULL;
+    bs->lru_tail = NULL;
+    bs->map_bytes = 0;
+    bs->map_budget = BLOBSTORE_MAP_BUDGET;
+
+    /* What `error3` releases starts out empty, so that a failure at any point can release it. */
+    memset(&bs->freeing, 0, sizeof(bs->freeing));
+    memset(&bs->discarding, 0, sizeof(bs->discarding));
+    memset(&bs->md_pages, 0, sizeof(bs->md_pages));
+    memset(&bs->clusters, 0, sizeof(bs->clusters));
+    memset(&bs->refs, 0, sizeof(bs->refs));
+    memset(&bs->dir_pages, 0, sizeof(bs->dir_pages));
+    memset(&bs->dir, 0, sizeof(bs->dir));
+    memset(&bs->dir_slots, 0, sizeof(bs->dir_slots));
+    memset(&bs->index, 0, sizeof(bs->index));
+
+    if (array_init(&bs->freeing, 0) < 0) goto error3;
+    if (array_init(&bs->discarding, 0) < 0) goto error3;
+    bs->n_discarding = 0;
+    bs->discard = 1;
+    bs->flush_data = 0;
+
+    /* Stores of version 4 have no metadata extents recorded and a fixed region. */
+    bs->n_md_extents = sb.n_md_extents;
+    memcpy(bs->md_extents, sb.md_extents, sizeof(bs->md_extents));
+    if (sb.version < 5) {
+        bs->n_md_extents = 1;
+        bs->md_extents[0].lcluster = 0;
+        bs->md_extents[0].pcluster = 0;
+        bs->md_extents[0].len = 1U << bs->md_shift;
+    }
+
+    uint64_t n_md = 0;
+    if (bs->n_md_extents == 0 || bs->n_md_extents > BLOBSTORE_MD_EXTENTS) goto error3;
+    for (uint32_t i = 0; i < bs->n_md_extents; i++) {
+        map_extent_t *ext = &bs->md_extents[i];
+        if (ext->lcluster != n_md || ext->len == 0 || (uint64_t) ext->pcluster + ext->len > sb.clusters) goto error3;
+        n_md += ext->len;
+    }
+
+    if (bitset_init(&bs->md_pages, n_md * cluster_pages(bs)) < 0) goto error3;
+    bitset_set(&bs->md_pages, 0, 1);
+
+    if (bitset_init(&bs->clusters, sb.clusters) < 0) goto error3;
+    if (array_init(&bs->refs, sb.clusters) < 0) goto error3;
+    for (uint32_t i = 0; i < bs->n_md_extents; i++) {
+        clusters_set_ref(bs, bs->md_extents[i].pcluster, bs->md_extents[i].len, 1);
+    }
+
+    /*
+     * After a clean shutdown the persisted bitmaps are current, so they are
+     * loaded directly and cluster maps are only read when first needed.
+     * Otherwise every cluster map is read to rebuild the bitmaps.
+     */
+    size_t n_bitmap_pages = bitmap_pages(&bs->md_pages) + refs_pages(bs);
+    bs->clean = sb.clean && bs->bitmap_page && bs->bitmap_pages >= n_bitmap_pages;
+    if (bs->clean && blobstore_bitmaps_io(bs, 0) < 0) {
+        bs->clean = 0;
+    }
+
+    memset(bs->dir_roots, 0, sizeof(bs->dir_roots));
+    if (array_init(&bs->dir_pages, 0) < 0) goto error3;
+    if (array_init(&bs->dir, 0) < 0) goto error3;
+    if (bitset_init(&bs->dir_slots, 0) < 0) goto error3;
+    if (blob_list_read(bs, &sb, &bs->head, !bs->clean) < 0) {
+        goto error3;
+    }
+
+    if (!bs->clean) {
+        blobstore_reserve_pages(bs, bs->bitmap_page, bs->bitmap_pages, 1);
+        blobstore_reserve_pages(bs, bs->journal_page, bs->journal_pages, 1);
+        for (size_t r = 0; r < BLOBSTORE_DIR_ROOTS; r++) {
+            if (bs->dir_roots[r]) bitset_set(&bs->md_pages, bs->dir_roots[r], 1);
+        }
+        bitset_set_indices(&bs->md_pages, &bs->dir_pages, 1);
+    }
+
+    if (blob_index_init(&bs->index, 0) < 0) goto error3;
+    for (blob_t *iter = bs->head; iter; iter = iter->next) {
+        if (!bs->clean) {
+            bitset_set(&bs->md_pages, iter->page_index, 1);
+            bitset_set_indices(&bs->md_pages, &iter->cluster_page_indices, 1);
+            blob_mark_clusters(bs, iter, 1);
+            blob_touch(bs, iter);
+        }
+        if (blob_index_insert(&bs->index, iter) < 0) goto error3;
+    }
+    blobstore_evict(bs);
+
+    if (sb.version < 6 && dir_build(bs) < 0) {
+        goto error3;
+    }
+
+    if (channel_init(&bs->channel, bs) < 0) {
+        goto error3;
+    }
+
+    stats_record(STAT_OPEN, stats_now() - start);
+    return 0;
+
+error3:
+    blob_index_deinit(&bs->index);
+    blob_list_deinit(bs->head);
+    bs->head = NULL;
+    bitset_deinit(&bs->dir_slots);
+    array_deinit(&bs->dir);
+    array_deinit(&bs->dir_pages);
+    array_deinit(&bs->refs);
+    bitset_deinit(&bs->clusters);
+    bitset_deinit(&bs->md_pages);
+    array_deinit(&bs->discarding);
+    array_deinit(&bs->freeing);
+    bufpool_deinit(&bs->bufs);
+error2:
+    cache_deinit(&bs->cache);
+error:
+    ioq_deinit(&bs->ioq);
+    return -1;
+}
+
+/**
+ * Reconfigure the I/O queue of the blobstore `bs`.
+ *
+ * \param bs the blobstore.
+ * \param depth the maximum number of requests in flight.
+ * \param flags `IOQ_POLL` to poll for completions, or 0.
+ * \return 0 if success else -1
+ */
+int blobstore_set_queue(blobstore_t *bs, uint32_t depth, int flags) {
+    ioq_t ioq, channel_ioq;
+    if (ioq_init(&ioq, bs->dev, depth, flags) < 0) return -1;
+    if (ioq_init(&channel_ioq, bs->dev, depth, flags) < 0) {
+        ioq_deinit(&ioq);
+        return -1;
+    }
+
+    blobstore_lock(bs);
+    ioq_deinit(&bs->ioq);
+    bs->ioq = ioq;
+    blobstore_unlock(bs);
+
+    pthread_mutex_lock(&bs->channel_lock);
+    ioq_deinit(&bs->channel.ioq);
+    bs->channel.ioq = channel_ioq;
+    pthread_mutex_unlock(&bs->channel_lock);
+    return 0;
+}
+
+/**
+ * Commit all metadata updates staged since the last commit as a single
+ * journal transaction. Clusters released by deleted blobs become available
+ * for reuse only once the deletion is committed. When data has been written
+ * to freshly mapped clusters, the device is flushed before the transaction
+ * is written, so that a committed map never points to data that is not yet
+ * durable.
+ *
+ * \param bs the blobstore.
+ * \return 0 if success else -1
+ */
+int blobstore_commit(blobstore_t *bs) {
+    blobstore_lock(bs);
+
+    /* Data written to fresh clusters must be durable before a map pointing to it. */
+    if (bs->flush_data && bs->cache.n_pending) {
+        if (ioq_flush(&bs->ioq) < 0) {
+            blobstore_unlock(bs);
+            return -1;
+        }
+        bs->flush_data = 0;
+    }
+
+    if (journal_commit(&bs->journal, &bs->cache) < 0) {
+        blobstore_unlock(bs);
+        return -1;
+    }
+
+    /* Clusters left unreferenced are held back until they have been discarded. */
+    size_t n = array_size(&bs->freeing);
+    for (size_t i = 0; i < n; i += 2) {
+        clusters_unref(bs, array_get(&bs->freeing, i), array_get(&bs->freeing, i + 1));
+    }
+    array_resize(&bs->freeing, 0);
+
+    if (bs->n_discarding >= BLOBSTORE_DISCARD_BATCH) {
+        blobstore_discard(bs);
+    }
+
+    blobstore_unlock(bs);
+    return 0;
+}
+
+static int extent_cmp(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t*) a;
+    uint32_t y = *(const uint32_t*) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Discard the committed released clusters from the device and make them
+ * available for reuse. The released extents are sorted and merged so that
+ * every contiguous range is discarded with a single request. Discarding is
+ * only a hint to the device, so once the device rejects a discard no
+ * further discards are issued, and the clusters are released either way.
+ *
+ * \param bs the blobstore.
+ */
+void blobstore_discard(blobstore_t *bs) {
+    blobstore_lock(bs);
+    size_t n = array_size(&bs->discarding) / 2;
+    if (n == 0) {
+        blobstore_unlock(bs);
+        return;
+    }
+
+    uint32_t *extents = array_get_ref(&bs->discarding, 0);
+    qsort(extents, n, 2 * sizeof(uint32_t), extent_cmp);
+
+    for (size_t i = 0; i < n;) {
+        uint32_t start = extents[2 * i];
+        uint32_t len = extents[2 * i + 1];
+        for (i++; i < n && extents[2 * i] == start + len; i++) {
+            len += extents[2 * i + 1];
+        }
+
+        uint64_t offset = (uint64_t) start << bs->page_shift << bs->cluster_shift;
+        uint64_t bytes = (uint64_t) len << bs->page_shift << bs->cluster_shift;
+        if (bs->discard && bdev_discard(bs->dev, offset, bytes) < 0) {
+            bs->discard = 0;
+        } else if (bs->discard) {
+            stats_add(STAT_BYTES_DISCARDED, bytes);
+        }
+
+        bitset_set_range(&bs->clusters, start, len, 0);
+    }
+
+    array_resize(&bs->discarding, 0);
+    bs->n_discarding = 0;
+    blobstore_unlock(bs);
+}
+
+/**
+ * Commit all pending metadata updates and write every cached update to its
+ * home location, leaving the journal empty. The clusters held by the pool
+ * of the default channel are returned as well.
+ *
+ * \param bs the blobstore.
+ * \return 0 if success else -1
+ */
+int blobstore_flush(blobstore_t *bs) {
+    pthread_mutex_lock(&bs->channel_lock);
+    blobstore_lock(bs);
+    bitset_free_extents(&bs->clusters, bs->channel.pool, bs->channel.n_pool);
+    bs->channel.n_pool = 0;
+    pthread_mutex_unlock(&bs->channel_lock);
+
+    int res = blobstore_commit(bs);
+    if (res == 0) {
+        blobstore_discard(bs);
+        res = journal_checkpoint(&bs->journal, &bs->cache);
+    }
+    blobstore_unlock(bs);
+    return res;
+}
+
+/**
+ * Release the clusters backing `blob` with the next commit. Until the
+ * deletion of `blob` is committed, the blob is still reachable on disk and
+ * its clusters must not be overwritten. The caller may undo this by
+ * truncating `bs->freeing` back to its previous size.
+ */
+static int blob_free_clusters(blobstore_t *bs, blob_t *blob) {
+    size_t n_extents = extent_map_size(&blob->clusters);
+    size_t n = array_size(&bs->freeing);
+    if (array_resize(&bs->freeing, n + 2 * n_extents) < 0) return -1;
+
+    for (size_t i = 0; i < n_extents; i++) {
+        map_extent_t *ext = extent_map_get_ref(&blob->clusters, i);
+        array_set(&bs->freeing, n + 2 * i, ext->pcluster);
+        array_set(&bs->freeing, n + 2 * i + 1, ext->len);
+    }
+
+    return 0;
+}
+
+/**
+ * Release all resources associated with the blobstore `bs`. Pending metadata
+ * updates are flushed, and the bitmaps are persisted so
+ * that the next open is clean.
+ * 
+ * \param bs the blobstore. 
+ */
+void blobstore_deinit(blobstore_t *bs) {
+    channel_deinit(&bs->channel);
+    if (blobstore_flush(bs) == 0 && !bs->clean && blobstore_bitmaps_reserve(bs) == 0 &&
+        blobstore_bitmaps_io(bs, 1) == 0 && ioq_flush(&bs->ioq) == 0) {
+        bs->clean = 1;
+        blobstore_sync_superblob_page(bs);
+    }
+
+    cache_deinit(&bs->cache);
+    bufpool_deinit(&bs->bufs);
+    array_deinit(&bs->freeing);
+    array_deinit(&bs->discarding);
+    ioq_deinit(&bs->ioq);
+    blob_index_deinit(&bs->index);
+    array_deinit(&bs->dir_pages);
+    array_deinit(&bs->dir);
+    bitset_deinit(&bs->dir_slots);
+    array_deinit(&bs->refs);
+    bitset_deinit(&bs->clusters);
+    bitset_deinit(&bs->md_pages);
+    blob_list_deinit(bs->head);
+    pthread_mutex_destroy(&bs->channel_lock);
+    pthread_mutex_destroy(&bs->lock);
+}
+
+/**
+ * Create a blob of `n_clusters` clusters at the head of the blob list. If
+ * `parent` is given, the new blob shares all of its clusters.
+ */
+static int blob_create(blobstore_t *bs, uint32_t n_clusters, blob_t *parent, uint32_t flags) {
+    uint64_t start = stats_now();
+    uint32_t page_index;
+
+    uint32_t slot;
+
+    if (n_clusters == 0) return -1;
+    if (parent && blob_load(bs, parent) < 0) return -1;
+    if (md_reserve(bs, (parent ? blob_map_pages(parent): 0) + MD_OP_PAGES) < 0) return -1;
+    if (blobstore_alloc_md_page(bs, &page_index) < 0) {
+        return -1;
+    }
+
+    if (dir_alloc_slot(bs, &slot) < 0) {
+        goto error0;
+    }
+
+    blob_t *blob = (blob_t*) calloc(1, sizeof(blob_t));
+    if (blob == NULL) {
+        goto error1;
+    }
+
+    blob->page_index = page_index;
+    blob->slot = slot;
+    blob->prev = NULL;
+    blob->next = bs->head;
+
+    if (uuid_init_random(blob->uuid) < 0) {
+        goto error2;
+    }
+
+    blob->n_clusters = n_clusters;
+    blob->n_allocated = 0;
+    blob->flags = flags;
+    blob->loaded = 1;
+    pthread_rwlock_init(&blob->lock, NULL);
+    extent_map_init(&blob->clusters);
+    if (array_init(&blob->cluster_page_indices, 0) < 0) {
+        goto error2;
+    }
+
+    if (blob_index_insert(&bs->index, blob) < 0) {
+        goto error3;
+    }
+
+    if (blobstore_mark_dirty(bs) < 0) {
+        goto error4;
+    }
+
+    /* A blob without a parent is fully unallocated and needs no cluster pages. */
+    if (parent) {
+        size_t n_extents = extent_map_size(&parent->clusters);
+        for (size_t i = 0; i < n_extents; i++) {
+            map_extent_t *ext = extent_map_get_ref(&parent->clusters, i);
+            if (extent_map_append(&blob->clusters, ext->lcluster, ext->pcluster, ext->len) < 0) {
+                goto error4;
+            }
+        }
+        blob->n_allocated = parent->n_allocated;
+    }
+
+    /* Writing the cluster map also writes the blob page. */
+    if (blob_persist_map(bs, blob, 0) < 0) {
+        goto error4;
+    }
+
+    if (dir_set(bs, slot, page_index) < 0) {
+        goto error4;
+    }
+
+    if (bs->head) {
+        bs->head->prev = blob;
+    }
+    bs->head = blob;
+    blob_mark_clusters(bs, blob, 1);
+    blob_touch(bs, blob);
+
+    stats_record(STAT_CREATE, stats_now() - start);
+    return 0;
+
+error4:
+    if (slot < array_size(&bs->dir)) array_set(&bs->dir, slot, 0);
+    bitset_set_indices(&bs->md_pages, &blob->cluster_page_indices, 0);
+    blob_index_remove(&bs->index, blob);
+error3:
+    extent_map_deinit(&blob->clusters);
+    array_deinit(&blob->cluster_page_indices);
+    pthread_rwlock_destroy(&blob->lock);
+error2:
+    free(blob);
+error1:
+    bitset_free(&bs->dir_slots, &slot, 1);
+error0:
+    bitset_free(&bs->md_pages, &page_index, 1);
+    return -1;
+}
+
+/**
+ * Create a blob of the given size in `n_clusters`. The blob is durable once
+ * the next `blobstore_commit` returns.
+ * 
+ * \param bs the blobstore.
+ * \param n_clusters the size of the blob in clusters.
+ * \return 0 if success else -1
+ */
+int blobstore_create_blob(blobstore_t *bs, uint32_t n_clusters) {
+    blobstore_lock(bs);
+    int res = blob_create(bs, n_clusters, NULL, 0);
+    blobstore_unlock(bs);
+    return res;
+}
+
+/**
+ * Create a blob that shares all clusters of `parent`. The parent is held
+ * exclusively, so that no write to it is in flight while its clusters
+ * become shared.
+ */
+static int blob_create_child(blobstore_t *bs, blob_t *parent, uint32_t flags) {
+    pthread_rwlock_wrlock(&parent->lock);
+    blobstore_lock(bs);
+    int res = blob_create(bs, parent->n_clusters, parent, flags);
+    blobstore_unlock(bs);
+    pthread_rwlock_unlock(&parent->lock);
+    return res;
+}
+
+/**
+ * Create a writable clone of `blob`. The clone shares all clusters of
+ * `blob` without copying any data, and a shared cluster is copied on the
+ * first write to it by either blob. Like `blobstore_create_blob`, the clone
+ * is placed at the head of the blob list and is durable once the next
+ * `blobstore_commit` returns.
+ *
+ * \param bs the blobstore.
+ * \param blob the blob to clone.
+ * \return 0 if success else -1
+ */
+int blob_clone(blobstore_t *bs, blob_t *blob) {
+    return blob_create_child(bs, blob, 0);
+}
+
+/**
+ * Create a read-only snapshot of the current content of `blob`. The snapshot
+ * shares all clusters of `blob` in the same way as `blob_clone`, and can
+ * itself be cloned.
+ *
+ * \param bs the blobstore.
+ * \param blob the blob to snapshot.
+ * \return 0 if success else -1
+ */
+int blob_snapshot(blobstore_t *bs, blob_t *blob) {
+    return blob_create_child(bs, blob, BLOB_READ_ONLY);
+}
+
+static int blob_delete(blobstore_t *bs, blob_t *blob) {
+    uint64_t start = stats_now();
+    if (blob_load(bs, blob) < 0) return -1;
+    if (md_reserve(bs, MD_OP_PAGES) < 0) return -1;
+    if (blobstore_mark_dirty(bs) < 0) return -1;
+
+    size_t n_freeing = array_size(&bs->freeing);
+    if (blob_free_clusters(bs, blob) < 0) {
+        return -1;
+    }
+
+    if (dir_set(bs, blob->slot, 0) < 0) {
+        array_resize(&bs->freeing, n_freeing);
+        return -1;
+    }
+
+    if (blob->prev) {
+        blob->prev->next = blob->next;
+    } else {
+        bs->head = blob->next;
+    }
+    if (blob->next) {
+        blob->next->prev = blob->prev;
+    }
+
+    blob_index_remove(&bs->index, blob);
+    bitset_set(&bs->dir_slots, blob->slot, 0);
+    bitset_set(&bs->md_pages, blob->page_index, 0);
+    bitset_set_indices(&bs->md_pages, &blob->cluster_page_indices, 0);
+
+    blob_unload(bs, blob);
+    blob_deinit(blob);
+    free(blob);
+
+    stats_record(STAT_DELETE, stats_now() - start);
+    return 0;
+}
+
+/**
+ * Delete `blob` from the blobstore `bs`. This will allow all clusters and
+ * metadata used by `blob` to be reused by another `blob` once the deletion
+ * is committed. I/O to `blob` still in flight is waited for, and no new I/O
+ * may be started on it.
+ * 
+ * \param bs the blobstore
+ * \param blob the blob
+ */
+int blobstore_delete_blob(blobstore_t *bs, blob_t *blob) {
+    if (blob == NULL) return -1;
+
+    pthread_rwlock_wrlock(&blob->lock);
+    pthread_rwlock_unlock(&blob->lock);
+
+    blobstore_lock(bs);
+    int res = blob_delete(bs, blob);
+    blobstore_unlock(bs);
+    return res;
+}
+
+static size_t blob_map_bytes(blob_t *blob) {
+    return blob->clusters.capacity * sizeof(map_extent_t) +
+        array_size(&blob->cluster_page_indices) * sizeof(uint32_t);
+}
+
+static void blob_lru_remove(blobstore_t *bs, blob_t *blob) {
+    if (blob->lru_prev) blob->lru_prev->lru_next = blob->lru_next;
+    else if (bs->lru_head == blob) bs->lru_head = blob->lru_next;
+    if (blob->lru_next) blob->lru_next->lru_prev = blob->lru_prev;
+    else if (bs->lru_tail == blob) bs->lru_tail = blob->lru_prev;
+    blob->lru_prev = NULL;
+    blob->lru_next = NULL;
+}
+
+/**
+ * Mark the loaded cluster map of `blob` as most recently used and update
+ * the memory accounted to it.
+ *
+ * \param bs the blobstore.
+ * \param blob the blob.
+ */
+void blob_touch(blobstore_t *bs, blob_t *blob) {
+    blobstore_lock(bs);
+    if (!blob->loaded) {
+        blobstore_unlock(bs);
+        return;
+    }
+
+    blob_lru_remove(bs, blob);
+    blob->lru_next = bs->lru_head;
+    if (bs->lru_head) bs->lru_head->lru_prev = blob;
+    bs->lru_head = blob;
+    if (bs->lru_tail == NULL) bs->lru_tail = blob;
+
+    size_t n_bytes = blob_map_bytes(blob);
+    bs->map_bytes += n_bytes - blob->map_bytes;
+    blob->map_bytes = n_bytes;
+    blobstore_unlock(bs);
+}
+
+/**
+ * Drop the in-memory cluster map of `blob`. Cluster maps are persisted on
+ * every change, so it can be read back at any time. No I/O may be in flight
+ * on `blob`.
+ *
+ * \param bs the blobstore.
+ * \param blob the blob.
+ */
+void blob_unload(blobstore_t *bs, blob_t *blob) {
+    if (!blob->loaded) return;
+
+    blob_lru_remove(bs, blob);
+    bs->map_bytes -= blob->map_bytes;
+    blob->map_bytes = 0;
+
+    extent_map_deinit(&blob->clusters);
+    if (array_size(&blob->cluster_page_indices) > 1) {
+        array_resize(&blob->cluster_page_indices, 1);
+    }
+    blob->loaded = 0;
+}
+
+/**
+ * Unload least recently used cluster maps until the loaded maps fit in the
+ * memory budget. The most recently used map is always kept, and so are the
+ * maps of blobs with I/O in flight. A map that was referenced by I/O since
+ * it was last moved is moved to the front instead.
+ *
+ * \param bs the blobstore.
+ */
+void blobstore_evict(blobstore_t *bs) {
+    blobstore_lock(bs);
+    blob_t *iter = bs->lru_tail;
+    while (bs->map_bytes > bs->map_budget && iter && iter != bs->lru_head) {
+        blob_t *prev = iter->lru_prev;
+        if (__atomic_exchange_n(&iter->referenced, 0, __ATOMIC_RELAXED)) {
+            blob_touch(bs, iter);
+        } else if (pthread_rwlock_trywrlock(&iter->lock) == 0) {
+            blob_unload(bs, iter);
+            pthread_rwlock_unlock(&iter->lock);
+            stats_add(STAT_MAP_EVICTIONS, 1);
+        }
+        iter = prev;
+    }
+    blobstore_unlock(bs);
+}
+
+/**
+ * Set the memory budget for loaded cluster maps.
+ *
+ * \param bs the blobstore.
+ * \param budget the budget in bytes.
+ */
+void blobstore_set_map_budget(blobstore_t *bs, size_t budget) {
+    blobstore_lock(bs);
+    bs->map_budget = budget;
+    blobstore_evict(bs);
+    blobstore_unlock(bs);
+}
+
+/**
+ * Fault in the cluster map of `blob` if it is not loaded and mark it as most
+ * recently used. Other maps may be unloaded to stay within the memory
+ * budget.
+ *
+ * \param bs the blobstore.
+ * \param blob the blob.
+ * \return 0 if success else -1
+ */
+int blob_load(blobstore_t *bs, blob_t *blob) {
+    blobstore_lock(bs);
+    if (!blob->loaded) {
+        uint64_t start = stats_now();
+        if (clusters_read(bs, blob, blob->next) < 0) {
+            extent_map_deinit(&blob->clusters);
+            if (array_size(&blob->cluster_page_indices) > 1) {
+                array_resize(&blob->cluster_page_indices, 1);
+            }
+            blobstore_unlock(bs);
+            return -1;
+        }
+        __atomic_store_n(&blob->loaded, 1, __ATOMIC_RELEASE);
+        stats_record(STAT_MAP_LOAD, stats_now() - start);
+    }
+
+    blob_touch(bs, blob);
+    blobstore_evict(bs);
+    blobstore_unlock(bs);
+    return 0;
+}
+
+/**
+ * Make sure the cluster map of `blob` is loaded for I/O under the blob lock.
+ * Eviction needs the blob lock exclusively, so a loaded map stays loaded
+ * while it is held, and I/O to it only marks the blob as referenced, without
+ * taking `bs->lock`. Eviction gives a referenced blob a second chance.
+ *
+ * \param bs the blobstore.
+ * \param blob the blob, with its lock held.
+ * \return 0 if success else -1
+ */
+static int blob_pin(blobstore_t *bs, blob_t *blob) {
+    if (!__atomic_load_n(&blob->loaded, __ATOMIC_ACQUIRE)) return blob_load(bs, blob);
+
+    if (!__atomic_load_n(&blob->referenced, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&blob->referenced, 1, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+/**
+ * Find the blob with the given UUID.
+ *
+ * \param bs the blobstore.
+ * \param uuid the UUID.
+ * \return the blob, or NULL if there is none.
+ */
+blob_t *blobstore_lookup(blobstore_t *bs, const uint8_t uuid[16]) {
+    blobstore_lock(bs);
+    blob_t *blob = blob_index_lookup(&bs->index, uuid);
+    blobstore_unlock(bs);
+    return blob;
+}
+
+/**
+ * Initialize `set` to represent the cluster sparsity of `blob`, whose
+ * cluster map must have been loaded with `blob_load`.
+ * 
+ * \param blob the blob
+ * \param set the bitset to initialize.
+ * \return 0 if success else -1
+ */
+int blob_nonzero(blob_t *blob, bitset_t *set) {
+    if (bitset_init(set, blob->n_clusters) < 0) return -1;
+
+    size_t n_extents = extent_map_size(&blob->clusters);
+    for (size_t i = 0; i < n_extents; i++) {
+        map_extent_t *ext = extent_map_get_ref(&blob->clusters, i);
+        bitset_set_range(set, ext->lcluster, ext->len, 1);
+    }
+
+    return 0;
+}
+
+/**
+ * Count the number of runs of physically contiguous clusters backing `blob`,
+ * whose cluster map must have been loaded with `blob_load`. A blob that is
+ * laid out sequentially has a single run however many extents its holes
+ * split it into.
+ *
+ * \param blob the blob.
+ * \return the number of runs.
+ */
+size_t blob_runs(blob_t *blob) {
+    size_t n_runs = 0;
+    uint32_t next = 0;
+
+    size_t n_extents = extent_map_size(&blob->clusters);
+    for (size_t i = 0; i < n_extents; i++) {
+        map_extent_t *ext = extent_map_get_ref(&blob->clusters, i);
+        if (ext->pcluster != next) n_runs++;
+        next = ext->pcluster + ext->len;
+    }
+
+    return n_runs;
+}
+
+/**
+ * Describe the fragmentation of the free space of `bs` as a histogram of
+ * the lengths of its free cluster runs.
+ *
+ * \param bs the blobstore.
+ * \param frag the report to fill.
+ */
+void blobstore_frag(blobstore_t *bs, blobstore_frag_t *frag) {
+    memset(frag, 0, sizeof(blobstore_frag_t));
+
+    blobstore_lock(bs);
+    extent_t run = bitset_next_clear_run(&bs->clusters, 0);
+    while (run.len) {
+        size_t k = llog2(run.len);
+        if (k >= BLOBSTORE_FRAG_BUCKETS) k = BLOBSTORE_FRAG_BUCKETS - 1;
+        frag->free_runs[k]++;
+        frag->free_clusters[k] += run.len;
+        frag->n_free += run.len;
+        frag->n_free_runs++;
+        if (run.len > frag->longest_free_run) frag->longest_free_run = run.len;
+        run = bitset_next_clear_run(&bs->clusters, run.start + run.len);
+    }
+    blobstore_unlock(bs);
+}
+
+/*
+ * A usage map records which metadata pages or clusters are referenced at
+ * least once (`seen`) and more than once (`multi`). The maps are plain
+ * words so that the maps built by several workers merge a word at a time.
+ */
+typedef struct usage {
+    size_t n_words;
+    uint64_t *seen;
+    uint64_t *multi;
+} usage_t;
+
+static int usage_init(usage_t *usage, size_t n) {
+    usage->n_words = (n + 63) / 64;
+    usage->seen = (uint64_t*) calloc(usage->n_words ? usage->n_words: 1, sizeof(uint64_t));
+    usage->multi = (uint64_t*) calloc(usage->n_words ? usage->n_words: 1, sizeof(uint64_t));
+    return usage->seen && usage->multi ? 0: -1;
+}
+
+static void usage_deinit(usage_t *usage) {
+    free(usage->seen);
+    free(usage->multi);
+}
+
+static void usage_mark(usage_t *usage, uint64_t start, uint64_t len) {
+    uint64_t end = start + len;
+    for (uint64_t i = start; i < end;) {
+        size_t lo = i & 63;
+        size_t hi = end - i < 64 - lo ? lo + (end - i): 64;
+        uint64_t mask = (hi == 64 ? ~0ULL: (1ULL << hi) - 1) & ~((1ULL << lo) - 1);
+        usage->multi[i >> 6] |= usage->seen[i >> 6] & mask;
+        usage->seen[i >> 6] |= mask;
+        i += hi - lo;
+    }
+}
+
+static void usage_merge(usage_t *dst, usage_t *src) {
+    for (size_t w = 0; w < dst->n_words; w++) {
+        dst->multi[w] |= src->multi[w] | (dst->seen[w] & src->seen[w]);
+        dst->seen[w] |= src->seen[w];
+    }
+}
+
+static int usage_get(uint64_t *words, size_t i) {
+    return words[i >> 6] >> (i & 63) & 1;
+}
+
+/*
+ * The state of the walk along the cluster page chain of one blob.
+ */
+typedef struct check_chain {
+    blob_t *blob;
+    uint32_t page_index;
+    uint32_t n_pages;
+    uint64_t lcluster;
+    uint64_t n_allocated;
+    int bad;
+} check_chain_t;
+
+typedef struct check_worker {
+    blobstore_t *bs;
+    blob_t **blobs;
+    size_t n_blobs;
+    usage_t pages;
+    usage_t clusters;
+    uint64_t n_bad_blobs;
+    int res;
+    pthread_t thread;
+} check_worker_t;
+
+static int check_page(check_worker_t *w, uint32_t page_index) {
+    uint32_t home;
+    if (page_index == 0 || md_page(w->bs, page_index, &home) < 0) return -1;
+    usage_mark(&w->pages, page_index, 1);
+    return 0;
+}
+
+static void check_chain_start(check_worker_t *w, check_chain_t *chain, blob_t *blob) {
+    memset(chain, 0, sizeof(check_chain_t));
+    chain->blob = blob;
+    if (check_page(w, blob->page_index) < 0) {
+        chain->bad = 1;
+        return;
+    }
+
+    if (array_size(&blob->cluster_page_indices) == 0) return;
+    chain->page_index = array_get(&blob->cluster_page_indices, 0);
+    chain->n_pages = 1;
+    if (check_page(w, chain->page_index) < 0) {
+        chain->page_index = 0;
+        chain->bad = 1;
+    }
+}
+
+/*
+ * Check the next cluster page of `chain`: its extents must be in logical
+ * order and lie within the blob and the device, and every page but the
+ * last must be full, as `cluster_page_fill` leaves them.
+ */
+static void check_chain_step(check_worker_t *w, check_chain_t *chain, cluster_page_t *cluster_page) {
+    blob_t *blob = chain->blob;
+    uint64_t n_clusters = bitset_capacity(&w->bs->clusters);
+    uint64_t max_pages = ((uint64_t) blob->n_clusters + CLUSTER_PAGE_EXTENTS - 1) / CLUSTER_PAGE_EXTENTS;
+
+    chain->page_index = 0;
+    if (cluster_page->n_extents == 0 || cluster_page->n_extents > CLUSTER_PAGE_EXTENTS) goto bad;
+    if (cluster_page->next && cluster_page->n_extents < CLUSTER_PAGE_EXTENTS) goto bad;
+
+    for (uint32_t i = 0; i < cluster_page->n_extents; i++) {
+        map_extent_t *ext = &cluster_page->extents[i];
+        if (ext->len == 0 || ext->lcluster < chain->lcluster) goto bad;
+        if ((uint64_t) ext->lcluster + ext->len > blob->n_clusters) goto bad;
+        if ((uint64_t) ext->pcluster + ext->len > n_clusters) goto bad;
+
+        usage_mark(&w->clusters, ext->pcluster, ext->len);
+        chain->lcluster = (uint64_t) ext->lcluster + ext->len;
+        chain->n_allocated += ext->len;
+    }
+
+    if (cluster_page->next) {
+        if (++chain->n_pages > max_pages || check_page(w, cluster_page->next) < 0) goto bad;
+        chain->page_index = cluster_page->next;
+    }
+    return;
+
+bad:
+    chain->bad = 1;
+}
+
+/*
+ * Walk the cluster page chains of the blobs of `w`, reading the next page
+ * of as many chains at once as its I/O queue takes.
+ */
+static void *check_worker_run(void *arg) {
+    check_worker_t *w = (check_worker_t*) arg;
+    blobstore_t *bs = w->bs;
+    w->res = -1;
+
+    ioq_t q;
+    if (ioq_init(&q, bs->dev, BLOBSTORE_QUEUE_DEPTH, 0) < 0) return NULL;
+    cluster_page_t *cluster_pages = aligned_alloc(PAGE_SIZE, q.depth * sizeof(cluster_page_t));
+    check_chain_t *chains = (check_chain_t*) calloc(q.depth, sizeof(check_chain_t));
+    if (cluster_pages == NULL || chains == NULL) goto done;
+
+    for (size_t first = 0; first < w->n_blobs; first += q.depth) {
+        size_t n = w->n_blobs - first < q.depth ? w->n_blobs - first: q.depth;
+        for (size_t j = 0; j < n; j++) {
+            check_chain_start(w, &chains[j], w->blobs[first + j]);
+        }
+
+        for (;;) {
+            size_t n_reads = 0;
+            for (size_t j = 0; j < n; j++) {
+                uint32_t home;
+                if (chains[j].page_index == 0) continue;
+                md_page(bs, chains[j].page_index, &home);
+                if (ioq_read(&q, &cluster_pages[j], PAGE_SIZE, page_offset(home)) < 0) {
+                    ioq_wait(&q);
+                    goto done;
+                }
+                n_reads++;
+            }
+            if (n_reads == 0) break;
+
+            if (ioq_wait(&q) < 0) goto done;
+            for (size_t j = 0; j < n; j++) {
+                if (chains[j].page_index) check_chain_step(w, &chains[j], &cluster_pages[j]);
+            }
+        }
+
+        for (size_t j = 0; j < n; j++) {
+            if (chains[j].bad || chains[j].n_allocated != chains[j].blob->n_allocated) w->n_bad_blobs++;
+        }
+    }
+    w->res = 0;
+
+done:
+    free(chains);
+    free(cluster_pages);
+    ioq_deinit(&q);
+    return NULL;
+}
+
+/**
+ * Rebuild the metadata page bitmap and the cluster reference counts from
+ * the cluster maps of all blobs, as an unclean open does. Every cluster map
+ * is loaded first, regardless of the memory budget, so that the maps are
+ * left untouched if one of them cannot be read.
+ */
+static int blobstore_rebuild_maps(blobstore_t *bs) {
+    size_t budget = bs->map_budget;
+    bs->map_budget = SIZE_MAX;
+    for (blob_t *iter = bs->head; iter; iter = iter->next) {
+        if (blob_load(bs, iter) < 0) {
+            blobstore_set_map_budget(bs, budget);
+            return -1;
+        }
+    }
+
+    if (blobstore_mark_dirty(bs) < 0) {
+        blobstore_set_map_budget(bs, budget);
+        return -1;
+    }
+
+    size_t n_clusters = array_size(&bs->refs);
+    memset(array_get_ref(&bs->refs, 0), 0, n_clusters * sizeof(uint32_t));
+    bitset_set_range(&bs->clusters, 0, n_clusters, 0);
+    bitset_set_range(&bs->md_pages, 0, bitset_capacity(&bs->md_pages), 0);
+    bitset_set(&bs->md_pages, 0, 1);
+
+    for (uint32_t i = 0; i < bs->n_md_extents; i++) {
+        clusters_set_ref(bs, bs->md_extents[i].pcluster, bs->md_extents[i].len, 1);
+    }
+    blobstore_reserve_pages(bs, bs->bitmap_page, bs->bitmap_pages, 1);
+    blobstore_reserve_pages(bs, bs->journal_page, bs->journal_pages, 1);
+    for (size_t r = 0; r < BLOBSTORE_DIR_ROOTS; r++) {
+        if (bs->dir_roots[r]) bitset_set(&bs->md_pages, bs->dir_roots[r], 1);
+    }
+    bitset_set_indices(&bs->md_pages, &bs->dir_pages, 1);
+
+    for (blob_t *iter = bs->head; iter; iter = iter->next) {
+        bitset_set(&bs->md_pages, iter->page_index, 1);
+        bitset_set_indices(&bs->md_pages, &iter->cluster_page_indices, 1);
+        blob_mark_clusters(bs, iter, 1);
+    }
+
+    blobstore_set_map_budget(bs, budget);
+    return 0;
+}
+
+/**
+ * Check the consistency of the blobstore `bs`. The cluster page chains of
+ * all blobs are read from their home pages by `n_threads` workers, each
+ * recording the metadata pages and clusters it finds in use in its own
+ * usage maps, which are then merged a word at a time. The merged maps are
+ * compared with the metadata page bitmap and the cluster reference counts:
+ * - a page or cluster used more than once, or a reserved cluster used by
+ *   a blob, is double-allocated (a cluster only if its count is 1),
+ * - one marked in use but not used, or whose reference count is above 1
+ *   while it is used once, is leaked,
+ * - one used but marked free is lost.
+ * With `repair`, the metadata page bitmap and the reference counts are
+ * rebuilt from the cluster maps, unless a blob has a broken cluster map.
+ * All channels other than the default one must have returned their pools.
+ *
+ * \param bs the blobstore.
+ * \param n_threads the number of workers.
+ * \param repair whether to rebuild the free maps.
+ * \param report the findings.
+ * \return 0 if success else -1
+ */
+int blobstore_check(blobstore_t *bs, int n_threads, int repair, blobstore_check_t *report) {
+    memset(report, 0, sizeof(blobstore_check_t));
+    if (n_threads < 1) n_threads = 1;
+    if (n_threads > BLOBSTORE_CHECK_THREADS) n_threads = BLOBSTORE_CHECK_THREADS;
+
+    blobstore_lock(bs);
+    int res = -1;
+    size_t n_pages = bitset_capacity(&bs->md_pages);
+    size_t n_clusters = bitset_capacity(&bs->clusters);
+    check_worker_t *workers = (check_worker_t*) calloc(n_threads, sizeof(check_worker_t));
+    blob_t **blobs = NULL;
+    usage_t pages = {0};
+    usage_t clusters = {0};
+    usage_t reserved = {0};
+    int n_started = 0;
+    if (workers == NULL) goto done;
+
+    /* The workers read home pages, so every update must have reached them. */
+    if (blobstore_flush(bs) < 0) goto done;
+
+    for (blob_t *iter = bs->head; iter; iter = iter->next) {
+        report->n_blobs++;
+    }
+    blobs = (blob_t**) calloc(report->n_blobs ? report->n_blobs: 1, sizeof(blob_t*));
+    if (blobs == NULL) goto done;
+    size_t i = 0;
+    for (blob_t *iter = bs->head; iter; iter = iter->next) {
+        blobs[i++] = iter;
+    }
+
+    size_t per_worker = (report->n_blobs + n_threads - 1) / n_threads;
+    for (; n_started < n_threads; n_started++) {
+        check_worker_t *w = &workers[n_started];
+        size_t first = n_started * per_worker;
+        w->bs = bs;
+        w->blobs = blobs + (first < report->n_blobs ? first: report->n_blobs);
+        w->n_blobs = first < report->n_blobs ? report->n_blobs - first: 0;
+        if (w->n_blobs > per_worker) w->n_blobs = per_worker;
+        if (usage_init(&w->pages, n_pages) < 0 || usage_init(&w->clusters, n_clusters) < 0 ||
+            pthread_create(&w->thread, NULL, check_worker_run, w) != 0) {
+            usage_deinit(&w->pages);
+            usage_deinit(&w->clusters);
+            break;
+        }
+    }
+
+    int failed = n_started < n_threads;
+    if (usage_init(&pages, n_pages) < 0 || usage_init(&clusters, n_clusters) < 0 ||
+        usage_init(&reserved, n_clusters) < 0) {
+        failed = 1;
+    }
+
+    if (!failed) {
+        usage_mark(&pages, 0, 1);
+        for (size_t r = 0; r < BLOBSTORE_DIR_ROOTS; r++) {
+            if (bs->dir_roots[r]) usage_mark(&pages, bs->dir_roots[r], 1);
+        }
+        for (size_t p = 0; p < array_size(&bs->dir_pages); p++) {
+            if (array_get(&bs->dir_pages, p)) usage_mark(&pages, array_get(&bs->dir_pages, p), 1);
+        }
+
+        uint64_t pages_per_cluster = cluster_pages(bs);
+        for (uint32_t e = 0; e < bs->n_md_extents; e++) {
+            usage_mark(&reserved, bs->md_extents[e].pcluster, bs->md_extents[e].len);
+        }
+        usage_mark(&reserved, bs->bitmap_page / pages_per_cluster,
+            ceil_div_ul((uint64_t) bs->bitmap_pages, pages_per_cluster));
+        usage_mark(&reserved, bs->journal_page / pages_per_cluster,
+            ceil_div_ul((uint64_t) bs->journal_pages, pages_per_cluster));
+    }
+
+    for (int t = 0; t < n_started; t++) {
+        check_worker_t *w = &workers[t];
+        pthread_join(w->thread, NULL);
+        if (w->res < 0) failed = 1;
+        if (!failed) {
+            usage_merge(&pages, &w->pages);
+            usage_merge(&clusters, &w->clusters);
+            report->n_bad_blobs += w->n_bad_blobs;
+        }
+        usage_deinit(&w->pages);
+        usage_deinit(&w->clusters);
+    }
+    if (failed) goto done;
+
+    for (size_t p = 0; p < n_pages; p++) {
+        int used = usage_get(pages.seen, p);
+        int marked = bitset_get(&bs->md_pages, p);
+        if (usage_get(pages.multi, p)) report->n_double_pages++;
+        if (used && !marked) report->n_lost_pages++;
+        if (!used && marked) report->n_leaked_pages++;
+    }
+
+    for (size_t c = 0; c < n_clusters; c++) {
+        uint32_t ref = array_get(&bs->refs, c);
+        int used = usage_get(clusters.seen, c);
+        int multi = usage_get(clusters.multi, c);
+        if (usage_get(reserved.seen, c)) {
+            if (used) report->n_double_clusters++;
+            if (ref == 0) report->n_lost_clusters++;
+        } else if (!used) {
+            if (ref) report->n_leaked_clusters++;
+        } else if (ref == 0) {
+            report->n_lost_clusters++;
+        } else if (multi && ref == 1) {
+            report->n_double_clusters++;
+        } else if (!multi && ref > 1) {
+            report->n_leaked_clusters++;
+        }
+    }
+
+    res = 0;
+    if (repair && report->n_bad_blobs == 0) {
+        res = blobstore_rebuild_maps(bs);
+        report->repaired = res == 0;
+    }
+
+done:
+    usage_deinit(&pages);
+    usage_deinit(&clusters);
+    usage_deinit(&reserved);
+    free(blobs);
+    free(workers);
+    blobstore_unlock(bs);
+    return res;
+}
+
+/**
+ * Queue a transfer of `len` bytes between `buf` and the device at byte
+ * `offset` within the physical cluster `cluster_id`.
+ */
+static int cluster_io(channel_t *ch, uint32_t cluster_id, void *buf, uint64_t offset, uint64_t len, int write) {
+    blobstore_t *bs = ch->bs;
+    uint64_t pos = ((uint64_t) cluster_id << bs->page_shift << bs->cluster_shift) + offset;
+    if (write) {
+        return ioq_write(&ch->ioq, buf, len, pos);
+    }
+
+    return ioq_read(&ch->ioq, buf, len, pos);
+}
+
+typedef struct iov_iter {
+    const struct iovec *iov;
+    int iovcnt;
+    int i;
+    size_t offset;
+} iov_iter_t;
+
+/**
+ * Describe the next `len` bytes of the buffers behind `it` with at most
+ * `max` iovecs stored in `out`, and advance past them.
+ *
+ * \return the number of bytes described.
+ */
+static uint64_t iov_iter_take(iov_iter_t *it, uint64_t len, struct iovec *out, int max, int *n) {
+    uint64_t taken = 0;
+    *n = 0;
+    while (taken < len && *n < max && it->i < it->iovcnt) {
+        const struct iovec *v = &it->iov[it->i];
+        size_t m = v->iov_len - it->offset;
+        if (m > len - taken) m = len - taken;
+
+        if (m) {
+            out[*n].iov_base = (uint8_t*) v->iov_base + it->offset;
+            out[*n].iov_len = m;
+            (*n)++;
+        }
+
+        taken += m;
+        it->offset += m;
+        if (it->offset == v->iov_len) {
+            it->i++;
+            it->offset = 0;
+        }
+    }
+
+    return taken;
+}
+
+/**
+ * Copy the byte range [`offset`, `offset + len`) of the physical cluster
+ * `src` to the same range of the physical cluster `dst`.
+ */
+static int cluster_copy(channel_t *ch, uint32_t src, uint32_t dst, uint64_t offset, uint64_t len) {
+    void *buf = blobstore_alloc_buf(ch->bs);
+    if (buf == NULL) return -1;
+
+    int res = -1;
+    if (cluster_io(ch, src, buf, offset, len, 0) < 0 || ioq_wait(&ch->ioq) < 0) goto done;
+    if (cluster_io(ch, dst, buf, offset, len, 1) < 0 || ioq_wait(&ch->ioq) < 0) goto done;
+    res = 0;
+
+done:
+    blobstore_free_buf(ch->bs, buf);
+    return res;
+}
+
+/**
+ * Initialize `ch` as a channel to the blobstore `bs`. A channel is the
+ * context through which one thread at a time issues data I/O: it owns an
+ * I/O queue and a private pool of free clusters, so that threads using
+ * different channels do not contend for either.
+ *
+ * \param ch the channel.
+ * \param bs the blobstore.
+ * \return 0 if success else -1
+ */
+int channel_init(channel_t *ch, blobstore_t *bs) {
+    ch->bs = bs;
+    ch->hint = bitset_capacity(&bs->clusters);
+    ch->n_pool = 0;
+    return ioq_init(&ch->ioq, bs->dev, BLOBSTORE_QUEUE_DEPTH, 0);
+}
+
+/**
+ * Release all resources associated with the channel `ch`, returning the
+ * clusters left in its pool to the blobstore.
+ *
+ * \param ch the channel.
+ */
+void channel_deinit(channel_t *ch) {
+    blobstore_lock(ch->bs);
+    bitset_free_extents(&ch->bs->clusters, ch->pool, ch->n_pool);
+    blobstore_unlock(ch->bs);
+    ch->n_pool = 0;
+    ioq_deinit(&ch->ioq);
+}
+
+/**
+ * Replace the cluster pool of `ch` with a new batch of at least `n` free
+ * clusters, returning the clusters left in the pool first.
+ */
+static int channel_refill(channel_t *ch, size_t n) {
+    blobstore_t *bs = ch->bs;
+    blobstore_lock(bs);
+    bitset_free_extents(&bs->clusters, ch->pool, ch->n_pool);
+    ch->n_pool = 0;
+
+    size_t n_free = bitset_capacity(&bs->clusters) - bitset_size(&bs->clusters);
+    if (n_free < n + CHANNEL_POOL_CLUSTERS && bs->n_discarding) {
+        blobstore_discard(bs);
+        n_free = bitset_capacity(&bs->clusters) - bitset_size(&bs->clusters);
+    }
+
+    /* Batches come from the smallest free runs, as single clusters would. */
+    size_t want = n + CHANNEL_POOL_CLUSTERS < n_free ? n + CHANNEL_POOL_CLUSTERS: n_free;
+    int n_extents = -1;
+    if (want >= n) {
+        n_extents = bitset_alloc_holes(&bs->clusters, want, ch->pool, CHANNEL_POOL_EXTENTS);
+        size_t n_pooled = 0;
+        for (int i = 0; i < n_extents; i++) {
+            n_pooled += ch->pool[i].len;
+        }
+        if (n_pooled < n) {
+            bitset_free_extents(&bs->clusters, ch->pool, n_extents);
+            n_extents = bitset_alloc_extents(&bs->clusters, n, ch->hint, ch->pool, CHANNEL_POOL_EXTENTS);
+        }
+    }
+    blobstore_unlock(bs);
+    if (n_extents < 0) return -1;
+
+    ch->n_pool = n_extents;
+    ch->hint = ch->pool[n_extents - 1].start + ch->pool[n_extents - 1].len;
+    return 0;
+}
+
+/**
+ * Allocate `n` clusters for the exclusive use of the caller as at most
+ * `max_runs` runs in `runs`. Clusters are taken from the pool of `ch`,
+ * starting with the one at `hint` if it is there, and the pool is refilled
+ * in batches, so most allocations do not touch the shared allocator. Large
+ * allocations bypass the pool.
+ *
+ * \return the number of runs if success else -1
+ */
+static int channel_alloc(channel_t *ch, size_t n, size_t hint, extent_t *runs, size_t max_runs) {
+    blobstore_t *bs = ch->bs;
+    if (n > CHANNEL_POOL_CLUSTERS) {
+        blobstore_lock(bs);
+        int n_runs = bitset_alloc_extents(&bs->clusters, n, hint, runs, max_runs);
+        if (n_runs < 0 && bs->n_discarding) {
+            blobstore_discard(bs);
+            n_runs = bitset_alloc_extents(&bs->clusters, n, hint, runs, max_runs);
+        }
+        blobstore_unlock(bs);
+        return n_runs;
+    }
+
+    size_t n_pooled = 0;
+    for (size_t i = 0; i < ch->n_pool; i++) {
+        n_pooled += ch->pool[i].len;
+    }
+    if (n_pooled < n && channel_refill(ch, n) < 0) return -1;
+
+    size_t n_runs = 0;
+    while (n > 0) {
+        size_t j = 0;
+        for (size_t i = 0; i < ch->n_pool; i++) {
+            if (ch->pool[i].start == hint) {
+                j = i;
+                break;
+            }
+        }
+
+        extent_t *ext = &ch->pool[j];
+        uint32_t take = ext->len < n ? ext->len: n;
+        if (n_runs && runs[n_runs - 1].start + runs[n_runs - 1].len == ext->start) {
+            runs[n_runs - 1].len += take;
+        } else {
+            runs[n_runs].start = ext->start;
+            runs[n_runs].len = take;
+            n_runs++;
+        }
+
+        ext->start += take;
+        ext->len -= take;
+        hint = ext->start;
+        n -= take;
+        if (ext->len == 0) {
+            memmove(ext, ext + 1, (ch->n_pool - j - 1) * sizeof(extent_t));
+            ch->n_pool--;
+        }
+    }
+
+    return n_runs;
+}
+
+/**
+ * Fill the parts of the fresh clusters `first` and `last` of `blob` that
+ * the write of [`offset`, `end`) does not cover. A cluster that replaces a
+ * shared cluster, as recorded in `shared`, gets the content of the shared
+ * cluster. Any other fresh cluster is zeroed.
+ */
+static int blob_fill_fresh(channel_t *ch, blob_t *blob, uint8_t *fresh, uint32_t *shared, size_t first, size_t last, uint64_t offset, uint64_t end) {
+    blobstore_t *bs = ch->bs;
+    uint64_t cluster_size = 1ULL << bs->page_shift << bs->cluster_shift;
+    uint64_t head = offset % cluster_size;
+    uint64_t tail = end % cluster_size;
+
+    if (head && fresh[0]) {
+        uint32_t cluster_id = extent_map_lookup(&blob->clusters, first);
+        if (shared[0]) {
+            if (cluster_copy(ch, shared[0], cluster_id, 0, head) < 0) return -1;
+        } else if (cluster_io(ch, cluster_id, bs->zeros, 0, head, 1) < 0) {
+            return -1;
+        }
+    }
+
+    if (tail && fresh[last - first]) {
+        uint32_t cluster_id = extent_map_lookup(&blob->clusters, last);
+        if (shared[last - first]) {
+            if (cluster_copy(ch, shared[last - first], cluster_id, tail, cluster_size - tail) < 0) return -1;
+        } else if (cluster_io(ch, cluster_id, bs->zeros, tail, cluster_size - tail, 1) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Give the clusters of `runs` back to the pool of `ch`, or to the blobstore
+ * once the pool has no room for more runs.
+ */
+static void channel_return(channel_t *ch, extent_t *runs, size_t n_runs) {
+    for (size_t r = 0; r < n_runs; r++) {
+        if (ch->n_pool < CHANNEL_POOL_EXTENTS) {
+            ch->pool[ch->n_pool++] = runs[r];
+        } else {
+            blobstore_lock(ch->bs);
+            bitset_free_extents(&ch->bs->clusters, &runs[r], 1);
+            blobstore_unlock(ch->bs);
+        }
+    }
+}
+
+/**
+ * Count the logical clusters of `blob` in [`first`, `last`] that a write
+ * needs fresh clusters for, because they are unallocated or shared. The
+ * blobstore must be locked.
+ */
+static size_t blob_count_fresh(blobstore_t *bs, blob_t *blob, size_t first, size_t last) {
+    size_t n_fresh = 0;
+    for (size_t i = first; i <= last; i++) {
+        uint32_t cluster_id = extent_map_lookup(&blob->clusters, i);
+        n_fresh += cluster_id == 0 || array_get(&bs->refs, cluster_id) > 1;
+    }
+    return n_fresh;
+}
+
+/**
+ * Map the clusters of `runs` in order to the `n_fresh` logical clusters of
+ * `blob` in [`first`, `last`] that are unallocated or shared, recording
+ * them in `fresh` and the shared clusters they replace in `shared`. The
+ * caller counts them with `blob_count_fresh` under the same hold of the
+ * blobstore lock, and `runs` must hold at least as many clusters. `runs` is
+ * cut down to the clusters used and the rest go back to the pool of `ch`.
+ *
+ * \return 0 if success else -1
+ */
+static int blob_map_fresh(channel_t *ch, blob_t *blob, size_t first, size_t last, size_t n_fresh, uint8_t *fresh, uint32_t *shared, extent_t *runs, int *n_runs) {
+    blobstore_t *bs = ch->bs;
+    extent_map_t *map = &blob->clusters;
+
+    size_t n_used = 0;
+    int r = 0;
+    for (; r < *n_runs && n_used < n_fresh; r++) {
+        if (runs[r].len > n_fresh - n_used) {
+            extent_t rest = {runs[r].start + (n_fresh - n_used), runs[r].len - (n_fresh - n_used)};
+            runs[r].len = n_fresh - n_used;
+            channel_return(ch, &rest, 1);
+        }
+        clusters_set_ref(bs, runs[r].start, runs[r].len, 1);
+        n_used += runs[r].len;
+    }
+    channel_return(ch, runs + r, *n_runs - r);
+    *n_runs = r;
+
+    r = 0;
+    uint32_t used = 0;
+    for (size_t i = first; i <= last; i++) {
+        uint32_t cluster_id = extent_map_lookup(map, i);
+        if (cluster_id && array_get(&bs->refs, cluster_id) == 1) continue;
+
+        if (cluster_id) {
+            if (extent_map_remove(map, i, 1, NULL, NULL) < 0) return -1;
+            shared[i - first] = cluster_id;
+            fresh[i - first] = 1;
+        }
+
+        if (extent_map_insert(map, i, runs[r].start + used, 1) < 0) return -1;
+        fresh[i - first] = 1;
+        if (!cluster_id) blob->n_allocated++;
+        if (++used == runs[r].len) {
+            r++;
+            used = 0;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Transfer the byte range [`offset`, `offset + len`) of `blob` to or from
+ * the buffers of `iov` as one batch. The range is split along the extents
+ * of the cluster map, and each extent is transferred with a single vectored
+ * request straight to or from the caller's buffers. Unallocated clusters
+ * read back as zeros. On write, backing clusters are allocated for the
+ * unallocated clusters in range and the parts of them not covered by the
+ * write are zeroed. Clusters shared with other blobs are copied on write:
+ * each is replaced by a fresh cluster that takes the parts of the shared
+ * cluster not covered by the write, and the reference to the shared cluster
+ * is dropped by the commit of the new map. The affected cluster pages are
+ * persisted once all data has landed.
+ */
+static int blob_iov(channel_t *ch, blob_t *blob, const struct iovec *iov, int iovcnt, uint64_t offset, int write) {
+    blobstore_t *bs = ch->bs;
+    ioq_t *q = &ch->ioq;
+    uint64_t cluster_size = 1ULL << bs->page_shift << bs->cluster_shift;
+    uint64_t block_mask = (1ULL << bs->page_shift) - 1;
+    extent_map_t *map = &blob->clusters;
+
+    uint64_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len & block_mask) return -1;
+        len += iov[i].iov_len;
+    }
+
+    if (offset & block_mask) return -1;
+    if (write && (blob->flags & BLOB_READ_ONLY)) return -1;
+    if (len == 0) return 0;
+
+    size_t first = offset / cluster_size;
+    size_t last = (offset + len - 1) / cluster_size;
+
+    uint8_t *fresh = NULL;
+    uint32_t *shared = NULL;
+    extent_t *runs = NULL;
+    int n_runs = 0;
+    struct iovec *slices = NULL;
+    size_t n_fresh = 0;
+
+    /*
+     * A write that allocates clusters holds the blob exclusively, so that no
+     * reader sees a fresh cluster before it has been filled. Anything else
+     * shares it.
+     */
+    int exclusive = 0;
+    pthread_rwlock_rdlock(&blob->lock);
+    for (;;) {
+        uint64_t blob_size = blob->n_clusters * cluster_size;
+        if (offset > blob_size || len > blob_size - offset) goto unlock;
+
+        if (blob_pin(bs, blob) < 0) goto unlock;
+
+        /* Only a write needs the reference counts, to find the shared clusters. */
+        if (write) {
+            blobstore_lock(bs);
+            n_fresh = blob_count_fresh(bs, blob, first, last);
+            blobstore_unlock(bs);
+        }
+
+        if (n_fresh == 0 || exclusive) break;
+
+        pthread_rwlock_unlock(&blob->lock);
+        pthread_rwlock_wrlock(&blob->lock);
+        exclusive = 1;
+        n_fresh = 0;
+    }
+    uint64_t start = stats_now();
+
+    size_t first_extent = extent_map_find(map, first);
+    if (first_extent > 0) first_extent--;
+
+    if (n_fresh) {
+        fresh = (uint8_t*) calloc(last - first + 1, 1);
+        shared = (uint32_t*) calloc(last - first + 1, sizeof(uint32_t));
+        runs = (extent_t*) calloc(n_fresh, sizeof(extent_t));
+        if (fresh == NULL || shared == NULL || runs == NULL) goto error0;
+
+        size_t hint = ch->hint;
+        uint32_t prev = first > 0 ? extent_map_lookup(map, first - 1): 0;
+        if (prev) hint = prev + 1;
+
+        /* A cluster may have become shared since it was counted, in which case the write plans again. */
+        int res;
+        for (;;) {
+            n_runs = channel_alloc(ch, n_fresh, hint, runs, n_fresh);
+            if (n_runs < 0) goto error0;
+
+            blobstore_lock(bs);
+            size_t n_needed = blob_count_fresh(bs, blob, first, last);
+            if (n_needed <= n_fresh) {
+                n_fresh = n_needed;
+                res = blob_map_fresh(ch, blob, first, last, n_fresh, fresh, shared, runs, &n_runs);
+                blobstore_unlock(bs);
+                break;
+            }
+            blobstore_unlock(bs);
+
+            channel_return(ch, runs, n_runs);
+            n_runs = 0;
+            n_fresh = n_needed;
+            extent_t *grown = (extent_t*) realloc(runs, n_fresh * sizeof(extent_t));
+            if (grown == NULL) goto error0;
+            runs = grown;
+        }
+        if (res < 0) goto error;
+
+        if (blob_fill_fresh(ch, blob, fresh, shared, first, last, offset, offset + len) < 0) goto error;
+    }
+
+    /* Every request takes its own slices of the caller's buffers, which must outlive it. */
+    size_t max_slices = iovcnt + 2 * (last - first + 1);
+    slices = (struct iovec*) calloc(max_slices, sizeof(struct iovec));
+    if (slices == NULL) goto error;
+
+    iov_iter_t it = {iov, iovcnt, 0, 0};
+    size_t n_slices = 0;
+    uint64_t pos = offset;
+    uint64_t end = offset + len;
+    while (pos < end) {
+        size_t lcluster = pos / cluster_size;
+        size_t e = extent_map_find(map, lcluster);
+        map_extent_t *ext = e < extent_map_size(map) ? extent_map_get_ref(map, e): NULL;
+
+        if (ext == NULL || ext->lcluster > lcluster) {
+            uint64_t hole_end = ext && (uint64_t) ext->lcluster * cluster_size < end ?
+                (uint64_t) ext->lcluster * cluster_size: end;
+            while (pos < hole_end) {
+                struct iovec piece;
+                int n;
+                pos += iov_iter_take(&it, hole_end - pos, &piece, 1, &n);
+                memset(piece.iov_base, 0, piece.iov_len);
+            }
+            continue;
+        }
+
+        uint64_t run_end = (uint64_t) (ext->lcluster + ext->len) * cluster_size;
+        if (run_end > end) run_end = end;
+        uint64_t dev_offset = ((uint64_t) (ext->pcluster + lcluster - ext->lcluster) << bs->page_shift << bs->cluster_shift) +
+            pos % cluster_size;
+
+        while (pos < run_end) {
+            struct iovec *req = &slices[n_slices];
+            int n;
+            uint64_t taken = iov_iter_take(&it, run_end - pos, req, IOV_MAX, &n);
+            n_slices += n;
+
+            int res = write ? ioq_writev(q, req, n, dev_offset): ioq_readv(q, req, n, dev_offset);
+            if (res < 0) goto error;
+
+            dev_offset += taken;
+            pos += taken;
+        }
+    }
+
+    if (ioq_wait(q) < 0) goto error;
+
+    if (n_fresh) {
+        blobstore_lock(bs);
+        if (md_reserve(bs, blob_persist_pages(blob, first_extent, 0)) < 0) {
+            blobstore_unlock(bs);
+            goto error;
+        }
+
+        size_t n_freeing = array_size(&bs->freeing);
+        if (array_resize(&bs->freeing, n_freeing + 2 * n_fresh) < 0) {
+            blobstore_unlock(bs);
+            goto error;
+        }
+
+        bs->flush_data = 1;
+        if (blob_persist_map(bs, blob, first_extent) < 0) {
+            array_resize(&bs->freeing, n_freeing);
+            blobstore_unlock(bs);
+            goto error;
+        }
+
+        /*
+         * The committed map still points to the shared clusters it replaces,
+         * so their references are only dropped by the commit of the new one.
+         */
+        size_t n = n_freeing;
+        for (size_t i = first; i <= last; i++) {
+            uint32_t cluster_id = shared[i - first];
+            if (cluster_id == 0) continue;
+            if (n > n_freeing &&
+                array_get(&bs->freeing, n - 2) + array_get(&bs->freeing, n - 1) == cluster_id) {
+                array_set(&bs->freeing, n - 1, array_get(&bs->freeing, n - 1) + 1);
+            } else {
+                array_set(&bs->freeing, n, cluster_id);
+                array_set(&bs->freeing, n + 1, 1);
+                n += 2;
+            }
+        }
+        array_resize(&bs->freeing, n);
+        blob_touch(bs, blob);
+        blobstore_unlock(bs);
+    }
+    pthread_rwlock_unlock(&blob->lock);
+    stats_record(write ? STAT_BLOB_WRITE: STAT_BLOB_READ, stats_now() - start);
+
+    free(slices);
+    free(runs);
+    free(shared);
+    free(fresh);
+    return 0;
+
+error:
+    ioq_wait(q);
+    blobstore_lock(bs);
+    for (size_t i = first; fresh && i <= last; i++) {
+        if (fresh[i - first]) {
+            extent_map_remove(map, i, 1, NULL, NULL);
+            if (shared[i - first]) {
+                extent_map_insert(map, i, shared[i - first], 1);
+            } else {
+                blob->n_allocated--;
+            }
+        }
+    }
+    for (int r = 0; r < n_runs; r++) {
+        clusters_set_ref(bs, runs[r].start, runs[r].len, 0);
+    }
+    blobstore_unlock(bs);
+error0:
+    free(slices);
+    free(runs);
+    free(shared);
+    free(fresh);
+unlock:
+    pthread_rwlock_unlock(&blob->lock);
+    return -1;
+}
+
+/**
+ * Deallocate the logical clusters [`first`, `end`) of `blob` and persist its
+ * cluster map. The backing clusters are released with the next commit. On
+ * failure the cluster map is left unchanged.
+ */
+static int blob_unmap_clusters(blobstore_t *bs, blob_t *blob, uint32_t first, uint32_t end) {
+    extent_map_t *map = &blob->clusters;
+    size_t lo = extent_map_find(map, first);
+    size_t hi = lo;
+    while (hi < extent_map_size(map) && extent_map_get_ref(map, hi)->lcluster < end) hi++;
+
+    /* Keep the affected extents so that the map can be restored on failure. */
+    size_t n = hi - lo;
+    map_extent_t *old = (map_extent_t*) malloc((n ? n: 1) * sizeof(map_extent_t));
+    if (old == NULL) return -1;
+    if (n) memcpy(old, extent_map_get_ref(map, lo), n * sizeof(map_extent_t));
+
+    if (md_reserve(bs, blob_persist_pages(blob, lo > 0 ? lo - 1: 0, 1)) < 0) goto error0;
+    size_t n_freeing = array_size(&bs->freeing);
+    if (array_resize(&bs->freeing, n_freeing + 2 * n) < 0) goto error0;
+    if (extent_map_remove(map, first, end - first, NULL, NULL) < 0) goto error1;
+
+    for (size_t i = 0; i < n; i++) {
+        uint32_t a = old[i].lcluster > first ? old[i].lcluster: first;
+        uint32_t b = old[i].lcluster + old[i].len < end ? old[i].lcluster + old[i].len: end;
+        array_set(&bs->freeing, n_freeing + 2 * i, old[i].pcluster + (a - old[i].lcluster));
+        array_set(&bs->freeing, n_freeing + 2 * i + 1, b - a);
+        blob->n_allocated -= b - a;
+    }
+
+    if (blob_persist_map(bs, blob, lo > 0 ? lo - 1: 0) < 0) goto error2;
+
+    free(old);
+    return 0;
+
+error2:
+    extent_map_remove(map, first, end - first, NULL, NULL);
+    for (size_t i = 0; i < n; i++) {
+        uint32_t a = old[i].lcluster > first ? old[i].lcluster: first;
+        uint32_t b = old[i].lcluster + old[i].len < end ? old[i].lcluster + old[i].len: end;
+        extent_map_insert(map, a, old[i].pcluster + (a - old[i].lcluster), b - a);
+        blob->n_allocated += b - a;
+    }
+error1:
+    array_resize(&bs->freeing, n_freeing);
+error0:
+    free(old);
+    return -1;
+}
+
+/**
+ * Deallocate the clusters of `blob` in the byte range [`offset`,
+ * `offset + len`), which then read back as zeros. The backing clusters are
+ * released, and discarded from the device, once the unmap is committed.
+ *
+ * \param bs the blobstore.
+ * \param blob the blob.
+ * \param offset the byte offset, a multiple of the cluster size.
+ * \param len the length in bytes, a multiple of the cluster size.
+ * \return 0 if success else -1
+ */
+int blob_unmap(blobstore_t *bs, blob_t *blob, uint64_t offset, uint64_t len) {
+    uint64_t cluster_size = 1ULL << bs->page_shift << bs->cluster_shift;
+    int res = -1;
+
+    pthread_rwlock_wrlock(&blob->lock);
+    blobstore_lock(bs);
+
+    uint64_t blob_size = blob->n_clusters * cluster_size;
+    if ((offset | len) & (cluster_size - 1)) goto done;
+    if (offset > blob_size || len > blob_size - offset) goto done;
+    if (blob->flags & BLOB_READ_ONLY) goto done;
+
+    res = 0;
+    if (len == 0) goto done;
+
+    res = -1;
+    if (blob_load(bs, blob) < 0) goto done;
+    if (blob_unmap_clusters(bs, blob, offset / cluster_size, (offset + len) / cluster_size) < 0) {
+        goto done;
+    }
+
+    blob_touch(bs, blob);
+    res = 0;
+
+done:
+    blobstore_unlock(bs);
+    pthread_rwlock_unlock(&blob->lock);
+    return res;
+}
+
+/**
+ * Change the size of `blob` to `n_clusters`. Growing only updates the blob
+ * page, since the new clusters are unallocated. Shrinking truncates the
+ * cluster map, rewrites the affected pages at the tail of the cluster page
+ * chain, and releases the truncated clusters once the resize is committed.
+ *
+ * \param bs the blobstore.
+ * \param blob the blob.
+ * \param n_clusters the new size of the blob in clusters.
+ * \return 0 if success else -1
+ */
+int blob_resize(blobstore_t *bs, blob_t *blob, uint32_t n_clusters) {
+    if (n_clusters == 0) return -1;
+    if (blob->flags & BLOB_READ_ONLY) return -1;
+
+    pthread_rwlock_wrlock(&blob->lock);
+    blobstore_lock(bs);
+
+    int res = -1;
+    uint32_t old = blob->n_clusters;
+    if (blob_load(bs, blob) < 0) goto done;
+
+    res = 0;
+    if (n_clusters == old) goto done;
+
+    blob->n_clusters = n_clusters;
+    if (n_clusters < old) {
+        res = blob_unmap_clusters(bs, blob, n_clusters, old);
+    } else if (md_reserve(bs, MD_OP_PAGES) < 0 || blobstore_mark_dirty(bs) < 0 ||
+               blobstore_write_blob_page(bs, blob) < 0) {
+        res = -1;
+    }
+
+    if (res < 0) {
+        blob->n_clusters = old;
+    } else {
+        blob_touch(bs, blob);
+    }
+
+done:
+    blobstore_unlock(bs);
+    pthread_rwlock_unlock(&blob->lock);
+    return res;
+}
+
+/**
+ * Prepare to move the clusters of `blob` into as few runs as the free space
+ * of `bs` allows. Clusters shared with other blobs stay where they are, so
+ * only the clusters referenced by `blob` alone are counted. The target runs
+ * are reserved up front, and are released again by `blob_defrag_end`.
+ *
+ * \param bs the blobstore.
+ * \param blob the blob.
+ * \param defrag the defragmentation state to initialize.
+ * \return 1 if there is work to do, 0 if there is none, or -1 on error.
+ */
+int blob_defrag_begin(blobstore_t *bs, blob_t *blob, blob_defrag_t *defrag) {
+    memset(defrag, 0, sizeof(blob_defrag_t));
+    memcpy(defrag->uuid, blob->uuid, 16);
+    if (blob->flags & BLOB_READ_ONLY) return 0;
+
+    pthread_rwlock_rdlock(&blob->lock);
+    blobstore_lock(bs);
+
+    int res = -1;
+    if (blob_load(bs, blob) < 0) goto done;
+
+    size_t n = 0;
+    size_t n_runs = 0;
+    uint32_t next = 0;
+    uint32_t *refs = array_get_ref(&bs->refs, 0);
+    size_t n_extents = extent_map_size(&blob->clusters);
+    for (size_t i = 0; i < n_extents; i++) {
+        map_extent_t *ext = extent_map_get_ref(&blob->clusters, i);
+        for (uint32_t j = 0; j < ext->len; j++) {
+            uint32_t p = ext->pcluster + j;
+            if (refs[p] != 1) continue;
+            if (p != next) n_runs++;
+            next = p + 1;
+            n++;
+        }
+    }
+
+    res = 0;
+    if (n_runs <= 1) goto done;
+
+    /* Moving is only worth it if the clusters end up in fewer runs. */
+    size_t max_runs = n_runs - 1 < BLOB_DEFRAG_RUNS ? n_runs - 1: BLOB_DEFRAG_RUNS;
+    if (bs->n_discarding) blobstore_discard(bs);
+    int n_target = bitset_alloc_extents(&bs->clusters, n, bitset_capacity(&bs->clusters), defrag->target, max_runs);
+    if (n_target < 0) goto done;
+
+    defrag->n_target = n_target;
+    res = 1;
+
+done:
+    blobstore_unlock(bs);
+    pthread_rwlock_unlock(&blob->lock);
+    return res;
+}
+
+/**
+ * Move the next batch of at most `max` clusters of `blob`, and never more
+ * than `BLOB_DEFRAG_STEP`, into the target runs of `defrag`. The clusters
+ * are copied without holding the blobstore lock, but with the blob locked
+ * against I/O, and the cluster map is then switched over and persisted. The
+ * commit of the move flushes the copies first, and the old clusters are
+ * released once it is done.
+ *
+ * \param ch the channel used for the copies.
+ * \param blob the blob.
+ * \param defrag the defragmentation state.
+ * \param max the maximum number of clusters to move.
+ * \return the number of clusters moved, 0 when done, or -1 on error.
+ */
+int blob_defrag_step(channel_t *ch, blob_t *blob, blob_defrag_t *defrag, size_t max) {
+    blobstore_t *bs = ch->bs;
+    uint64_t cluster_size = 1ULL << bs->page_shift << bs->cluster_shift;
+    uint32_t lcluster[BLOB_DEFRAG_STEP];
+    uint32_t src[BLOB_DEFRAG_STEP];
+    uint32_t dst[BLOB_DEFRAG_STEP];
+    size_t n = 0;
+    if (max > BLOB_DEFRAG_STEP) max = BLOB_DEFRAG_STEP;
+
+    pthread_rwlock_wrlock(&blob->lock);
+    blobstore_lock(bs);
+    if (blob_load(bs, blob) < 0) goto error;
+
+    /* Plan the moves, consuming the target runs from the front. */
+    extent_map_t *map = &blob->clusters;
+    uint32_t *refs = array_get_ref(&bs->refs, 0);
+    size_t pos = defrag->target_pos;
+    extent_t target = pos < defrag->n_target ? defrag->target[pos]: (extent_t) {0, 0};
+    for (size_t i = extent_map_find(map, defrag->lcluster); i < extent_map_size(map) && n < max; i++) {
+        map_extent_t *ext = extent_map_get_ref(map, i);
+        uint32_t j = ext->lcluster < defrag->lcluster ? defrag->lcluster - ext->lcluster: 0;
+        for (; j < ext->len && n < max; j++) {
+            if (refs[ext->pcluster + j] != 1) continue;
+            if (target.len == 0) {
+                if (++pos >= defrag->n_target) break;
+                target = defrag->target[pos];
+            }
+            lcluster[n] = ext->lcluster + j;
+            src[n] = ext->pcluster + j;
+            dst[n] = target.start++;
+            target.len--;
+            n++;
+        }
+        if (pos >= defrag->n_target) break;
+    }
+    blobstore_unlock(bs);
+
+    if (n == 0) {
+        pthread_rwlock_unlock(&blob->lock);
+        return 0;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (cluster_copy(ch, src[i], dst[i], 0, cluster_size) < 0) {
+            pthread_rwlock_unlock(&blob->lock);
+            return -1;
+        }
+    }
+
+    blobstore_lock(bs);
+    size_t first = extent_map_find(map, lcluster[0]);
+    if (md_reserve(bs, blob_persist_pages(blob, first > 0 ? first - 1: 0, 2 * n)) < 0) goto error;
+
+    bs->flush_data = 1;
+    size_t n_freeing = array_size(&bs->freeing);
+    if (array_resize(&bs->freeing, n_freeing + 2 * n) < 0) goto error;
+
+    size_t k = 0;
+    for (; k < n; k++) {
+        if (extent_map_remove(map, lcluster[k], 1, NULL, NULL) < 0) break;
+        if (extent_map_insert(map, lcluster[k], dst[k], 1) < 0) {
+            extent_map_insert(map, lcluster[k], src[k], 1);
+            break;
+        }
+        array_set(&bs->freeing, n_freeing + 2 * k, src[k]);
+        array_set(&bs->freeing, n_freeing + 2 * k + 1, 1);
+    }
+
+    if (k < n || blob_persist_map(bs, blob, first > 0 ? first - 1: 0) < 0) {
+        for (size_t i = 0; i < k; i++) {
+            extent_map_remove(map, lcluster[i], 1, NULL, NULL);
+            extent_map_insert(map, lcluster[i], src[i], 1);
+        }
+        array_resize(&bs->freeing, n_freeing);
+        goto error;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        clusters_ref(bs, dst[i], 1);
+    }
+
+    defrag->lcluster = lcluster[n - 1] + 1;
+    defrag->n_moved += n;
+    defrag->target_pos = pos;
+    if (pos < defrag->n_target) defrag->target[pos] = target;
+
+    blob_touch(bs, blob);
+    blobstore_unlock(bs);
+    pthread_rwlock_unlock(&blob->lock);
+    return n;
+
+error:
+    blobstore_unlock(bs);
+    pthread_rwlock_unlock(&blob->lock);
+    return -1;
+}
+
+/**
+ * Release the target clusters of `defrag` that were not used.
+ *
+ * \param bs the blobstore.
+ * \param defrag the defragmentation state.
+ */
+void blob_defrag_end(blobstore_t *bs, blob_defrag_t *defrag) {
+    if (defrag->target_pos >= defrag->n_target) return;
+
+    blobstore_lock(bs);
+    bitset_free_extents(&bs->clusters, defrag->target + defrag->target_pos, defrag->n_target - defrag->target_pos);
+    blobstore_unlock(bs);
+    defrag->n_target = 0;
+    defrag->target_pos = 0;
+}
+
+/**
+ * Transfer through the channel of the blobstore itself, which is shared by
+ * all threads that use the blobstore functions for data I/O.
+ */
+static int blobstore_iov(blobstore_t *bs, blob_t *blob, const struct iovec *iov, int iovcnt, uint64_t offset, int write) {
+    pthread_mutex_lock(&bs->channel_lock);
+    int res = blob_iov(&bs->channel, blob, iov, iovcnt, offset, write);
+    pthread_mutex_unlock(&bs->channel_lock);
+    return res;
+}
+
+/**
+ * Read `len` bytes at byte `offset` of `blob` into `buf`. Clusters that have
+ * never been written read back as zeros without touching the device.
+ *
+ * \param bs the blobstore.
+ * \param blob the blob.
+ * \param buf the destination buffer, aligned for direct I/O.
+ * \param offset the byte offset, a multiple of the block size.
+ * \param len the length in bytes, a multiple of the block size.
+ * \return 0 if success else -1
+ */
+int blob_read(blobstore_t *bs, blob_t *blob, void *buf, uint64_t offset, uint64_t len) {
+    struct iovec iov = {buf, len};
+    return blobstore_iov(bs, blob, &iov, 1, offset, 0);
+}
+
+/**
+ * Write `len` bytes from `buf` at byte `offset` of `blob`. A backing cluster
+ * is allocated on the first write to each cluster of the blob, and the new
+ * mappings are durable once the next `blobstore_commit` returns.
+ *
+ * \param bs the blobstore.
+ * \param blob the blob.
+ * \param buf the source buffer, aligned for direct I/O.
+ * \param offset the byte offset, a multiple of the block size.
+ * \param len the length in bytes, a multiple of the block size.
+ * \return 0 if success else -1
+ */
+int blob_write(blobstore_t *bs, blob_t *blob, const void *buf, uint64_t offset, uint64_t len) {
+    struct iovec iov = {(void*) buf, len};
+    return blobstore_iov(bs, blob, &iov, 1, offset, 1);
+}
+
+/**
+ * Read from byte `offset` of `blob` into the buffers of `iov` in order. Each
+ * run of physically contiguous clusters is read with a single request.
+ *
+ * \param bs the blobstore.
+ * \param blob the blob.
+ * \param iov the destination buffers, aligned for direct I/O.
+ * \param iovcnt the number of buffers.
+ * \param offset the byte offset, a multiple of the block size.
+ * \return 0 if success else -1
+ */
+int blob_readv(blobstore_t *bs, blob_t *blob, const struct iovec *iov, int iovcnt, uint64_t offset) {
+    return blobstore_iov(bs, blob, iov, iovcnt, offset, 0);
+}
+
+/**
+ * Write the buffers of `iov` in order from byte `offset` of `blob`. Each
+ * run of physically contiguous clusters is written with a single request.
+ *
+ * \param bs the blobstore.
+ * \param blob the blob.
+ * \param iov the source buffers, aligned for direct I/O.
+ * \param iovcnt the number of buffers.
+ * \param offset the byte offset, a multiple of the block size.
+ * \return 0 if success else -1
+ */
+int blob_writev(blobstore_t *bs, blob_t *blob, const struct iovec *iov, int iovcnt, uint64_t offset) {
+    return blobstore_iov(bs, blob, iov, iovcnt, offset, 1);
+}
+
+/**
+ * Read `len` bytes at byte `offset` of `blob` into `buf` through the
+ * channel `ch`.
+ *
+ * \param ch the channel.
+ * \param blob the blob.
+ * \param buf the destination buffer, aligned for direct I/O.
+ * \param offset the byte offset, a multiple of the block size.
+ * \param len the length in bytes, a multiple of the block size.
+ * \return 0 if success else -1
+ */
+int channel_read(channel_t *ch, blob_t *blob, void *buf, uint64_t offset, uint64_t len) {
+    struct iovec iov = {buf, len};
+    return blob_iov(ch, blob, &iov, 1, offset, 0);
+}
+
+/**
+ * Write `len` bytes from `buf` at byte `offset` of `blob` through the
+ * channel `ch`.
+ *
+ * \param ch the channel.
+ * \param blob the blob.
+ * \param buf the source buffer, aligned for direct I/O.
+ * \param offset the byte offset, a multiple of the block size.
+ * \param len the length in bytes, a multiple of the block size.
+ * \return 0 if success else -1
+ */
+int channel_write(channel_t *ch, blob_t *blob, const void *buf, uint64_t offset, uint64_t len) {
+    struct iovec iov = {(void*) buf, len};
+    return blob_iov(ch, blob, &iov, 1, offset, 1);
+}
+
+/**
+ * Read from byte `offset` of `blob` into the buffers of `iov` in order
+ * through the channel `ch`.
+ *
+ * \param ch the channel.
+ * \param blob the blob.
+ * \param iov the destination buffers, aligned for direct I/O.
+ * \param iovcnt the number of buffers.
+ * \param offset the byte offset, a multiple of the block size.
+ * \return 0 if success else -1
+ */
+int channel_readv(channel_t *ch, blob_t *blob, const struct iovec *iov, int iovcnt, uint64_t offset) {
+    return blob_iov(ch, blob, iov, iovcnt, offset, 0);
+}
+
+/**
+ * Write the buffers of `iov` in order from byte `offset` of `blob` through
+ * the channel `ch`.
+ *
+ * \param ch the channel.
+ * \param blob the blob.
+ * \param iov the source buffers, aligned for direct I/O.
+ * \param iovcnt the number of buffers.
+ * \param offset the byte offset, a multiple of the block size.
+ * \return 0 if success else -1
+ */
+int channel_writev(channel_t *ch, blob_t *blob, const struct iovec *iov, int iovcnt, uint64_t offset) {
+    return blob_iov(ch, blob, iov, iovcnt, offset, 1);
 }
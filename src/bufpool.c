@@ -0,0 +1,90 @@
+#define _GNU_SOURCE
+#include "bufpool.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+/*
+ * A buffer pool carves equally sized I/O buffers out of one mapping, backed
+ * by huge pages when the system has some reserved and by transparent huge
+ * pages otherwise. Buffers are aligned to the smaller of their size and the
+ * page size, which satisfies direct I/O. Free buffers are kept on a stack,
+ * so the most recently released and likely cached buffer is reused first.
+ * The stack is guarded by a mutex, so a pool can be shared between threads.
+ */
+
+/**
+ * Initialize `pool` with `n_bufs` buffers of `buf_size` bytes each.
+ *
+ * \param pool the buffer pool.
+ * \param buf_size the buffer size, a multiple of 4096.
+ * \param n_bufs the number of buffers.
+ * \return 0 if success else -1
+ */
+int bufpool_init(bufpool_t *pool, size_t buf_size, size_t n_bufs) {
+    memset(pool, 0, sizeof(bufpool_t));
+    if (buf_size == 0 || buf_size % 4096 || n_bufs == 0) return -1;
+
+    size_t size = buf_size * n_bufs;
+    pool->map_size = (size + BUFPOOL_HUGE_PAGE_SIZE - 1) & ~(BUFPOOL_HUGE_PAGE_SIZE - 1);
+    pool->base = mmap(NULL, pool->map_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    pool->huge = pool->base != MAP_FAILED;
+    if (!pool->huge) {
+        pool->map_size = size;
+        pool->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pool->base == MAP_FAILED) return -1;
+        madvise(pool->base, size, MADV_HUGEPAGE);
+    }
+
+    pool->free = (void**) calloc(n_bufs, sizeof(void*));
+    if (pool->free == NULL) {
+        munmap(pool->base, pool->map_size);
+        return -1;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->buf_size = buf_size;
+    pool->n_bufs = n_bufs;
+    for (size_t i = 0; i < n_bufs; i++) {
+        pool->free[pool->n_free++] = pool->base + (n_bufs - 1 - i) * buf_size;
+    }
+
+    return 0;
+}
+
+void bufpool_deinit(bufpool_t *pool) {
+    if (pool->base == NULL) return;
+
+    munmap(pool->base, pool->map_size);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->free);
+    memset(pool, 0, sizeof(bufpool_t));
+}
+
+/**
+ * Take a buffer from `pool`.
+ *
+ * \param pool the buffer pool.
+ * \return the buffer, or NULL if every buffer is in use.
+ */
+void *bufpool_get(bufpool_t *pool) {
+    void *buf = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->n_free) buf = pool->free[--pool->n_free];
+    pthread_mutex_unlock(&pool->lock);
+    return buf;
+}
+
+/**
+ * Return a buffer taken with `bufpool_get` to `pool`.
+ *
+ * \param pool the buffer pool.
+ * \param buf the buffer.
+ */
+void bufpool_put(bufpool_t *pool, void *buf) {
+    pthread_mutex_lock(&pool->lock);
+    pool->free[pool->n_free++] = buf;
+    pthread_mutex_unlock(&pool->lock);
+}
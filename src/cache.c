@@ -0,0 +1,183 @@
+#include "cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The cache is a fixed pool of page-aligned frames holding metadata pages,
+ * found by page index through an open-addressing hash table of frame
+ * numbers. Clean frames are recycled with the CLOCK policy: the hand skips
+ * and clears referenced frames, giving each recently used page a second
+ * chance. Dirty frames hold updates that have not reached their home
+ * location yet and are never recycled; pending frames are the dirty frames
+ * whose content has not been committed to the journal yet.
+ */
+
+#define PAGE_SIZE 4096
+
+#define MAP_EMPTY -1
+
+static size_t page_hash(uint32_t index) {
+    return (size_t) (index * 0x9e3779b1U);
+}
+
+int cache_init(cache_t *cache, size_t n_frames) {
+    memset(cache, 0, sizeof(cache_t));
+    if (n_frames == 0) return -1;
+
+    size_t n = 16;
+    while (n < 2 * n_frames) n <<= 1;
+
+    cache->map = (int32_t*) malloc(n * sizeof(int32_t));
+    cache->frames = (cache_frame_t*) calloc(n_frames, sizeof(cache_frame_t));
+    cache->pages = (uint8_t*) aligned_alloc(PAGE_SIZE, n_frames * PAGE_SIZE);
+    if (cache->map == NULL || cache->frames == NULL || cache->pages == NULL) {
+        cache_deinit(cache);
+        return -1;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        cache->map[i] = MAP_EMPTY;
+    }
+    cache->map_capacity = n;
+    cache->n_frames = n_frames;
+    return 0;
+}
+
+void cache_deinit(cache_t *cache) {
+    free(cache->map);
+    free(cache->frames);
+    free(cache->pages);
+    memset(cache, 0, sizeof(cache_t));
+}
+
+static size_t cache_slot(cache_t *cache, uint32_t index) {
+    size_t mask = cache->map_capacity - 1;
+    size_t i = page_hash(index) & mask;
+    while (cache->map[i] != MAP_EMPTY) {
+        if (cache->frames[cache->map[i]].index == index) return i;
+        i = (i + 1) & mask;
+    }
+
+    return i;
+}
+
+static void cache_unmap(cache_t *cache, uint32_t index) {
+    size_t mask = cache->map_capacity - 1;
+    size_t i = cache_slot(cache, index);
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (cache->map[j] == MAP_EMPTY) break;
+
+        /* Move the entry back unless its home slot lies cyclically in (i, j]. */
+        size_t home = page_hash(cache->frames[cache->map[j]].index) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            cache->map[i] = cache->map[j];
+            i = j;
+        }
+    }
+
+    cache->map[i] = MAP_EMPTY;
+}
+
+static void *frame_page(cache_t *cache, size_t frame) {
+    return cache->pages + frame * PAGE_SIZE;
+}
+
+/**
+ * Find the cached copy of the metadata page `index`.
+ *
+ * \param cache the cache.
+ * \param index the page index.
+ * \return the cached page, or NULL if it is not cached.
+ */
+void *cache_lookup(cache_t *cache, uint32_t index) {
+    int32_t frame = cache->map[cache_slot(cache, index)];
+    if (frame == MAP_EMPTY) return NULL;
+
+    cache->frames[frame].referenced = 1;
+    return frame_page(cache, frame);
+}
+
+/**
+ * Find a frame for the metadata page `index`. A page that is not cached yet
+ * gets a recycled clean frame whose content is undefined until the caller
+ * fills it.
+ *
+ * \param cache the cache.
+ * \param index the page index.
+ * \return the frame, or NULL if every frame is dirty.
+ */
+void *cache_insert(cache_t *cache, uint32_t index) {
+    void *page = cache_lookup(cache, index);
+    if (page) return page;
+
+    /* Two sweeps clear every reference bit, so a clean frame is found if there is one. */
+    for (size_t n = 0; n < 2 * cache->n_frames; n++) {
+        size_t i = cache->hand;
+        cache_frame_t *frame = &cache->frames[i];
+        cache->hand = (i + 1) % cache->n_frames;
+        if (frame->dirty) continue;
+        if (frame->valid && frame->referenced) {
+            frame->referenced = 0;
+            continue;
+        }
+
+        if (frame->valid) cache_unmap(cache, frame->index);
+        frame->index = index;
+        frame->valid = 1;
+        frame->referenced = 1;
+        cache->map[cache_slot(cache, index)] = (int32_t) i;
+        return frame_page(cache, i);
+    }
+
+    return NULL;
+}
+
+cache_frame_t *cache_get_frame(cache_t *cache, void *page) {
+    return &cache->frames[((uint8_t*) page - cache->pages) / PAGE_SIZE];
+}
+
+/**
+ * Mark the cached page `page` as modified since it was last committed.
+ *
+ * \param cache the cache.
+ * \param page a page returned by `cache_insert`.
+ */
+void cache_set_dirty(cache_t *cache, void *page) {
+    cache_frame_t *frame = cache_get_frame(cache, page);
+    if (!frame->dirty) cache->n_dirty++;
+    if (!frame->pending) cache->n_pending++;
+    frame->dirty = 1;
+    frame->pending = 1;
+}
+
+/**
+ * Write every dirty page that is not pending to its home location and mark
+ * it clean.
+ *
+ * \param cache the cache.
+ * \param q the I/O queue.
+ * \return 0 if success else -1
+ */
+int cache_writeback(cache_t *cache, ioq_t *q) {
+    for (size_t i = 0; i < cache->n_frames; i++) {
+        cache_frame_t *frame = &cache->frames[i];
+        if (!frame->dirty || frame->pending) continue;
+        if (ioq_write(q, frame_page(cache, i), PAGE_SIZE, (uint64_t) frame->index * PAGE_SIZE) < 0) {
+            ioq_wait(q);
+            return -1;
+        }
+    }
+    if (ioq_wait(q) < 0) return -1;
+
+    for (size_t i = 0; i < cache->n_frames; i++) {
+        cache_frame_t *frame = &cache->frames[i];
+        if (!frame->dirty || frame->pending) continue;
+        frame->dirty = 0;
+        cache->n_dirty--;
+    }
+
+    return 0;
+}
@@ -0,0 +1,224 @@
+#include "extent.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * An extent map translates logical clusters to physical clusters. It is a
+ * sorted array of non-overlapping (lcluster, pcluster, len) extents; logical
+ * clusters not covered by any extent are unallocated.
+ */
+
+int extent_map_init(extent_map_t *map) {
+    map->size = 0;
+    map->capacity = 0;
+    map->data = NULL;
+    return 0;
+}
+
+void extent_map_deinit(extent_map_t *map) {
+    free(map->data);
+    map->data = NULL;
+    map->size = 0;
+    map->capacity = 0;
+}
+
+size_t extent_map_size(extent_map_t *map) {
+    return map->size;
+}
+
+map_extent_t *extent_map_get_ref(extent_map_t *map, size_t i) {
+    assert(i < map->size);
+    return &map->data[i];
+}
+
+static int extent_map_reserve(extent_map_t *map, size_t n) {
+    if (n <= map->capacity) return 0;
+
+    size_t capacity = map->capacity ? map->capacity * 2: 4;
+    while (capacity < n) capacity *= 2;
+
+    map_extent_t *data = (map_extent_t*) realloc(map->data, capacity * sizeof(map_extent_t));
+    if (data == NULL) return -1;
+
+    map->data = data;
+    map->capacity = capacity;
+    return 0;
+}
+
+/**
+ * Append an extent that starts past the end of every extent in `map`. This
+ * is used when loading a map that is already sorted.
+ *
+ * \param map the extent map.
+ * \param lcluster the first logical cluster.
+ * \param pcluster the first physical cluster.
+ * \param len the length in clusters.
+ * \return 0 if success else -1
+ */
+int extent_map_append(extent_map_t *map, uint32_t lcluster, uint32_t pcluster, uint32_t len) {
+    if (len == 0 || pcluster == 0) return -1;
+    if (map->size) {
+        map_extent_t *last = &map->data[map->size - 1];
+        if (lcluster < last->lcluster + last->len) return -1;
+    }
+
+    if (extent_map_reserve(map, map->size + 1) < 0) return -1;
+    map_extent_t *ext = &map->data[map->size++];
+    ext->lcluster = lcluster;
+    ext->pcluster = pcluster;
+    ext->len = len;
+    return 0;
+}
+
+/**
+ * Find the first extent that ends after `lcluster` with a binary search.
+ *
+ * \param map the extent map.
+ * \param lcluster the logical cluster.
+ * \return the index of the extent, or the size of the map if there is none.
+ */
+size_t extent_map_find(extent_map_t *map, uint32_t lcluster) {
+    size_t lo = 0;
+    size_t hi = map->size;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        map_extent_t *ext = &map->data[mid];
+        if ((uint64_t) ext->lcluster + ext->len <= lcluster) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/**
+ * Translate the logical cluster `lcluster` to its physical cluster.
+ *
+ * \param map the extent map.
+ * \param lcluster the logical cluster.
+ * \return the physical cluster, or 0 if `lcluster` is unallocated.
+ */
+uint32_t extent_map_lookup(extent_map_t *map, uint32_t lcluster) {
+    size_t i = extent_map_find(map, lcluster);
+    if (i == map->size) return 0;
+
+    map_extent_t *ext = &map->data[i];
+    if (lcluster < ext->lcluster) return 0;
+    return ext->pcluster + (lcluster - ext->lcluster);
+}
+
+/**
+ * Map the unallocated logical clusters [`lcluster`, `lcluster + len`) to the
+ * physical clusters starting at `pcluster`. The new extent is merged with its
+ * neighbours when they are contiguous both logically and physically.
+ *
+ * \param map the extent map.
+ * \param lcluster the first logical cluster.
+ * \param pcluster the first physical cluster.
+ * \param len the length in clusters.
+ * \return 0 if success else -1
+ */
+int extent_map_insert(extent_map_t *map, uint32_t lcluster, uint32_t pcluster, uint32_t len) {
+    if (len == 0 || pcluster == 0) return -1;
+
+    size_t i = extent_map_find(map, lcluster);
+    if (i < map->size && map->data[i].lcluster < lcluster + len) return -1;
+
+    map_extent_t *prev = i > 0 ? &map->data[i - 1]: NULL;
+    map_extent_t *next = i < map->size ? &map->data[i]: NULL;
+    int merge_prev = prev && prev->lcluster + prev->len == lcluster &&
+        prev->pcluster + prev->len == pcluster;
+    int merge_next = next && lcluster + len == next->lcluster &&
+        pcluster + len == next->pcluster;
+
+    if (merge_prev && merge_next) {
+        prev->len += len + next->len;
+        memmove(next, next + 1, (map->size - i - 1) * sizeof(map_extent_t));
+        map->size--;
+    } else if (merge_prev) {
+        prev->len += len;
+    } else if (merge_next) {
+        next->lcluster = lcluster;
+        next->pcluster = pcluster;
+        next->len += len;
+    } else {
+        if (extent_map_reserve(map, map->size + 1) < 0) return -1;
+        memmove(&map->data[i + 1], &map->data[i], (map->size - i) * sizeof(map_extent_t));
+        map->data[i].lcluster = lcluster;
+        map->data[i].pcluster = pcluster;
+        map->data[i].len = len;
+        map->size++;
+    }
+
+    return 0;
+}
+
+/**
+ * Unmap the logical clusters [`lcluster`, `lcluster + len`), splitting
+ * extents that straddle the boundaries. `fn` is called with every physical
+ * run that is unmapped.
+ *
+ * \param map the extent map.
+ * \param lcluster the first logical cluster.
+ * \param len the length in clusters.
+ * \param fn the function receiving the unmapped physical runs, or NULL.
+ * \param ctx the context passed to `fn`.
+ * \return 0 if success else -1
+ */
+int extent_map_remove(extent_map_t *map, uint32_t lcluster, uint32_t len, extent_fn_t fn, void *ctx) {
+    if (extent_map_reserve(map, map->size + 1) < 0) return -1;
+
+    uint64_t end = (uint64_t) lcluster + len;
+    size_t i = extent_map_find(map, lcluster);
+    while (i < map->size && map->data[i].lcluster < end) {
+        map_extent_t *ext = &map->data[i];
+        uint64_t ext_end = (uint64_t) ext->lcluster + ext->len;
+        uint32_t lo = ext->lcluster > lcluster ? ext->lcluster: lcluster;
+        uint32_t hi = ext_end < end ? ext_end: end;
+
+        if (fn) fn(ctx, ext->pcluster + (lo - ext->lcluster), hi - lo);
+
+        if (lo > ext->lcluster && hi < ext_end) {
+            memmove(ext + 1, ext, (map->size - i) * sizeof(map_extent_t));
+            map->size++;
+            ext->len = lo - ext->lcluster;
+            map_extent_t *tail = ext + 1;
+            tail->pcluster += hi - tail->lcluster;
+            tail->len = ext_end - hi;
+            tail->lcluster = hi;
+            break;
+        } else if (lo > ext->lcluster) {
+            ext->len = lo - ext->lcluster;
+            i++;
+        } else if (hi < ext_end) {
+            ext->pcluster += hi - ext->lcluster;
+            ext->len = ext_end - hi;
+            ext->lcluster = hi;
+            break;
+        } else {
+            memmove(ext, ext + 1, (map->size - i - 1) * sizeof(map_extent_t));
+            map->size--;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Count the logical clusters of `map` that are backed by a physical cluster.
+ *
+ * \param map the extent map.
+ * \return the number of allocated clusters.
+ */
+size_t extent_map_allocated(extent_map_t *map) {
+    size_t n = 0;
+    for (size_t i = 0; i < map->size; i++) {
+        n += map->data[i].len;
+    }
+
+    return n;
+}
@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+#include "index.h"
+#include "blob.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The blob index is an open-addressing hash table of blobs keyed on their
+ * UUID. Collisions are resolved with linear probing and removals shift the
+ * following entries back, so there are no tombstones. The capacity is a
+ * power of two and the table grows when it becomes more than 70% full.
+ */
+
+static size_t uuid_hash(const uint8_t uuid[16]) {
+    uint64_t lo;
+    uint64_t hi;
+    memcpy(&lo, uuid, 8);
+    memcpy(&hi, uuid + 8, 8);
+    uint64_t h = (lo ^ (hi * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+    return (size_t) (h ^ (h >> 32));
+}
+
+int blob_index_init(blob_index_t *index, size_t capacity) {
+    size_t n = 16;
+    while (n < capacity) n <<= 1;
+
+    index->slots = (struct blob**) calloc(n, sizeof(struct blob*));
+    if (index->slots == NULL) return -1;
+
+    index->capacity = n;
+    index->size = 0;
+    return 0;
+}
+
+void blob_index_deinit(blob_index_t *index) {
+    free(index->slots);
+    index->slots = NULL;
+    index->capacity = 0;
+    index->size = 0;
+}
+
+size_t blob_index_size(blob_index_t *index) {
+    return index->size;
+}
+
+static void blob_index_place(blob_index_t *index, struct blob *blob) {
+    size_t mask = index->capacity - 1;
+    size_t i = uuid_hash(blob->uuid) & mask;
+    while (index->slots[i]) {
+        i = (i + 1) & mask;
+    }
+    index->slots[i] = blob;
+}
+
+static int blob_index_grow(blob_index_t *index) {
+    blob_index_t grown;
+    if (blob_index_init(&grown, index->capacity * 2) < 0) return -1;
+
+    for (size_t i = 0; i < index->capacity; i++) {
+        if (index->slots[i]) blob_index_place(&grown, index->slots[i]);
+    }
+    grown.size = index->size;
+
+    free(index->slots);
+    *index = grown;
+    return 0;
+}
+
+/**
+ * Insert `blob` into `index`.
+ *
+ * \param index the blob index.
+ * \param blob the blob.
+ * \return 0 if success else -1, including when a blob with the same UUID is
+ * already present.
+ */
+int blob_index_insert(blob_index_t *index, struct blob *blob) {
+    if (blob_index_lookup(index, blob->uuid)) return -1;
+    if ((index->size + 1) * 10 > index->capacity * 7 && blob_index_grow(index) < 0) {
+        return -1;
+    }
+
+    blob_index_place(index, blob);
+    index->size++;
+    return 0;
+}
+
+static size_t blob_index_slot(blob_index_t *index, const uint8_t uuid[16]) {
+    size_t mask = index->capacity - 1;
+    size_t i = uuid_hash(uuid) & mask;
+    while (index->slots[i]) {
+        if (memcmp(index->slots[i]->uuid, uuid, 16) == 0) return i;
+        i = (i + 1) & mask;
+    }
+
+    return index->capacity;
+}
+
+/**
+ * Find the blob with the given UUID.
+ *
+ * \param index the blob index.
+ * \param uuid the UUID.
+ * \return the blob, or NULL if there is none.
+ */
+struct blob *blob_index_lookup(blob_index_t *index, const uint8_t uuid[16]) {
+    size_t i = blob_index_slot(index, uuid);
+    return i < index->capacity ? index->slots[i]: NULL;
+}
+
+/**
+ * Remove `blob` from `index`.
+ *
+ * \param index the blob index.
+ * \param blob the blob.
+ * \return 0 if success else -1
+ */
+int blob_index_remove(blob_index_t *index, struct blob *blob) {
+    size_t i = blob_index_slot(index, blob->uuid);
+    if (i == index->capacity || index->slots[i] != blob) return -1;
+
+    size_t mask = index->capacity - 1;
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (index->slots[j] == NULL) break;
+
+        /* Move the entry back unless its home slot lies cyclically in (i, j]. */
+        size_t home = uuid_hash(index->slots[j]->uuid) & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            index->slots[i] = index->slots[j];
+            i = j;
+        }
+    }
+
+    index->slots[i] = NULL;
+    index->size--;
+    return 0;
+}
@@ -0,0 +1,422 @@
+#define _GNU_SOURCE
+#include "ioq.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ * Each request in flight on the ring occupies a slot recording what it
+ * transfers and when it was queued, so that completions can be checked and
+ * timed, and the iovecs it owns, if any. The slot number is the user data
+ * of the request.
+ */
+typedef struct ioq_slot {
+    uint64_t len;
+    uint64_t start;
+    uint8_t opcode;
+    struct iovec *iov;
+} ioq_slot_t;
+
+static int io_uring_setup(uint32_t entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int ioq_ring_init(ioq_t *q, uint32_t flags) {
+    struct io_uring_params p = {0};
+    p.flags = flags;
+
+    int ring_fd = io_uring_setup(q->depth, &p);
+    if (ring_fd < 0) return -1;
+
+    q->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    q->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (q->cq_ring_size > q->sq_ring_size) q->sq_ring_size = q->cq_ring_size;
+        q->cq_ring_size = 0;
+    }
+
+    q->sq_ring = mmap(NULL, q->sq_ring_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (q->sq_ring == MAP_FAILED) goto error0;
+
+    q->cq_ring = q->sq_ring;
+    if (q->cq_ring_size) {
+        q->cq_ring = mmap(NULL, q->cq_ring_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (q->cq_ring == MAP_FAILED) goto error1;
+    }
+
+    q->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    q->sqes = mmap(NULL, q->sqes_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (q->sqes == MAP_FAILED) goto error2;
+
+    uint8_t *sq = (uint8_t*) q->sq_ring;
+    q->sq_head = (uint32_t*) (sq + p.sq_off.head);
+    q->sq_tail = (uint32_t*) (sq + p.sq_off.tail);
+    q->sq_mask = (uint32_t*) (sq + p.sq_off.ring_mask);
+    q->sq_array = (uint32_t*) (sq + p.sq_off.array);
+
+    uint8_t *cq = (uint8_t*) q->cq_ring;
+    q->cq_head = (uint32_t*) (cq + p.cq_off.head);
+    q->cq_tail = (uint32_t*) (cq + p.cq_off.tail);
+    q->cq_mask = (uint32_t*) (cq + p.cq_off.ring_mask);
+    q->cqes = (struct io_uring_cqe*) (cq + p.cq_off.cqes);
+
+    if (p.sq_entries < q->depth) q->depth = p.sq_entries;
+
+    q->slots = (ioq_slot_t*) calloc(q->depth, sizeof(ioq_slot_t));
+    q->free_slots = (uint32_t*) calloc(q->depth, sizeof(uint32_t));
+    if (q->slots == NULL || q->free_slots == NULL) goto error3;
+    for (uint32_t i = 0; i < q->depth; i++) {
+        q->free_slots[i] = i;
+    }
+    q->n_free = q->depth;
+
+    q->ring_fd = ring_fd;
+    return 0;
+
+error3:
+    free(q->slots);
+    free(q->free_slots);
+    munmap(q->sqes, q->sqes_size);
+error2:
+    if (q->cq_ring_size) munmap(q->cq_ring, q->cq_ring_size);
+error1:
+    munmap(q->sq_ring, q->sq_ring_size);
+error0:
+    close(ring_fd);
+    return -1;
+}
+
+/**
+ * Initialize the I/O queue `q` for issuing requests against `dev` with up to
+ * `depth` requests in flight. An io_uring instance is used when the kernel
+ * provides one and the device has a file descriptor; otherwise requests are
+ * executed synchronously through the device operations as they are queued.
+ * With `IOQ_POLL` completions are reaped by polling the device rather than
+ * waiting for interrupts, which requires direct I/O. A striped device gets
+ * a queue of `depth` requests per member, and requests are split at stripe
+ * boundaries and routed to the queues of the members they touch.
+ *
+ * \param q the I/O queue.
+ * \param dev the device.
+ * \param depth the maximum number of requests in flight.
+ * \param flags `IOQ_POLL` or 0.
+ * \return 0 if success else -1
+ */
+int ioq_init(ioq_t *q, bdev_t *dev, uint32_t depth, int flags) {
+    memset(q, 0, sizeof(ioq_t));
+    if (depth == 0) return -1;
+
+    q->dev = dev;
+    q->ring_fd = -1;
+    q->depth = depth;
+    if (dev->n_members) {
+        q->members = (ioq_t*) calloc(dev->n_members, sizeof(ioq_t));
+        if (q->members == NULL) return -1;
+        for (uint32_t i = 0; i < dev->n_members; i++) {
+            if (ioq_init(&q->members[i], &dev->members[i], depth, flags) < 0) {
+                q->n_members = i;
+                ioq_deinit(q);
+                return -1;
+            }
+        }
+        q->n_members = dev->n_members;
+        return 0;
+    }
+    if (dev->fd < 0) return 0;
+
+    if ((flags & IOQ_POLL) && ioq_ring_init(q, IORING_SETUP_IOPOLL) == 0) {
+        return 0;
+    }
+
+    ioq_ring_init(q, 0);
+    return 0;
+}
+
+/**
+ * Release all resources associated with the I/O queue `q`. Requests still in
+ * flight are waited for first.
+ *
+ * \param q the I/O queue.
+ */
+void ioq_deinit(ioq_t *q) {
+    ioq_wait(q);
+    for (uint32_t i = 0; i < q->n_members; i++) {
+        ioq_deinit(&q->members[i]);
+    }
+    free(q->members);
+    q->members = NULL;
+    q->n_members = 0;
+    if (q->ring_fd < 0) return;
+
+    munmap(q->sqes, q->sqes_size);
+    if (q->cq_ring_size) munmap(q->cq_ring, q->cq_ring_size);
+    munmap(q->sq_ring, q->sq_ring_size);
+    close(q->ring_fd);
+    free(q->slots);
+    free(q->free_slots);
+    q->ring_fd = -1;
+}
+
+static void ioq_complete(uint8_t opcode, uint64_t len, uint64_t start, int ok) {
+    int read = opcode == IORING_OP_READ || opcode == IORING_OP_READV;
+    stats_record(read ? STAT_IO_READ: STAT_IO_WRITE, stats_now() - start);
+    if (ok) stats_add(read ? STAT_BYTES_READ: STAT_BYTES_WRITTEN, len);
+}
+
+static void ioq_reap(ioq_t *q) {
+    uint32_t head = *q->cq_head;
+    uint32_t tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &q->cqes[head & *q->cq_mask];
+        ioq_slot_t *slot = &q->slots[cqe->user_data];
+        int ok = cqe->res >= 0 && (uint64_t) cqe->res == slot->len;
+        if (!ok) q->error = -1;
+
+        ioq_complete(slot->opcode, slot->len, slot->start, ok);
+        free(slot->iov);
+        slot->iov = NULL;
+        q->free_slots[q->n_free++] = cqe->user_data;
+        q->inflight--;
+        head++;
+    }
+    __atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+}
+
+static int ioq_enter(ioq_t *q, uint32_t min_complete) {
+    uint32_t flags = min_complete ? IORING_ENTER_GETEVENTS: 0;
+    while (q->queued || min_complete) {
+        int n = io_uring_enter(q->ring_fd, q->queued, min_complete, flags);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        q->queued -= n;
+        q->inflight += n;
+        if (min_complete) break;
+    }
+
+    ioq_reap(q);
+    return 0;
+}
+
+static int ioq_sync(ioq_t *q, uint8_t opcode, void *addr, uint32_t n, uint64_t offset) {
+    switch (opcode) {
+    case IORING_OP_READ: return bdev_read(q->dev, addr, n, offset);
+    case IORING_OP_WRITE: return bdev_write(q->dev, addr, n, offset);
+    case IORING_OP_READV: return bdev_readv(q->dev, (const struct iovec*) addr, n, offset);
+    default: return bdev_writev(q->dev, (const struct iovec*) addr, n, offset);
+    }
+}
+
+/**
+ * Queue a request transferring `len` bytes at byte `offset`. For plain
+ * reads and writes `addr` is the buffer and `n` the length; for vectored
+ * ones `addr` is the iovec array and `n` its length. An iovec array passed
+ * as `owned` is freed once the request has completed.
+ */
+static int ioq_push(ioq_t *q, uint8_t opcode, void *addr, uint32_t n, size_t len, uint64_t offset, struct iovec *owned) {
+    if (q->ring_fd < 0) {
+        uint64_t start = stats_now();
+        int res = ioq_sync(q, opcode, addr, n, offset);
+        if (res < 0) q->error = -1;
+        ioq_complete(opcode, len, start, res == 0);
+        free(owned);
+        return 0;
+    }
+
+    while (q->queued + q->inflight >= q->depth) {
+        if (ioq_enter(q, 1) < 0) {
+            free(owned);
+            return -1;
+        }
+    }
+
+    uint32_t tail = *q->sq_tail;
+    uint32_t index = tail & *q->sq_mask;
+    struct io_uring_sqe *sqe = &q->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = q->dev->fd;
+    sqe->addr = (uint64_t) (uintptr_t) addr;
+    sqe->len = n;
+    sqe->off = offset;
+    uint32_t slot = q->free_slots[--q->n_free];
+    q->slots[slot].len = len;
+    q->slots[slot].start = stats_now();
+    q->slots[slot].opcode = opcode;
+    q->slots[slot].iov = owned;
+    sqe->user_data = slot;
+    q->sq_array[index] = index;
+    __atomic_store_n(q->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    q->queued++;
+
+    return 0;
+}
+
+/**
+ * Queue a request like `ioq_push`, splitting it among the member queues of
+ * a striped device. The parts of a vectored request that do not cover it
+ * whole get iovec arrays of their own.
+ */
+static int ioq_route(ioq_t *q, uint8_t opcode, void *addr, uint32_t n, size_t len, uint64_t offset) {
+    if (q->members == NULL) return ioq_push(q, opcode, addr, n, len, offset, NULL);
+
+    int vectored = opcode == IORING_OP_READV || opcode == IORING_OP_WRITEV;
+    for (size_t done = 0; done < len;) {
+        uint32_t member;
+        uint64_t member_offset;
+        size_t m = bdev_map(q->dev, offset + done, len - done, &member, &member_offset);
+        ioq_t *mq = &q->members[member];
+
+        int res;
+        if (!vectored) {
+            res = ioq_push(mq, opcode, (uint8_t*) addr + done, m, m, member_offset, NULL);
+        } else if (m == len) {
+            res = ioq_push(mq, opcode, addr, n, m, member_offset, NULL);
+        } else {
+            struct iovec *slice = (struct iovec*) malloc(n * sizeof(struct iovec));
+            if (slice == NULL) return -1;
+            int cnt = bdev_iov_slice((const struct iovec*) addr, n, done, m, slice);
+            res = ioq_push(mq, opcode, slice, cnt, m, member_offset, slice);
+        }
+        if (res < 0) return -1;
+        done += m;
+    }
+
+    return 0;
+}
+
+/**
+ * Queue a read of `len` bytes at byte `offset` into `buf`. The buffer must
+ * stay valid until the next `ioq_wait`.
+ *
+ * \param q the I/O queue.
+ * \param buf the destination buffer.
+ * \param len the length in bytes.
+ * \param offset the byte offset.
+ * \return 0 if success else -1
+ */
+int ioq_read(ioq_t *q, void *buf, size_t len, uint64_t offset) {
+    return ioq_route(q, IORING_OP_READ, buf, len, len, offset);
+}
+
+/**
+ * Queue a write of `len` bytes from `buf` at byte `offset`. The buffer must
+ * stay valid until the next `ioq_wait`.
+ *
+ * \param q the I/O queue.
+ * \param buf the source buffer.
+ * \param len the length in bytes.
+ * \param offset the byte offset.
+ * \return 0 if success else -1
+ */
+int ioq_write(ioq_t *q, const void *buf, size_t len, uint64_t offset) {
+    return ioq_route(q, IORING_OP_WRITE, (void*) buf, len, len, offset);
+}
+
+static size_t iov_length(const struct iovec *iov, int iovcnt) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    return len;
+}
+
+/**
+ * Queue a read at byte `offset` scattered into the buffers of `iov`. The
+ * iovec array and the buffers must stay valid until the next `ioq_wait`.
+ *
+ * \param q the I/O queue.
+ * \param iov the destination buffers.
+ * \param iovcnt the number of buffers, at most `IOV_MAX`.
+ * \param offset the byte offset.
+ * \return 0 if success else -1
+ */
+int ioq_readv(ioq_t *q, const struct iovec *iov, int iovcnt, uint64_t offset) {
+    return ioq_route(q, IORING_OP_READV, (void*) iov, iovcnt, iov_length(iov, iovcnt), offset);
+}
+
+/**
+ * Queue a write at byte `offset` gathered from the buffers of `iov`. The
+ * iovec array and the buffers must stay valid until the next `ioq_wait`.
+ *
+ * \param q the I/O queue.
+ * \param iov the source buffers.
+ * \param iovcnt the number of buffers, at most `IOV_MAX`.
+ * \param offset the byte offset.
+ * \return 0 if success else -1
+ */
+int ioq_writev(ioq_t *q, const struct iovec *iov, int iovcnt, uint64_t offset) {
+    return ioq_route(q, IORING_OP_WRITEV, (void*) iov, iovcnt, iov_length(iov, iovcnt), offset);
+}
+
+/**
+ * Submit all queued requests to the device without waiting for them.
+ *
+ * \param q the I/O queue.
+ * \return 0 if success else -1
+ */
+int ioq_submit(ioq_t *q) {
+    for (uint32_t i = 0; i < q->n_members; i++) {
+        if (ioq_submit(&q->members[i]) < 0) return -1;
+    }
+    if (q->ring_fd < 0) return 0;
+    return ioq_enter(q, 0);
+}
+
+/**
+ * Submit all queued requests and wait until every request in flight has
+ * completed.
+ *
+ * \param q the I/O queue.
+ * \return 0 if every request since the last wait succeeded else -1
+ */
+int ioq_wait(ioq_t *q) {
+    int res = 0;
+
+    /* The members work in parallel, so all are submitted before waiting on any. */
+    if (q->n_members && ioq_submit(q) < 0) res = -1;
+    for (uint32_t i = 0; i < q->n_members; i++) {
+        if (ioq_wait(&q->members[i]) < 0) res = -1;
+    }
+
+    if (q->ring_fd >= 0) {
+        while (q->queued || q->inflight) {
+            if (ioq_enter(q, q->queued + q->inflight) < 0) {
+                res = -1;
+                break;
+            }
+        }
+    }
+
+    if (q->error) res = -1;
+    q->error = 0;
+    return res;
+}
+
+/**
+ * Wait for every request in flight and make all completed writes durable.
+ *
+ * \param q the I/O queue.
+ * \return 0 if success else -1
+ */
+int ioq_flush(ioq_t *q) {
+    if (ioq_wait(q) < 0) return -1;
+
+    uint64_t start = stats_now();
+    int res = bdev_flush(q->dev);
+    stats_record(STAT_IO_FLUSH, stats_now() - start);
+    return res;
+}
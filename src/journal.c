@@ -0,0 +1,237 @@
+#define _GNU_SOURCE
+#include "journal.h"
+#include "stats.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The journal is a physical redo log for the metadata page cache. The
+ * pending pages of the cache are committed together as one transaction: a
+ * header page listing their home indices followed by their images, written
+ * to the next free part of the journal region with a single request and a
+ * single flush. Committed pages stay dirty in the cache and are written to
+ * their home location at the next checkpoint, which happens whenever the
+ * region cannot hold another full transaction. The first page of the region
+ * records the sequence number of the first transaction since the last
+ * checkpoint; replay applies transactions from there for as long as their
+ * sequence numbers follow on and their checksums match.
+ */
+
+#define PAGE_SIZE 4096
+
+#define JOURNAL_MAGIC 0x4a524e4c
+
+typedef struct journal_super {
+    uint32_t magic;
+    uint32_t res4;
+    uint64_t sequence;
+    uint8_t res16[4080];
+} __attribute__((aligned(PAGE_SIZE))) journal_super_t;
+
+static_assert(sizeof(journal_super_t) == PAGE_SIZE);
+
+typedef struct journal_header {
+    uint32_t magic;
+    uint32_t n_pages;
+    uint64_t sequence;
+    uint64_t checksum;
+    uint32_t pages[JOURNAL_TX_PAGES];
+} __attribute__((aligned(PAGE_SIZE))) journal_header_t;
+
+static_assert(sizeof(journal_header_t) == PAGE_SIZE);
+
+static uint64_t page_offset(uint32_t index) {
+    return (uint64_t) index * PAGE_SIZE;
+}
+
+static uint64_t checksum_update(uint64_t h, const void *buf, size_t len) {
+    const uint64_t *words = (const uint64_t*) buf;
+    for (size_t i = 0; i < len / sizeof(uint64_t); i++) {
+        h = (h ^ words[i]) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+static uint64_t tx_checksum(journal_header_t *header, const uint8_t *images) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ header->sequence;
+    h = checksum_update(h, header->pages, sizeof(header->pages));
+    h = checksum_update(h, images, (size_t) header->n_pages * PAGE_SIZE);
+    return h ^ header->n_pages;
+}
+
+int journal_init(journal_t *j, ioq_t *ioq, uint32_t start_page, uint32_t n_pages) {
+    memset(j, 0, sizeof(journal_t));
+    if (n_pages < 2 * (JOURNAL_TX_PAGES + 1) + 1) return -1;
+
+    j->ioq = ioq;
+    j->start_page = start_page;
+    j->n_pages = n_pages;
+    j->head = 1;
+    return 0;
+}
+
+/**
+ * Record that every transaction so far has reached its home location, so
+ * that the journal can be reused from the start.
+ */
+static int journal_reset(journal_t *j) {
+    journal_super_t super = {0};
+    super.magic = JOURNAL_MAGIC;
+    super.sequence = j->sequence;
+    if (ioq_write(j->ioq, &super, PAGE_SIZE, page_offset(j->start_page)) < 0) return -1;
+    if (ioq_flush(j->ioq) < 0) return -1;
+
+    j->head = 1;
+    return 0;
+}
+
+/**
+ * Initialize an empty journal on disk.
+ *
+ * \param j the journal.
+ * \return 0 if success else -1
+ */
+int journal_format(journal_t *j) {
+    j->sequence = 1;
+    return journal_reset(j);
+}
+
+/**
+ * Commit every pending page of `cache` as a single transaction and flush
+ * it. A checkpoint follows when the journal could not hold another full
+ * transaction.
+ *
+ * \param j the journal.
+ * \param cache the metadata page cache, with at most `JOURNAL_TX_PAGES`
+ * pending pages.
+ * \return 0 if success else -1
+ */
+int journal_commit(journal_t *j, cache_t *cache) {
+    if (cache->n_pending == 0) return 0;
+    if (cache->n_pending > JOURNAL_TX_PAGES) return -1;
+    assert(j->head + 1 + cache->n_pending <= j->n_pages);
+    uint64_t start = stats_now();
+
+    size_t len = (1 + cache->n_pending) * PAGE_SIZE;
+    uint8_t *buf = aligned_alloc(PAGE_SIZE, len);
+    if (buf == NULL) return -1;
+
+    journal_header_t *header = (journal_header_t*) buf;
+    memset(header, 0, PAGE_SIZE);
+    header->magic = JOURNAL_MAGIC;
+    header->sequence = j->sequence;
+
+    uint8_t *images = buf + PAGE_SIZE;
+    for (size_t i = 0; i < cache->n_frames; i++) {
+        cache_frame_t *frame = &cache->frames[i];
+        if (!frame->pending) continue;
+        header->pages[header->n_pages] = frame->index;
+        memcpy(images + (size_t) header->n_pages * PAGE_SIZE, cache->pages + i * PAGE_SIZE, PAGE_SIZE);
+        header->n_pages++;
+    }
+    header->checksum = tx_checksum(header, images);
+
+    int res = -1;
+    if (ioq_write(j->ioq, buf, len, page_offset(j->start_page + j->head)) < 0) goto done;
+    if (ioq_flush(j->ioq) < 0) goto done;
+
+    for (size_t i = 0; i < cache->n_frames; i++) {
+        cache->frames[i].pending = 0;
+    }
+    cache->n_pending = 0;
+    j->head += 1 + header->n_pages;
+    j->sequence++;
+    res = 0;
+    stats_record(STAT_COMMIT, stats_now() - start);
+    stats_record(STAT_COMMIT_PAGES, header->n_pages);
+
+    if (j->n_pages - j->head < 1 + JOURNAL_TX_PAGES) {
+        res = journal_checkpoint(j, cache);
+    }
+
+done:
+    free(buf);
+    return res;
+}
+
+/**
+ * Write every committed page of `cache` to its home location and empty the
+ * journal. Pending pages must have been committed first.
+ *
+ * \param j the journal.
+ * \param cache the metadata page cache.
+ * \return 0 if success else -1
+ */
+int journal_checkpoint(journal_t *j, cache_t *cache) {
+    if (cache->n_pending) return -1;
+    if (j->head == 1) return 0;
+
+    uint64_t start = stats_now();
+    if (cache_writeback(cache, j->ioq) < 0) return -1;
+    if (ioq_flush(j->ioq) < 0) return -1;
+    if (journal_reset(j) < 0) return -1;
+
+    stats_record(STAT_CHECKPOINT, stats_now() - start);
+    return 0;
+}
+
+/**
+ * Write every transaction committed since the last checkpoint to its home
+ * location and empty the journal. Transactions are applied in order until
+ * one is missing, out of sequence or fails its checksum.
+ *
+ * \param j the journal.
+ * \return 0 if success else -1
+ */
+int journal_replay(journal_t *j) {
+    journal_super_t super;
+    if (ioq_read(j->ioq, &super, PAGE_SIZE, page_offset(j->start_page)) < 0) return -1;
+    if (ioq_wait(j->ioq) < 0) return -1;
+    if (super.magic != JOURNAL_MAGIC) return -1;
+
+    j->sequence = super.sequence;
+    j->head = 1;
+
+    size_t len = (1 + JOURNAL_TX_PAGES) * PAGE_SIZE;
+    uint8_t *buf = aligned_alloc(PAGE_SIZE, len);
+    if (buf == NULL) return -1;
+
+    journal_header_t *header = (journal_header_t*) buf;
+    while (j->head + 1 < j->n_pages) {
+        if (ioq_read(j->ioq, header, PAGE_SIZE, page_offset(j->start_page + j->head)) < 0) goto error;
+        if (ioq_wait(j->ioq) < 0) goto error;
+        if (header->magic != JOURNAL_MAGIC || header->sequence != j->sequence) break;
+        if (header->n_pages == 0 || header->n_pages > JOURNAL_TX_PAGES) break;
+        if (j->head + 1 + header->n_pages > j->n_pages) break;
+
+        uint8_t *images = buf + PAGE_SIZE;
+        uint64_t offset = page_offset(j->start_page + j->head + 1);
+        if (ioq_read(j->ioq, images, (size_t) header->n_pages * PAGE_SIZE, offset) < 0) goto error;
+        if (ioq_wait(j->ioq) < 0) goto error;
+        if (header->checksum != tx_checksum(header, images)) break;
+
+        /* A transaction holds each page once, so its writes may complete in any order. */
+        for (size_t i = 0; i < header->n_pages; i++) {
+            if (ioq_write(j->ioq, images + i * PAGE_SIZE, PAGE_SIZE, page_offset(header->pages[i])) < 0) {
+                goto error;
+            }
+        }
+        if (ioq_wait(j->ioq) < 0) goto error;
+
+        j->head += 1 + header->n_pages;
+        j->sequence++;
+    }
+
+    free(buf);
+    if (j->head == 1) return 0;
+    if (ioq_flush(j->ioq) < 0) return -1;
+    return journal_reset(j);
+
+error:
+    ioq_wait(j->ioq);
+    free(buf);
+    return -1;
+}
@@ -0,0 +1,186 @@
+#define _GNU_SOURCE
+#include "rpc.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+ * A blobstore daemon serves requests over a Unix stream socket. Every
+ * request is an `rpc_request_t` header followed by `len` bytes of payload,
+ * which only writes carry, and is answered by an `rpc_response_t` header
+ * followed by `len` bytes of payload. A client may send any number of
+ * requests before reading the responses: they are executed and answered in
+ * order, and each response carries the tag of its request. The status of a
+ * response is 0 on success and an errno value otherwise.
+ *
+ * Both ends run on the same host, so the headers are in native byte order.
+ */
+
+void rpc_buf_init(rpc_buf_t *buf) {
+    memset(buf, 0, sizeof(rpc_buf_t));
+}
+
+void rpc_buf_deinit(rpc_buf_t *buf) {
+    free(buf->data);
+    memset(buf, 0, sizeof(rpc_buf_t));
+}
+
+/**
+ * Extend `buf` by `len` uninitialized bytes.
+ *
+ * \param buf the buffer.
+ * \param len the number of bytes.
+ * \return the first of the new bytes if success else NULL
+ */
+void *rpc_buf_extend(rpc_buf_t *buf, size_t len) {
+    if (buf->len + len > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity: 4096;
+        while (capacity < buf->len + len) capacity *= 2;
+
+        uint8_t *data = (uint8_t*) realloc(buf->data, capacity);
+        if (data == NULL) return NULL;
+
+        buf->data = data;
+        buf->capacity = capacity;
+    }
+
+    void *res = buf->data + buf->len;
+    buf->len += len;
+    return res;
+}
+
+int rpc_buf_append(rpc_buf_t *buf, const void *data, size_t len) {
+    void *dst = rpc_buf_extend(buf, len);
+    if (dst == NULL) return -1;
+
+    memcpy(dst, data, len);
+    return 0;
+}
+
+/**
+ * Drop the bytes of `buf` before its position.
+ *
+ * \param buf the buffer.
+ */
+void rpc_buf_compact(rpc_buf_t *buf) {
+    memmove(buf->data, buf->data + buf->pos, buf->len - buf->pos);
+    buf->len -= buf->pos;
+    buf->pos = 0;
+}
+
+/**
+ * Connect to the blobstore daemon listening at `path`.
+ *
+ * \param path the path of the socket.
+ * \return the connected socket if success else -1
+ */
+int rpc_connect(const char *path) {
+    struct sockaddr_un addr = {0};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+
+    return fd;
+}
+
+static int rpc_write_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        struct msghdr msg = {0};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+
+        while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t*) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+static int rpc_read_all(int fd, void *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) {
+            errno = ECONNRESET;
+            return -1;
+        }
+
+        buf = (uint8_t*) buf + n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * Send the request `req` with `req->len` bytes of `payload` to the daemon
+ * connected to `fd`, without waiting for the response.
+ *
+ * \param fd the connected socket.
+ * \param req the request.
+ * \param payload the payload, or NULL if there is none.
+ * \return 0 if success else -1
+ */
+int rpc_send(int fd, const rpc_request_t *req, const void *payload) {
+    struct iovec iov[2] = {
+        {(void*) req, sizeof(rpc_request_t)},
+        {(void*) payload, req->len},
+    };
+    return rpc_write_all(fd, iov, req->len ? 2: 1);
+}
+
+/**
+ * Receive the next response from the daemon connected to `fd`. The payload,
+ * if any, is returned in a buffer that the caller must free.
+ *
+ * \param fd the connected socket.
+ * \param resp the response.
+ * \param payload the payload, or NULL if there is none.
+ * \return 0 if success else -1
+ */
+int rpc_recv(int fd, rpc_response_t *resp, void **payload) {
+    *payload = NULL;
+    if (rpc_read_all(fd, resp, sizeof(rpc_response_t)) < 0) return -1;
+    if (resp->len == 0) return 0;
+
+    *payload = malloc(resp->len);
+    if (*payload == NULL) return -1;
+
+    if (rpc_read_all(fd, *payload, resp->len) < 0) {
+        free(*payload);
+        *payload = NULL;
+        return -1;
+    }
+
+    return 0;
+}
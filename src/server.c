@@ -0,0 +1,582 @@
+#define _GNU_SOURCE
+#include "server.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define PAGE_SIZE 4096
+
+/*
+ * The server keeps a blobstore open and executes requests against it on
+ * behalf of its clients. It runs a single thread that polls the listening
+ * socket and all connections, executes every complete request it has read
+ * in order, commits once for all requests of a round that changed the
+ * blobstore, and only then sends their responses, so a client that has
+ * seen a response knows the request is durable. Defragmentations run in
+ * the same loop, a step at a time, so they never stall clients for long.
+ */
+
+/**
+ * Initialize `srv` to execute requests against `bs`, without listening
+ * for clients yet.
+ *
+ * \param srv the server.
+ * \param bs the blobstore.
+ * \return 0 if success else -1
+ */
+int server_init(server_t *srv, blobstore_t *bs) {
+    memset(srv, 0, sizeof(server_t));
+    srv->bs = bs;
+    srv->fd = -1;
+
+    srv->io_buf = aligned_alloc(PAGE_SIZE, RPC_MAX_IO);
+    if (srv->io_buf == NULL) return -1;
+
+    if (channel_init(&srv->channel, bs) < 0) {
+        free(srv->io_buf);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Stop all defragmentations in progress, releasing their target clusters.
+ */
+static void server_defrag_cancel(server_t *srv) {
+    for (size_t i = 0; i < srv->n_defrags; i++) {
+        blob_defrag_end(srv->bs, &srv->defrags[i].defrag);
+    }
+    srv->n_defrags = 0;
+}
+
+static void server_close(server_t *srv, conn_t *conn) {
+    close(conn->fd);
+    conn->fd = -1;
+    rpc_buf_deinit(&conn->in);
+    rpc_buf_deinit(&conn->out);
+}
+
+/**
+ * Release all resources associated with `srv`, closing every connection
+ * and removing its socket.
+ *
+ * \param srv the server.
+ */
+void server_deinit(server_t *srv) {
+    for (size_t i = 0; i < srv->n_conns; i++) {
+        server_close(srv, &srv->conns[i]);
+    }
+    srv->n_conns = 0;
+
+    if (srv->fd >= 0) {
+        close(srv->fd);
+        unlink(srv->path);
+    }
+
+    server_defrag_cancel(srv);
+    channel_deinit(&srv->channel);
+    free(srv->io_buf);
+}
+
+static void server_store_info(server_t *srv, rpc_store_info_t *info) {
+    blobstore_t *bs = srv->bs;
+    memset(info, 0, sizeof(rpc_store_info_t));
+    info->page_shift = bs->page_shift;
+    info->cluster_shift = bs->cluster_shift;
+    info->md_shift = bs->md_shift;
+    info->n_clusters = bitset_capacity(&bs->clusters);
+    info->n_free = bitset_capacity(&bs->clusters) - bitset_size(&bs->clusters);
+    for (size_t i = 0; i < srv->channel.n_pool; i++) {
+        info->n_free += srv->channel.pool[i].len;
+    }
+    info->md_used = bitset_size(&bs->md_pages);
+    info->md_capacity = bitset_capacity(&bs->md_pages);
+    info->map_bytes = bs->map_bytes;
+    for (blob_t *curr = bs->head; curr; curr = curr->next) {
+        info->n_blobs++;
+        info->n_allocated += curr->n_allocated;
+    }
+}
+
+static void server_blob_info(blob_t *blob, rpc_blob_info_t *info) {
+    memset(info, 0, sizeof(rpc_blob_info_t));
+    memcpy(info->uuid, blob->uuid, 16);
+    info->page_index = blob->page_index;
+    info->n_clusters = blob->n_clusters;
+    info->n_allocated = blob->n_allocated;
+    info->flags = blob->flags;
+    if (blob->loaded) {
+        info->n_extents = extent_map_size(&blob->clusters);
+        info->n_cluster_pages = array_size(&blob->cluster_page_indices);
+    }
+}
+
+/*
+ * Check that the byte range of an I/O request lies within `blob` and is
+ * aligned to the page size.
+ */
+static int server_check_io(server_t *srv, blob_t *blob, uint64_t offset, uint64_t len) {
+    uint64_t blob_size = (uint64_t) blob->n_clusters << srv->bs->page_shift << srv->bs->cluster_shift;
+    if (len == 0 || len > RPC_MAX_IO || (offset | len) % PAGE_SIZE) return -1;
+    if (offset > blob_size || len > blob_size - offset) return -1;
+    return 0;
+}
+
+/**
+ * Execute the request `req` with its `payload` and append the response to
+ * `out`. The result of the request is reported in the status of the
+ * response. Requests that change the blobstore become durable with the
+ * next `server_sync`.
+ *
+ * \param srv the server.
+ * \param req the request.
+ * \param payload the `req->len` bytes of payload of the request.
+ * \param out the buffer receiving the response.
+ * \return 0 if success else -1
+ */
+int server_execute(server_t *srv, const rpc_request_t *req, const void *payload, rpc_buf_t *out) {
+    blobstore_t *bs = srv->bs;
+    size_t at = out->len;
+    rpc_response_t resp = {0};
+    resp.tag = req->tag;
+    if (rpc_buf_extend(out, sizeof(rpc_response_t)) == NULL) return -1;
+
+    blob_t *blob = NULL;
+    if (req->op != RPC_OP_CREATE && req->op != RPC_OP_LIST && req->op != RPC_OP_STATS &&
+        req->op != RPC_OP_CHECK && req->op != RPC_OP_FRAG) {
+        blob = blobstore_lookup(bs, req->uuid);
+        if (blob == NULL) {
+            resp.status = ENOENT;
+            goto done;
+        }
+        memcpy(resp.uuid, blob->uuid, 16);
+    }
+
+    int res = 0;
+    errno = 0;
+    switch (req->op) {
+    case RPC_OP_CREATE:
+        if (req->arg0 == 0 || req->arg0 > UINT32_MAX) {
+            resp.status = EINVAL;
+            break;
+        }
+        res = blobstore_create_blob(bs, req->arg0);
+        if (res == 0) memcpy(resp.uuid, bs->head->uuid, 16);
+        srv->dirty = 1;
+        break;
+    case RPC_OP_DELETE:
+        res = blobstore_delete_blob(bs, blob);
+        srv->dirty = 1;
+        break;
+    case RPC_OP_RESIZE:
+        if (req->arg0 == 0 || req->arg0 > UINT32_MAX) {
+            resp.status = EINVAL;
+        } else if (blob->flags & BLOB_READ_ONLY) {
+            resp.status = EROFS;
+        } else {
+            res = blob_resize(bs, blob, req->arg0);
+            srv->dirty = 1;
+        }
+        break;
+    case RPC_OP_CLONE:
+    case RPC_OP_SNAPSHOT:
+        res = req->op == RPC_OP_CLONE ? blob_clone(bs, blob): blob_snapshot(bs, blob);
+        if (res == 0) memcpy(resp.uuid, bs->head->uuid, 16);
+        srv->dirty = 1;
+        break;
+    case RPC_OP_INFO: {
+        res = blob_load(bs, blob);
+        if (res < 0) break;
+
+        rpc_blob_info_t info;
+        server_blob_info(blob, &info);
+        if (rpc_buf_append(out, &info, sizeof(info)) < 0) return -1;
+        break;
+    }
+    case RPC_OP_LIST: {
+        rpc_store_info_t info;
+        server_store_info(srv, &info);
+        if (rpc_buf_append(out, &info, sizeof(info)) < 0) return -1;
+
+        for (blob_t *curr = bs->head; curr; curr = curr->next) {
+            rpc_blob_info_t blob_info;
+            server_blob_info(curr, &blob_info);
+            if (rpc_buf_append(out, &blob_info, sizeof(blob_info)) < 0) return -1;
+        }
+        break;
+    }
+    case RPC_OP_STATS: {
+        rpc_store_info_t info;
+        server_store_info(srv, &info);
+        if (rpc_buf_append(out, &info, sizeof(info)) < 0) return -1;
+
+        stats_t *stats = rpc_buf_extend(out, sizeof(stats_t));
+        if (stats == NULL) return -1;
+        stats_collect(stats);
+        stats->next = NULL;
+        break;
+    }
+    case RPC_OP_READ:
+        if (server_check_io(srv, blob, req->arg0, req->arg1) < 0) {
+            resp.status = EINVAL;
+            break;
+        }
+
+        res = channel_read(&srv->channel, blob, srv->io_buf, req->arg0, req->arg1);
+        if (res == 0 && rpc_buf_append(out, srv->io_buf, req->arg1) < 0) return -1;
+        break;
+    case RPC_OP_WRITE:
+        if (server_check_io(srv, blob, req->arg0, req->len) < 0) {
+            resp.status = EINVAL;
+            break;
+        }
+        if (blob->flags & BLOB_READ_ONLY) {
+            resp.status = EROFS;
+            break;
+        }
+
+        memcpy(srv->io_buf, payload, req->len);
+        res = channel_write(&srv->channel, blob, srv->io_buf, req->arg0, req->len);
+        srv->dirty = 1;
+        break;
+    case RPC_OP_CHECK: {
+        /* The pool of the server's channel must not survive a repair. */
+        blobstore_check_t *report = rpc_buf_extend(out, sizeof(blobstore_check_t));
+        if (report == NULL) return -1;
+
+        server_defrag_cancel(srv);
+        channel_deinit(&srv->channel);
+        res = blobstore_check(bs, req->arg0, req->arg1 != 0, report);
+        if (channel_init(&srv->channel, bs) < 0) return -1;
+        break;
+    }
+    case RPC_OP_FRAG: {
+        blobstore_frag_t *frag = rpc_buf_extend(out, sizeof(blobstore_frag_t));
+        if (frag == NULL) return -1;
+        blobstore_frag(bs, frag);
+
+        for (blob_t *curr = bs->head; curr; curr = curr->next) {
+            rpc_blob_frag_t info = {0};
+            memcpy(info.uuid, curr->uuid, 16);
+            pthread_rwlock_rdlock(&curr->lock);
+            res = blob_load(bs, curr);
+            if (res == 0) {
+                info.n_allocated = curr->n_allocated;
+                info.n_extents = extent_map_size(&curr->clusters);
+                info.n_runs = blob_runs(curr);
+            }
+            pthread_rwlock_unlock(&curr->lock);
+            if (res < 0) break;
+            if (rpc_buf_append(out, &info, sizeof(info)) < 0) return -1;
+        }
+        break;
+    }
+    case RPC_OP_DEFRAG: {
+        if (blob->flags & BLOB_READ_ONLY) {
+            resp.status = EROFS;
+            break;
+        }
+        for (size_t i = 0; i < srv->n_defrags; i++) {
+            if (memcmp(srv->defrags[i].defrag.uuid, blob->uuid, 16) == 0) resp.status = EBUSY;
+        }
+        if (srv->n_defrags == SERVER_MAX_DEFRAGS) resp.status = EAGAIN;
+        if (resp.status) break;
+
+        /* The job runs from `server_defrag`; the response holds the number of clusters to move. */
+        defrag_job_t *job = &srv->defrags[srv->n_defrags];
+        res = blob_defrag_begin(bs, blob, &job->defrag);
+        if (res < 0) break;
+
+        uint64_t n_clusters = 0;
+        for (size_t i = 0; i < job->defrag.n_target; i++) {
+            n_clusters += job->defrag.target[i].len;
+        }
+        if (res == 1) {
+            job->rate = req->arg0;
+            job->due = 0;
+            srv->n_defrags++;
+        }
+        res = 0;
+        if (rpc_buf_append(out, &n_clusters, sizeof(n_clusters)) < 0) return -1;
+        break;
+    }
+    case RPC_OP_MAP: {
+        if (req->arg0 > UINT32_MAX) {
+            resp.status = EINVAL;
+            break;
+        }
+
+        pthread_rwlock_rdlock(&blob->lock);
+        res = blob_load(bs, blob);
+        if (res < 0) {
+            pthread_rwlock_unlock(&blob->lock);
+            break;
+        }
+
+        rpc_blob_map_t map;
+        map.cluster_size = 1ULL << bs->page_shift << bs->cluster_shift;
+        map.n_clusters = blob->n_clusters;
+        int failed = rpc_buf_append(out, &map, sizeof(map)) < 0;
+
+        /* Extents that are only split physically are merged. */
+        size_t max = (RPC_MAX_IO - sizeof(map)) / sizeof(rpc_extent_t);
+        size_t n = 0;
+        rpc_extent_t ext = {0, 0};
+        extent_map_t *clusters = &blob->clusters;
+        for (size_t i = extent_map_find(clusters, req->arg0); i < extent_map_size(clusters) && n < max && !failed; i++) {
+            map_extent_t *curr = extent_map_get_ref(clusters, i);
+            uint32_t start = curr->lcluster > req->arg0 ? curr->lcluster: req->arg0;
+            uint32_t len = curr->lcluster + curr->len - start;
+            if (ext.len && ext.lcluster + ext.len == start) {
+                ext.len += len;
+                continue;
+            }
+            if (ext.len) {
+                failed = rpc_buf_append(out, &ext, sizeof(ext)) < 0;
+                n++;
+            }
+            ext.lcluster = start;
+            ext.len = len;
+        }
+        if (ext.len && n < max && !failed) failed = rpc_buf_append(out, &ext, sizeof(ext)) < 0;
+        pthread_rwlock_unlock(&blob->lock);
+
+        if (failed) return -1;
+        break;
+    }
+    default:
+        resp.status = EINVAL;
+        break;
+    }
+    if (res < 0) {
+        resp.status = errno ? errno: EIO;
+        out->len = at + sizeof(rpc_response_t);
+    }
+
+done:
+    resp.len = out->len - at - sizeof(rpc_response_t);
+    memcpy(out->data + at, &resp, sizeof(rpc_response_t));
+    return 0;
+}
+
+/**
+ * Make all requests executed so far durable.
+ *
+ * \param srv the server.
+ * \return 0 if success else -1
+ */
+int server_sync(server_t *srv) {
+    if (!srv->dirty) return 0;
+
+    srv->dirty = 0;
+    return blobstore_commit(srv->bs);
+}
+
+/**
+ * Advance every defragmentation that is due by one step. A job whose rate
+ * is limited is next due once the clusters it has moved would have taken
+ * that long to copy at its rate. Jobs end once their blob has been moved,
+ * or has been deleted, or when a step fails.
+ *
+ * \param srv the server.
+ * \return the number of milliseconds until the next job is due, or -1 if
+ * there are no jobs left.
+ */
+int server_defrag(server_t *srv) {
+    blobstore_t *bs = srv->bs;
+    uint64_t cluster_size = 1ULL << bs->page_shift << bs->cluster_shift;
+    uint64_t now = stats_now();
+    int timeout = -1;
+
+    size_t j = 0;
+    for (size_t i = 0; i < srv->n_defrags; i++) {
+        defrag_job_t *job = &srv->defrags[i];
+        if (job->due <= now) {
+            /* A limited job moves about a tenth of a second's worth at a time. */
+            size_t max = job->rate ? job->rate / 10 / cluster_size: BLOB_DEFRAG_STEP;
+            blob_t *blob = blobstore_lookup(bs, job->defrag.uuid);
+            int n = blob ? blob_defrag_step(&srv->channel, blob, &job->defrag, max ? max: 1): 0;
+            if (n <= 0) {
+                blob_defrag_end(bs, &job->defrag);
+                continue;
+            }
+
+            srv->dirty = 1;
+            if (job->rate) job->due = now + n * cluster_size * 1000000000ULL / job->rate;
+        }
+
+        uint64_t wait = job->due > now ? (job->due - now + 999999) / 1000000: 0;
+        if (timeout < 0 || wait < (uint64_t) timeout) timeout = wait;
+        srv->defrags[j++] = *job;
+    }
+    srv->n_defrags = j;
+
+    return timeout;
+}
+
+/**
+ * Listen for clients on a Unix socket at `path`. A socket left behind by a
+ * daemon that is no longer running is replaced.
+ *
+ * \param srv the server.
+ * \param path the path of the socket.
+ * \return 0 if success else -1
+ */
+int server_listen(server_t *srv, const char *path) {
+    struct sockaddr_un addr = {0};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    int fd = rpc_connect(path);
+    if (fd >= 0) {
+        close(fd);
+        errno = EADDRINUSE;
+        return -1;
+    }
+    if (errno == ECONNREFUSED) unlink(path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) < 0) goto error;
+    if (listen(fd, SOMAXCONN) < 0) {
+        unlink(path);
+        goto error;
+    }
+
+    srv->fd = fd;
+    strcpy(srv->path, path);
+    return 0;
+
+error:
+    close(fd);
+    return -1;
+}
+
+static void server_accept(server_t *srv) {
+    for (;;) {
+        int fd = accept4(srv->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return;
+
+        if (srv->n_conns == SERVER_MAX_CONNS) {
+            close(fd);
+            continue;
+        }
+
+        conn_t *conn = &srv->conns[srv->n_conns++];
+        conn->fd = fd;
+        conn->eof = 0;
+        rpc_buf_init(&conn->in);
+        rpc_buf_init(&conn->out);
+    }
+}
+
+/*
+ * Read what is available on `conn` and execute every complete request.
+ * Returns -1 if the connection has failed or sent a malformed request.
+ */
+static int server_read(server_t *srv, conn_t *conn) {
+    rpc_buf_t *in = &conn->in;
+    if (rpc_buf_extend(in, SERVER_READ_SIZE) == NULL) return -1;
+    in->len -= SERVER_READ_SIZE;
+
+    ssize_t n = recv(conn->fd, in->data + in->len, SERVER_READ_SIZE, 0);
+    if (n < 0) return errno == EAGAIN || errno == EINTR ? 0: -1;
+    if (n == 0) conn->eof = 1;
+    in->len += n;
+
+    while (in->len - in->pos >= sizeof(rpc_request_t)) {
+        rpc_request_t req;
+        memcpy(&req, in->data + in->pos, sizeof(rpc_request_t));
+        if (req.magic != RPC_MAGIC || req.len > RPC_MAX_IO) return -1;
+        if (in->len - in->pos - sizeof(rpc_request_t) < req.len) break;
+
+        const void *payload = in->data + in->pos + sizeof(rpc_request_t);
+        if (server_execute(srv, &req, payload, &conn->out) < 0) return -1;
+        in->pos += sizeof(rpc_request_t) + req.len;
+    }
+    rpc_buf_compact(in);
+
+    return 0;
+}
+
+/*
+ * Send as much of the pending responses of `conn` as the socket takes.
+ * Returns -1 if the connection has failed.
+ */
+static int server_write(conn_t *conn) {
+    rpc_buf_t *out = &conn->out;
+    while (out->pos < out->len) {
+        ssize_t n = send(conn->fd, out->data + out->pos, out->len - out->pos, MSG_NOSIGNAL);
+        if (n < 0) return errno == EAGAIN || errno == EINTR ? 0: -1;
+        out->pos += n;
+    }
+
+    out->pos = 0;
+    out->len = 0;
+    return 0;
+}
+
+/**
+ * Serve clients until `*stop` is set, advancing defragmentations in
+ * between requests. Setting `*stop` from a signal handler interrupts a
+ * server waiting for clients.
+ *
+ * \param srv the server, listening for clients.
+ * \param stop the flag stopping the server.
+ * \return 0 if success else -1
+ */
+int server_run(server_t *srv, volatile sig_atomic_t *stop) {
+    struct pollfd fds[1 + SERVER_MAX_CONNS];
+    while (!*stop) {
+        int timeout = server_defrag(srv);
+        size_t n_conns = srv->n_conns;
+        fds[0].fd = srv->fd;
+        fds[0].events = POLLIN;
+        for (size_t i = 0; i < n_conns; i++) {
+            conn_t *conn = &srv->conns[i];
+            fds[1 + i].fd = conn->fd;
+            fds[1 + i].events = 0;
+            if (!conn->eof && conn->out.len - conn->out.pos < SERVER_MAX_BACKLOG) fds[1 + i].events |= POLLIN;
+            if (conn->out.pos < conn->out.len) fds[1 + i].events |= POLLOUT;
+        }
+
+        if (poll(fds, 1 + n_conns, timeout) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+
+        if (fds[0].revents & POLLIN) server_accept(srv);
+
+        for (size_t i = 0; i < n_conns; i++) {
+            conn_t *conn = &srv->conns[i];
+            if (fds[1 + i].revents & (POLLIN | POLLHUP | POLLERR) && !conn->eof) {
+                if (server_read(srv, conn) < 0) server_close(srv, conn);
+            }
+        }
+
+        /* Responses are only sent once their requests are durable. */
+        if (server_sync(srv) < 0) return -1;
+
+        size_t j = 0;
+        for (size_t i = 0; i < srv->n_conns; i++) {
+            conn_t *conn = &srv->conns[i];
+            if (conn->fd >= 0 && server_write(conn) < 0) server_close(srv, conn);
+            if (conn->fd >= 0 && conn->eof && conn->out.pos == conn->out.len) server_close(srv, conn);
+            if (conn->fd >= 0) srv->conns[j++] = *conn;
+        }
+        srv->n_conns = j;
+    }
+
+    return 0;
+}
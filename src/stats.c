@@ -0,0 +1,188 @@
+#define _GNU_SOURCE
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Every thread updates its own counters and histograms without
+ * synchronization. The per-thread blocks are linked into a global list
+ * when a thread first records something, and `stats_collect` sums them.
+ *
+ * Histograms are log-bucketed: values below 2^HISTOGRAM_SUB_BITS get a
+ * bucket each, and every larger power-of-two range is split into
+ * 2^HISTOGRAM_SUB_BITS equal buckets, which bounds the relative error of a
+ * percentile to about 3%.
+ */
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static stats_t *stats_head = NULL;
+
+static _Thread_local stats_t *stats_local = NULL;
+
+static const char *counter_names[STAT_COUNTER_COUNT] = {
+    "bytes_read",
+    "bytes_written",
+    "cache_hits",
+    "cache_misses",
+    "map_evictions",
+    "bytes_discarded",
+};
+
+static const char *hist_names[STAT_HIST_COUNT] = {
+    "io_read",
+    "io_write",
+    "io_flush",
+    "open",
+    "create",
+    "delete",
+    "commit",
+    "checkpoint",
+    "map_load",
+    "blob_read",
+    "blob_write",
+    "commit_pages",
+    "alloc_scan_words",
+    "alloc_scan_runs",
+};
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static stats_t *stats_get(void) {
+    if (stats_local) return stats_local;
+
+    stats_t *stats = (stats_t*) calloc(1, sizeof(stats_t));
+    if (stats == NULL) return NULL;
+
+    pthread_mutex_lock(&stats_lock);
+    stats->next = stats_head;
+    stats_head = stats;
+    pthread_mutex_unlock(&stats_lock);
+
+    stats_local = stats;
+    return stats;
+}
+
+static size_t histogram_bucket(uint64_t value) {
+    if (value < (1 << HISTOGRAM_SUB_BITS)) return value;
+
+    size_t msb = 63 - __builtin_clzll(value);
+    size_t sub = (value >> (msb - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    return ((msb - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) + sub;
+}
+
+static uint64_t histogram_value(size_t bucket) {
+    if (bucket < (1 << HISTOGRAM_SUB_BITS)) return bucket;
+
+    size_t msb = (bucket >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+    uint64_t sub = bucket & ((1 << HISTOGRAM_SUB_BITS) - 1);
+    uint64_t width = 1ULL << (msb - HISTOGRAM_SUB_BITS);
+    return (((1ULL << HISTOGRAM_SUB_BITS) + sub) << (msb - HISTOGRAM_SUB_BITS)) + width / 2;
+}
+
+/**
+ * Add `n` to a counter of the calling thread.
+ *
+ * \param counter the counter.
+ * \param n the increment.
+ */
+void stats_add(stat_counter_t counter, uint64_t n) {
+    stats_t *stats = stats_get();
+    if (stats) stats->counters[counter] += n;
+}
+
+/**
+ * Record `value` in a histogram of the calling thread. Latencies are
+ * recorded in nanoseconds.
+ *
+ * \param hist the histogram.
+ * \param value the value.
+ */
+void stats_record(stat_hist_t hist, uint64_t value) {
+    stats_t *stats = stats_get();
+    if (stats == NULL) return;
+
+    histogram_t *h = &stats->hists[hist];
+    h->count++;
+    h->sum += value;
+    if (value > h->max) h->max = value;
+    h->buckets[histogram_bucket(value)]++;
+}
+
+/**
+ * Sum the counters and histograms of every thread into `res`.
+ *
+ * \param res the result.
+ */
+void stats_collect(stats_t *res) {
+    memset(res, 0, sizeof(stats_t));
+
+    pthread_mutex_lock(&stats_lock);
+    for (stats_t *iter = stats_head; iter; iter = iter->next) {
+        for (size_t i = 0; i < STAT_COUNTER_COUNT; i++) {
+            res->counters[i] += iter->counters[i];
+        }
+
+        for (size_t i = 0; i < STAT_HIST_COUNT; i++) {
+            histogram_t *h = &res->hists[i];
+            histogram_t *src = &iter->hists[i];
+            h->count += src->count;
+            h->sum += src->sum;
+            if (src->max > h->max) h->max = src->max;
+            for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+                h->buckets[b] += src->buckets[b];
+            }
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+const char *stats_counter_name(stat_counter_t counter) {
+    return counter_names[counter];
+}
+
+const char *stats_hist_name(stat_hist_t hist) {
+    return hist_names[hist];
+}
+
+const char *stats_hist_unit(stat_hist_t hist) {
+    switch (hist) {
+    case STAT_COMMIT_PAGES: return "pages";
+    case STAT_ALLOC_SCAN_WORDS: return "words";
+    case STAT_ALLOC_SCAN_RUNS: return "runs";
+    default: return "ns";
+    }
+}
+
+/**
+ * Estimate the value below which a fraction `p` of the recorded values
+ * fall.
+ *
+ * \param hist the histogram.
+ * \param p the fraction, between 0 and 1.
+ * \return the value, or 0 if the histogram is empty.
+ */
+uint64_t histogram_percentile(histogram_t *hist, double p) {
+    if (hist->count == 0) return 0;
+
+    uint64_t rank = (uint64_t) (p * hist->count);
+    if (rank >= hist->count) rank = hist->count - 1;
+
+    uint64_t seen = 0;
+    for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        seen += hist->buckets[b];
+        if (seen > rank) {
+            uint64_t value = histogram_value(b);
+            return value < hist->max ? value: hist->max;
+        }
+    }
+
+    return hist->max;
+}
@@ -4,6 +4,7 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -25,6 +26,35 @@ int parse_u64(const char *str, uint64_t *res) {
     return 0;
 }
 
+/**
+ * Parse a size in bytes with an optional K, M, G or T binary suffix.
+ *
+ * \param str the string.
+ * \param res the parsed size.
+ * \return 0 if success else -1
+ */
+int parse_size(const char *str, uint64_t *res) {
+    errno = 0;
+    char* end = (char *) str;
+    *res = strtoull(str, &end, 10);
+    if (errno == ERANGE || end == str) return -1;
+
+    int shift = 0;
+    switch (*end) {
+    case 'K': case 'k': shift = 10; break;
+    case 'M': case 'm': shift = 20; break;
+    case 'G': case 'g': shift = 30; break;
+    case 'T': case 't': shift = 40; break;
+    case 0: break;
+    default: return -1;
+    }
+    if (shift && end[1]) return -1;
+    if (*res > (UINT64_MAX >> shift)) return -1;
+
+    *res <<= shift;
+    return 0;
+}
+
 int uuid_init_random(uint8_t uuid[16]) {
     int fd = open("/dev/random", O_RDONLY);
     int n_read = read(fd, uuid, 16);
@@ -32,6 +62,26 @@ int uuid_init_random(uint8_t uuid[16]) {
     return n_read - 16;
 }
 
+int uuid_parse(const char *str, uint8_t uuid[16]) {
+    size_t n = 0;
+    for (const char *c = str; *c; c++) {
+        if (*c == '-') continue;
+
+        int v;
+        if (*c >= '0' && *c <= '9') v = *c - '0';
+        else if (*c >= 'a' && *c <= 'f') v = *c - 'a' + 10;
+        else if (*c >= 'A' && *c <= 'F') v = *c - 'A' + 10;
+        else return -1;
+
+        if (n == 32) return -1;
+        if (n % 2 == 0) uuid[n / 2] = v << 4;
+        else uuid[n / 2] |= v;
+        n++;
+    }
+
+    return n == 32 ? 0: -1;
+}
+
 void uuid_print(uint8_t uuid[16]) {
     printf("%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x", 
         uuid[0], uuid[1], uuid[2], uuid[3], 
@@ -40,3 +90,33 @@ void uuid_print(uint8_t uuid[16]) {
         uuid[12], uuid[13], uuid[14], uuid[15]
     );
 }
+
+/**
+ * Check whether the `len` bytes at `buf` are all zero. The bytes are OR-ed
+ * together 64 at a time without branching inside a block, which compiles
+ * to vector instructions, and the check stops at the first nonzero block.
+ *
+ * \param buf the buffer.
+ * \param len the length in bytes.
+ * \return 1 if the buffer is all zero else 0
+ */
+int buf_is_zero(const void *buf, size_t len) {
+    const uint8_t *bytes = buf;
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        uint64_t words[8];
+        memcpy(words, bytes + i, 64);
+
+        uint64_t acc = 0;
+        for (int j = 0; j < 8; j++) {
+            acc |= words[j];
+        }
+        if (acc) return 0;
+    }
+
+    for (; i < len; i++) {
+        if (bytes[i]) return 0;
+    }
+
+    return 1;
+}
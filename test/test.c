@@ -0,0 +1,191 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blob.h"
+
+/*
+ * Regression tests for the blobstore library. Every case formats a fresh
+ * blobstore on a RAM disk, and the first failed check ends the run with a
+ * nonzero status.
+ */
+
+#define TEST_DEVICE_SIZE (64ULL << 20)
+
+static int n_cases = 0;
+
+static void fail(const char *name, const char *msg) {
+    fprintf(stderr, "%s: %s\n", name, msg);
+    exit(1);
+}
+
+static void test_format(const char *name, bdev_t *dev, blobstore_t *bs) {
+    if (bdev_open(dev, BDEV_RAM_PREFIX, TEST_DEVICE_SIZE) < 0) fail(name, "failed to open device");
+    if (blobstore_init(bs, dev) < 0) fail(name, "failed to create blobstore");
+}
+
+static void test_close(bdev_t *dev, blobstore_t *bs) {
+    blobstore_deinit(bs);
+    bdev_close(dev);
+}
+
+/**
+ * Check that the bytes [`offset`, `offset + len`) of `blob` all hold `value`.
+ */
+static void check_content(const char *name, blobstore_t *bs, blob_t *blob, uint64_t offset, uint64_t len,
+                          int value) {
+    uint8_t *buf = aligned_alloc(4096, len);
+    if (buf == NULL) fail(name, "failed to allocate buffer");
+    if (blob_read(bs, blob, buf, offset, len) < 0) fail(name, "failed to read blob");
+    for (uint64_t i = 0; i < len; i++) {
+        if (buf[i] != value) fail(name, "unexpected blob content");
+    }
+    free(buf);
+}
+
+/**
+ * Unmap a whole blob, so that its cluster map becomes empty, and let another
+ * blob reuse the metadata pages it gave up. After a reopen, the first blob
+ * must read back as zeros and the second one must keep its data.
+ */
+static void test_unmap_reopen(void) {
+    const char *name = "unmap_reopen";
+    bdev_t dev;
+    blobstore_t bs;
+    test_format(name, &dev, &bs);
+
+    uint64_t cluster_size = 1ULL << bs.page_shift << bs.cluster_shift;
+    uint64_t len = 4 * cluster_size;
+    uint8_t *buf = aligned_alloc(4096, len);
+    if (buf == NULL) fail(name, "failed to allocate buffer");
+
+    if (blobstore_create_blob(&bs, 8) < 0) fail(name, "failed to create blob");
+    uint8_t unmapped[16];
+    memcpy(unmapped, bs.head->uuid, 16);
+    memset(buf, 0xaa, len);
+    if (blob_write(&bs, bs.head, buf, 0, len) < 0) fail(name, "failed to write blob");
+    if (blobstore_commit(&bs) < 0) fail(name, "failed to commit");
+
+    if (blob_unmap(&bs, bs.head, 0, 8 * cluster_size) < 0) fail(name, "failed to unmap blob");
+    if (blobstore_commit(&bs) < 0) fail(name, "failed to commit");
+
+    if (blobstore_create_blob(&bs, 8) < 0) fail(name, "failed to create blob");
+    uint8_t written[16];
+    memcpy(written, bs.head->uuid, 16);
+    memset(buf, 0xbb, len);
+    if (blob_write(&bs, bs.head, buf, 0, len) < 0) fail(name, "failed to write blob");
+    if (blobstore_commit(&bs) < 0) fail(name, "failed to commit");
+
+    blobstore_deinit(&bs);
+    if (blobstore_open(&bs, &dev) < 0) fail(name, "failed to open blobstore");
+
+    blob_t *blob = blobstore_lookup(&bs, unmapped);
+    if (blob == NULL) fail(name, "unmapped blob is missing");
+    check_content(name, &bs, blob, 0, len, 0);
+
+    blob = blobstore_lookup(&bs, written);
+    if (blob == NULL) fail(name, "written blob is missing");
+    check_content(name, &bs, blob, 0, len, 0xbb);
+
+    free(buf);
+    test_close(&dev, &bs);
+    n_cases++;
+}
+
+/**
+ * Overwrite part of a clone, so that the clusters it shares with its parent
+ * are copied, and reopen. The parent must keep its data and the clone must
+ * read back the new data over the old.
+ */
+static void test_clone_write(void) {
+    const char *name = "clone_write";
+    bdev_t dev;
+    blobstore_t bs;
+    test_format(name, &dev, &bs);
+
+    uint64_t cluster_size = 1ULL << bs.page_shift << bs.cluster_shift;
+    uint64_t len = 4 * cluster_size;
+    uint8_t *buf = aligned_alloc(4096, len);
+    if (buf == NULL) fail(name, "failed to allocate buffer");
+
+    if (blobstore_create_blob(&bs, 4) < 0) fail(name, "failed to create blob");
+    uint8_t parent[16];
+    memcpy(parent, bs.head->uuid, 16);
+    memset(buf, 0xaa, len);
+    if (blob_write(&bs, bs.head, buf, 0, len) < 0) fail(name, "failed to write blob");
+    if (blobstore_commit(&bs) < 0) fail(name, "failed to commit");
+
+    if (blob_clone(&bs, bs.head) < 0) fail(name, "failed to clone blob");
+    uint8_t clone[16];
+    memcpy(clone, bs.head->uuid, 16);
+    if (memcmp(clone, parent, 16) == 0) fail(name, "clone is not the head blob");
+    memset(buf, 0xbb, len);
+    if (blob_write(&bs, bs.head, buf, cluster_size / 2, 2 * cluster_size) < 0) fail(name, "failed to write clone");
+    if (blobstore_commit(&bs) < 0) fail(name, "failed to commit");
+
+    blobstore_deinit(&bs);
+    if (blobstore_open(&bs, &dev) < 0) fail(name, "failed to open blobstore");
+
+    blob_t *blob = blobstore_lookup(&bs, parent);
+    if (blob == NULL) fail(name, "parent blob is missing");
+    check_content(name, &bs, blob, 0, len, 0xaa);
+
+    blob = blobstore_lookup(&bs, clone);
+    if (blob == NULL) fail(name, "clone is missing");
+    check_content(name, &bs, blob, 0, cluster_size / 2, 0xaa);
+    check_content(name, &bs, blob, cluster_size / 2, 2 * cluster_size, 0xbb);
+    check_content(name, &bs, blob, 5 * cluster_size / 2, 3 * cluster_size / 2, 0xaa);
+
+    free(buf);
+    test_close(&dev, &bs);
+    n_cases++;
+}
+
+/**
+ * Create and delete more blobs between two commits than a journal
+ * transaction holds, so that operations have to commit the earlier ones to
+ * make room, and reopen. Exactly the blobs that were not deleted must be
+ * found.
+ */
+static void test_large_batch(void) {
+    const char *name = "large_batch";
+    bdev_t dev;
+    blobstore_t bs;
+    test_format(name, &dev, &bs);
+
+    size_t n = 1500;
+    uint8_t (*uuids)[16] = malloc(n * 16);
+    if (uuids == NULL) fail(name, "failed to allocate uuids");
+    for (size_t i = 0; i < n; i++) {
+        if (blobstore_create_blob(&bs, 1) < 0) fail(name, "failed to create blob");
+        memcpy(uuids[i], bs.head->uuid, 16);
+    }
+    for (size_t i = 0; i < n; i += 2) {
+        if (blobstore_delete_blob(&bs, blobstore_lookup(&bs, uuids[i])) < 0) fail(name, "failed to delete blob");
+    }
+    if (blobstore_commit(&bs) < 0) fail(name, "failed to commit");
+
+    blobstore_deinit(&bs);
+    if (blobstore_open(&bs, &dev) < 0) fail(name, "failed to open blobstore");
+
+    for (size_t i = 0; i < n; i++) {
+        blob_t *blob = blobstore_lookup(&bs, uuids[i]);
+        if (i % 2 == 0 && blob) fail(name, "deleted blob is present");
+        if (i % 2 == 1 && blob == NULL) fail(name, "blob is missing");
+    }
+
+    free(uuids);
+    test_close(&dev, &bs);
+    n_cases++;
+}
+
+int main(void) {
+    test_unmap_reopen();
+    test_clone_write();
+    test_large_batch();
+
+    printf("%d cases passed\n", n_cases);
+    return 0;
+}